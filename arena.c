@@ -0,0 +1,107 @@
+#include <stdalign.h>
+#include <string.h>
+
+#include "arena.h"
+#include "mem.h"
+
+struct arena_chunk
+{
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+static struct arena_chunk *new_chunk(size_t size)
+{
+  struct arena_chunk *c = mem_malloc(MEM_DOC, sizeof(struct arena_chunk) + size);
+
+  if (c == NULL)
+    return NULL;
+
+  c->next = NULL;
+  c->size = size;
+  c->used = 0;
+
+  return c;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+  struct arena_chunk *c = a->head;
+  void *ptr;
+
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+  if (c == NULL || c->size - c->used < size)
+  {
+    /* Large allocations get a chunk of their own behind the current
+     * one, so the space left in it is not wasted */
+    if (size > ARENA_CHUNK_SIZE / 4 && c != NULL)
+    {
+      struct arena_chunk *big = new_chunk(size);
+
+      if (big == NULL)
+	return NULL;
+
+      big->used = size;
+      big->next = c->next;
+      c->next = big;
+
+      return big->data;
+    }
+
+    if ((c = new_chunk(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE)) == NULL)
+      return NULL;
+
+    c->next = a->head;
+    a->head = c;
+  }
+
+  ptr = (char *) c->data + c->used;
+  c->used += size;
+
+  return ptr;
+}
+
+char *arena_strndup(struct arena *a, const char *str, size_t len)
+{
+  char *dup = arena_alloc(a, len + 1);
+
+  if (dup != NULL)
+  {
+    memcpy(dup, str, len);
+    dup[len] = 0;
+  }
+
+  return dup;
+}
+
+/* Release everything, keeping one standard chunk for the next page */
+void arena_reset(struct arena *a)
+{
+  struct arena_chunk *c = a->head, *next, *keep = NULL;
+
+  for (; c != NULL; c = next)
+  {
+    next = c->next;
+
+    if (keep == NULL && c->size == ARENA_CHUNK_SIZE)
+    {
+      keep = c;
+      keep->used = 0;
+      keep->next = NULL;
+    }
+    else
+      mem_free(c);
+  }
+
+  a->head = keep;
+}
+
+void arena_free(struct arena *a)
+{
+  arena_reset(a);
+  mem_free(a->head);
+  a->head = NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (64*1024)
+
+struct arena_chunk;
+
+/* Bump allocator, everything in it is released at once */
+struct arena
+{
+  struct arena_chunk *head;
+};
+
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strndup(struct arena *a, const char *str, size_t len);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+#endif /* _ARENA_H */
@@ -0,0 +1,618 @@
+#define _GNU_SOURCE /* posix_openpt() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "config.h"
+#include "stats.h"
+#include "url_parser.h"
+#include "export.h"
+#include "gemtext.h"
+#include "pool.h"
+#include "mem.h"
+
+static void print_row(char *name, struct histogram *h)
+{
+  printf("%-10s %8lu %8lu %8lu %8lu\n", name,
+	 (unsigned long) hist_mean(h),
+	 (unsigned long) hist_percentile(h, 0.50),
+	 (unsigned long) hist_percentile(h, 0.99),
+	 (unsigned long) h->max);
+}
+
+/* Connects and handshakes count times without sending a request, so
+ * suite and curve preferences can be compared against one server */
+int bench_handshake(struct session *s, char *url, int count)
+{
+  char with_scheme[1024];
+  char host[255], port[10];
+  char suite[100] = "", version[20] = "";
+  struct histogram connect_us, handshake_us;
+  int failed = 0;
+  uint64_t start, connected, done, total = 0;
+
+  if (!strstr(url, "://"))
+  {
+    snprintf(with_scheme, sizeof(with_scheme), "gemini://%s", url);
+    url = with_scheme;
+  }
+
+  if (url_address(url, host, sizeof(host), port, sizeof(port)) < 0)
+  {
+    fprintf(stderr, "Bad URL: %s\n", url);
+    return 1;
+  }
+
+  memset(&connect_us, 0, sizeof(connect_us));
+  memset(&handshake_us, 0, sizeof(handshake_us));
+
+  for (int i = 0; i < count; i++)
+  {
+    struct conn conn;
+    struct trace trace;
+    mbedtls_ssl_context ssl;
+    const char *phase;
+
+    trace_begin(&trace, url);
+
+    if (dial(&conn, &ssl, s, host, port, 0, NULL, &trace, &phase) != 0)
+    {
+      close_conn(&conn, &ssl);
+      failed++;
+      continue;
+    }
+
+    start = trace.start;
+    connected = trace.marks[PHASE_CONNECT];
+    done = trace.marks[PHASE_HANDSHAKE];
+
+    if (suite[0] == 0)
+    {
+      snprintf(suite, sizeof(suite), "%s", mbedtls_ssl_get_ciphersuite(&ssl));
+      snprintf(version, sizeof(version), "%s", mbedtls_ssl_get_version(&ssl));
+    }
+
+    hist_record(&connect_us, connected - start);
+    hist_record(&handshake_us, done - connected);
+    total += done - start;
+
+    close_conn(&conn, &ssl);
+  }
+
+  printf("%s:%s  %d handshakes, %d failed\n", host, port, count - failed, failed);
+  printf("tls_ciphers %s, tls_curves %s\n", cfg.tls_ciphers, cfg.tls_curves);
+  printf("negotiated  %s %s\n", version, suite);
+
+  if (handshake_us.total == 0)
+    return 1;
+
+  printf("%-10s %8s %8s %8s %8s  (us)\n", "", "mean", "p50", "p99", "max");
+  print_row("connect", &connect_us);
+  print_row("handshake", &handshake_us);
+  printf("%.1f handshakes/s\n", handshake_us.total * 1e6 / total);
+
+  return failed > 0;
+}
+
+static double rate(uint64_t bytes, uint64_t us)
+{
+  return us ? bytes / 1048576.0 / (us / 1e6) : 0;
+}
+
+/* Converts path to /dev/null, after reading it once on its own so the
+ * conversion can be compared with plain I/O on a warm page cache */
+int bench_jsonl(char *path)
+{
+  FILE *fp, *out;
+  char *buf;
+  uint64_t bytes = 0, start, read_us, convert_us;
+  int64_t lines;
+  size_t ret;
+
+  if ((fp = fopen(path, "r")) == NULL || (buf = mem_malloc(MEM_RECV, 1 << 20)) == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+
+  start = trace_now();
+  while ((ret = fread(buf, 1, 1 << 20, fp)) > 0)
+    bytes += ret;
+  read_us = trace_now() - start;
+
+  mem_free(buf);
+  fclose(fp);
+
+  if ((out = fopen("/dev/null", "w")) == NULL)
+    return 1;
+  setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+  start = trace_now();
+  lines = export_file(path, out);
+  fflush(out);
+  convert_us = trace_now() - start;
+
+  fclose(out);
+
+  if (lines < 0)
+    return 1;
+
+  printf("%s  %.1f MiB, %ld lines\n", path, bytes / 1048576.0, (long) lines);
+  printf("read       %8.1f MiB/s\n", rate(bytes, read_us));
+  printf("to-jsonl   %8.1f MiB/s  %.1f M lines/s\n", rate(bytes, convert_us),
+	 convert_us ? lines / (convert_us / 1e6) / 1e6 : 0);
+
+  return 0;
+}
+
+/* Parses path as gemtext from memory until a second has passed, at
+ * least BENCH_PARSE_RUNS times, reporting the newline scan in use */
+#define BENCH_PARSE_RUNS 5
+#define BENCH_PARSE_US 1000000
+
+int bench_parse(char *path)
+{
+  struct document doc;
+  struct arena page = {0};
+  uint64_t start, us = 0;
+  size_t len = 0, ret;
+  char *text;
+  FILE *fp;
+  int runs = 0;
+
+  if ((fp = fopen(path, "r")) == NULL)
+  {
+    perror(path);
+    return 1;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  rewind(fp);
+
+  if ((text = mem_malloc(MEM_RECV, len + 1)) == NULL
+      || (ret = fread(text, 1, len, fp)) != len)
+  {
+    perror(path);
+    mem_free(text);
+    fclose(fp);
+    return 1;
+  }
+  fclose(fp);
+
+  while (runs < BENCH_PARSE_RUNS || us < BENCH_PARSE_US)
+  {
+    arena_reset(&page);
+    start = trace_now();
+    doc_parse(&doc, &page, text, len, true);
+    us += trace_now() - start;
+    runs++;
+  }
+
+  printf("%s  %.1f MiB, %zu lines, %zu links\n", path, len / 1048576.0,
+	 doc.lines_len, doc.links_len);
+  if (len >= PARSE_PARALLEL && pool_size() > 1)
+    printf("scan       %s, in chunks on %zu threads\n", doc_parse_path(), pool_size());
+  else
+    printf("scan       %s\n", doc_parse_path());
+  printf("doc_parse  %8.1f MiB/s  %.1f M lines/s, %d runs\n", rate((uint64_t) len * runs, us),
+	 us ? doc.lines_len * runs / (us / 1e6) / 1e6 : 0, runs);
+
+  arena_free(&page);
+  mem_free(text);
+
+  return 0;
+}
+
+/* URLs as pages link them: absolute, relative, with dot segments,
+ * queries, escapes, IPv6 hosts and ports */
+static const char *bench_urls[] =
+{
+  "gemini://gemini.circumlunar.space/",
+  "gemini://geminiprotocol.net/docs/specification.gmi",
+  "gemini://example.org:1966/a/b/../c/./d.gmi?q=1#top",
+  "gemini://[::1]:1965/path/to/page.gmi",
+  "gemini://Example.ORG/%7Euser/caf%C3%A9.gmi",
+  "titan://example.org/upload.gmi;size=10;mime=text/plain",
+  "https://example.com/index.html",
+  "../sibling/page.gmi",
+  "./here.gmi",
+  "/absolute/path.gmi?query",
+  "#fragment",
+  "?only=query",
+  "//other.host/path",
+  "deep/er/and/deeper/page.gmi",
+};
+
+static const char bench_base[] = "gemini://example.org/dir/sub/page.gmi?x=1";
+
+#define BENCH_URL_ROUNDS 200000
+
+static void bench_url_row(char *name, uint64_t ops, uint64_t us)
+{
+  printf("%-14s %10.0f ops/s  %6.1f ns/op\n", name,
+	 us ? ops * 1e6 / us : 0, ops ? us * 1e3 / ops : 0);
+}
+
+/* Times url_parse, url_resolve against a page and url_normalize over
+ * bench_urls, BENCH_URL_ROUNDS times each */
+int bench_url()
+{
+  size_t n = sizeof(bench_urls) / sizeof(bench_urls[0]), lens[n];
+  struct url_view view;
+  char out[1025];
+  uint64_t start, ops = (uint64_t) BENCH_URL_ROUNDS * n;
+  volatile int sink = 0;
+
+  for (size_t i = 0; i < n; i++)
+    lens[i] = strlen(bench_urls[i]);
+
+  printf("%zu URLs, %d rounds\n", n, BENCH_URL_ROUNDS);
+
+  start = trace_now();
+  for (int r = 0; r < BENCH_URL_ROUNDS; r++)
+    for (size_t i = 0; i < n; i++)
+      sink += url_parse(bench_urls[i], lens[i], &view);
+  bench_url_row("url_parse", ops, trace_now() - start);
+
+  start = trace_now();
+  for (int r = 0; r < BENCH_URL_ROUNDS; r++)
+    for (size_t i = 0; i < n; i++)
+      sink += url_resolve(bench_base, bench_urls[i], out, sizeof(out));
+  bench_url_row("url_resolve", ops, trace_now() - start);
+
+  start = trace_now();
+  for (int r = 0; r < BENCH_URL_ROUNDS; r++)
+    for (size_t i = 0; i < n; i++)
+      sink += url_normalize(bench_urls[i], out, sizeof(out));
+  bench_url_row("url_normalize", ops, trace_now() - start);
+
+  return 0;
+}
+
+/* Keystroke replay: the client runs on a pseudo-terminal and every key
+ * of a script is timed from being written to the end of what it drew.
+ * A response ends with the status line's erase once nothing follows it
+ * for KEYS_SETTLE_US and the page is not loading. */
+#define KEYS_SETTLE_US 20000
+#define KEYS_TIMEOUT_US 10000000
+#define KEYS_LABELS 32
+
+static const char keys_script[] =
+  "# label  action  argument\n"
+  "hold     repeat 200 j\n"
+  "back     repeat 100 k\n"
+  "page     repeat 20 ^F\n"
+  "bottom   type G\n"
+  "top      type gg\n"
+  "jump     type 500G\n"
+  "search   type /the\\n\n"
+  "next     repeat 20 n\n"
+  "resize   resize 40 120\n"
+  "resize   resize 24 80\n"
+  "hold     repeat 50 j\n"
+  "help     type ?\n";
+
+struct key_label
+{
+  char name[16];
+  struct histogram latency_us;
+  uint64_t keys;
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t timeouts;
+};
+
+struct key_run
+{
+  int fd;
+  pid_t pid;
+  struct winsize ws;
+  struct key_label labels[KEYS_LABELS];
+  int labels_len;
+};
+
+/* Steps pattern along one byte of output */
+static bool match_step(const char *pattern, size_t *state, char c)
+{
+  if (c == pattern[*state])
+    (*state)++;
+  else
+    *state = c == pattern[0];
+
+  if (pattern[*state] != 0)
+    return false;
+
+  *state = 0;
+  return true;
+}
+
+/* Reads what the client draws after a key. Returns when the frame that
+ * finished it ended, 0 on a timeout or when the client is gone. */
+static uint64_t keys_wait(struct key_run *run, struct key_label *label)
+{
+  char buf[65536];
+  size_t clear = 0, load = 0, erase = 0;
+  uint64_t start = trace_now(), end = 0, now;
+  uint64_t frames = 0;
+  bool loading = false;
+  ssize_t n;
+
+  for (;;)
+  {
+    struct pollfd pfd = { .fd = run->fd, .events = POLLIN };
+    int ms = end ? KEYS_SETTLE_US / 1000 : 10;
+
+    if (poll(&pfd, 1, ms) == 0)
+    {
+      now = trace_now();
+
+      if (end && !loading)
+	break;
+      if (now - start > KEYS_TIMEOUT_US)
+	return 0;
+      continue;
+    }
+
+    if ((n = read(run->fd, buf, sizeof(buf))) <= 0)
+      return 0;
+
+    now = trace_now();
+    label->bytes += n;
+    end = 0;
+
+    for (ssize_t i = 0; i < n; i++)
+    {
+      if (match_step("\e[2J", &clear, buf[i]))
+      {
+	frames++;
+	loading = false;
+      }
+      if (match_step("\e[3JLoading ", &load, buf[i]))
+	loading = true;
+      if (match_step("\e[K", &erase, buf[i]) && i == n - 1)
+	end = now;
+    }
+  }
+
+  /* Only the status line changed, still a paint */
+  label->frames += frames ? frames : 1;
+
+  return end;
+}
+
+static struct key_label *keys_label(struct key_run *run, char *name)
+{
+  struct key_label *l;
+
+  for (int i = 0; i < run->labels_len; i++)
+    if (!strcmp(run->labels[i].name, name))
+      return &run->labels[i];
+
+  if (run->labels_len == KEYS_LABELS)
+    return &run->labels[KEYS_LABELS - 1];
+
+  l = &run->labels[run->labels_len++];
+  snprintf(l->name, sizeof(l->name), "%s", name);
+
+  return l;
+}
+
+static void keys_record(struct key_label *label, uint64_t sent, uint64_t end)
+{
+  label->keys++;
+
+  if (end == 0)
+    label->timeouts++;
+  else
+    hist_record(&label->latency_us, end - sent);
+}
+
+/* Writes keys one at a time, each timed on its own */
+static void keys_type(struct key_run *run, struct key_label *label, char *keys, size_t len)
+{
+  uint64_t sent;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    sent = trace_now();
+    if (write(run->fd, keys + i, 1) != 1)
+      return;
+    keys_record(label, sent, keys_wait(run, label));
+  }
+}
+
+/* \n, \e, \t, \\ and ^X for control keys */
+static size_t keys_unescape(char *s)
+{
+  size_t n = 0;
+
+  for (size_t i = 0; s[i]; i++)
+  {
+    if (s[i] == '\\' && s[i+1])
+    {
+      i++;
+      s[n++] = s[i] == 'n' ? '\n' : s[i] == 'e' ? '\e' : s[i] == 't' ? '\t' : s[i];
+    }
+    else if (s[i] == '^' && s[i+1] >= '@' && s[i+1] <= '_')
+      s[n++] = s[++i] - '@';
+    else
+      s[n++] = s[i];
+  }
+
+  s[n] = 0;
+  return n;
+}
+
+static int keys_spawn(struct key_run *run, char *url)
+{
+  sigset_t none;
+  int slave;
+
+  if ((run->fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+      || grantpt(run->fd) < 0 || unlockpt(run->fd) < 0)
+  {
+    perror("pty");
+    return -1;
+  }
+
+  ioctl(run->fd, TIOCSWINSZ, &run->ws);
+
+  if ((run->pid = fork()) < 0)
+  {
+    perror("fork");
+    return -1;
+  }
+
+  if (run->pid == 0)
+  {
+    /* Resizes are blocked here, the client sets up its own */
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    setsid();
+    if ((slave = open(ptsname(run->fd), O_RDWR)) < 0)
+      _exit(127);
+    ioctl(slave, TIOCSCTTY, 0);
+
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    close(slave);
+    close(run->fd);
+
+    execl("/proc/self/exe", "gemini", url, (char *) NULL);
+    _exit(127);
+  }
+
+  return 0;
+}
+
+static void keys_report(struct key_run *run, char *url, uint64_t us)
+{
+  printf("%s  %.1fs\n", url, us / 1e6);
+  printf("%-8s %6s %8s %8s %8s %8s %7s %10s  (us)\n",
+	 "", "keys", "mean", "p50", "p99", "max", "frames", "bytes/frm");
+
+  for (int i = 0; i < run->labels_len; i++)
+  {
+    struct key_label *l = &run->labels[i];
+
+    printf("%-8s %6lu %8lu %8lu %8lu %8lu %7lu %10lu", l->name,
+	   (unsigned long) l->keys,
+	   (unsigned long) hist_mean(&l->latency_us),
+	   (unsigned long) hist_percentile(&l->latency_us, 0.50),
+	   (unsigned long) hist_percentile(&l->latency_us, 0.99),
+	   (unsigned long) l->latency_us.max,
+	   (unsigned long) l->frames,
+	   (unsigned long) (l->frames ? l->bytes / l->frames : 0));
+
+    if (l->timeouts)
+      printf("  %lu timed out", (unsigned long) l->timeouts);
+    putchar('\n');
+  }
+}
+
+/* Replays script, or a default one, against the client showing url */
+int bench_keys(char *url, char *script)
+{
+  static struct key_run run;
+  static struct key_label quit;
+  char line[1024], *label, *action, *arg;
+  FILE *fp;
+  uint64_t start, sent;
+  int status, failed = 0;
+
+  if (script != NULL)
+    fp = fopen(script, "r");
+  else
+    fp = fmemopen((void *) keys_script, strlen(keys_script), "r");
+
+  if (fp == NULL)
+  {
+    perror(script);
+    return 1;
+  }
+
+  run.ws.ws_row = 24;
+  run.ws.ws_col = 80;
+
+  start = sent = trace_now();
+  if (keys_spawn(&run, url) < 0)
+    return 1;
+
+  /* Start up to the first paint of the page */
+  label = "start";
+  keys_record(keys_label(&run, label), sent, keys_wait(&run, keys_label(&run, label)));
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    struct key_label *l;
+    int count = 1;
+
+    label = strtok(line, " \t\r\n");
+    if (label == NULL || label[0] == '#')
+      continue;
+
+    action = strtok(NULL, " \t\r\n");
+    arg = strtok(NULL, "\r\n");
+    if (action == NULL)
+      continue;
+    while (arg != NULL && (*arg == ' ' || *arg == '\t'))
+      arg++;
+
+    l = keys_label(&run, label);
+
+    if (!strcmp(action, "resize") && arg != NULL)
+    {
+      /* The kernel tells the client with SIGWINCH */
+      sscanf(arg, "%hu %hu", &run.ws.ws_row, &run.ws.ws_col);
+      sent = trace_now();
+      ioctl(run.fd, TIOCSWINSZ, &run.ws);
+      keys_record(l, sent, keys_wait(&run, l));
+    }
+    else if (!strcmp(action, "repeat") && arg != NULL)
+    {
+      count = strtol(arg, &arg, 10);
+      while (*arg == ' ' || *arg == '\t')
+	arg++;
+
+      size_t len = keys_unescape(arg);
+      for (int i = 0; i < count; i++)
+	keys_type(&run, l, arg, len);
+    }
+    else if (!strcmp(action, "type") && arg != NULL)
+      keys_type(&run, l, arg, keys_unescape(arg));
+    else
+      fprintf(stderr, "Unknown step: %s %s\n", label, action);
+  }
+
+  fclose(fp);
+
+  /* Quit, reading what the client writes on the way out */
+  if (write(run.fd, "\eq", 2) == 2)
+    keys_wait(&run, &quit);
+
+  keys_report(&run, url, trace_now() - start);
+
+  if (waitpid(run.pid, &status, WNOHANG) == 0)
+  {
+    kill(run.pid, SIGTERM);
+    waitpid(run.pid, &status, 0);
+  }
+  close(run.fd);
+
+  for (int i = 0; i < run.labels_len; i++)
+    failed += run.labels[i].timeouts > 0;
+
+  return failed > 0;
+}
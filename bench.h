@@ -0,0 +1,12 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "net.h"
+
+int bench_handshake(struct session *s, char *url, int count);
+int bench_jsonl(char *path);
+int bench_parse(char *path);
+int bench_url();
+int bench_keys(char *url, char *script);
+
+#endif /* _BENCH_H */
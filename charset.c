@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include "charset.h"
+#include "utf8.h"
+
+enum charset_kind
+{
+  CHARSET_TABLE,
+  CHARSET_ICONV
+};
+
+/* Converted text is gathered here before it goes to the body */
+#define CHARSET_OUT 16384
+
+/* ASCII runs at least this long skip the staging buffer */
+#define CHARSET_DIRECT 256
+
+/* windows-1252 in 0x80-0x9F, holes are U+FFFD */
+static const uint16_t cp1252_c1[32] =
+{
+  0x20AC, 0xFFFD, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+  0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+  0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+  0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0xFFFD, 0x017E, 0x0178
+};
+
+/* Where ISO-8859-15 differs from ISO-8859-1 */
+static const uint16_t latin9[][2] =
+{
+  { 0xA4, 0x20AC }, { 0xA6, 0x0160 }, { 0xA8, 0x0161 }, { 0xB4, 0x017D },
+  { 0xB8, 0x017E }, { 0xBC, 0x0152 }, { 0xBD, 0x0153 }, { 0xBE, 0x0178 }
+};
+
+/* The charset parameter of a MIME type, lower case and unquoted */
+static bool meta_charset(const char *meta, char *name, size_t len)
+{
+  const char *p = meta;
+  size_t n = 0;
+
+  while ((p = strchr(p, ';')) != NULL)
+  {
+    p++;
+    while (*p == ' ' || *p == '\t')
+      p++;
+
+    if (strncasecmp(p, "charset=", 8))
+      continue;
+
+    p += 8;
+    if (*p == '"')
+      p++;
+
+    while (*p && *p != ';' && *p != '"' && *p != ' ' && *p != '\t' && n + 1 < len)
+    {
+      name[n++] = *p >= 'A' && *p <= 'Z' ? *p + 32 : *p;
+      p++;
+    }
+    name[n] = 0;
+
+    return n > 0;
+  }
+
+  return false;
+}
+
+/* Prepares c for the body of a response with this meta. Returns false
+ * when the body is used as it is: UTF-8, US-ASCII, no charset, or one
+ * this system cannot convert. */
+bool charset_open(struct charset *c, const char *meta)
+{
+  char name[64];
+  size_t i;
+
+  if (!meta_charset(meta, name, sizeof(name)))
+    return false;
+
+  if (!strcmp(name, "utf-8") || !strcmp(name, "utf8")
+      || !strcmp(name, "us-ascii") || !strcmp(name, "ascii"))
+    return false;
+
+  c->pending_len = 0;
+
+  for (i = 0; i < 128; i++)
+    c->high[i] = 0x80 + i < 0xA0 ? 0xFFFD : 0x80 + i;
+
+  /* Like browsers, Latin-1 labels get windows-1252: text declared as
+   * Latin-1 nearly always means it, and C1 controls are not printed */
+  if (!strcmp(name, "windows-1252") || !strcmp(name, "cp1252")
+      || !strcmp(name, "iso-8859-1") || !strcmp(name, "iso8859-1")
+      || !strcmp(name, "iso_8859-1") || !strcmp(name, "latin1")
+      || !strcmp(name, "l1"))
+  {
+    memcpy(c->high, cp1252_c1, sizeof(cp1252_c1));
+    c->kind = CHARSET_TABLE;
+    return true;
+  }
+
+  if (!strcmp(name, "iso-8859-15") || !strcmp(name, "iso8859-15")
+      || !strcmp(name, "latin9") || !strcmp(name, "latin-9"))
+  {
+    for (i = 0; i < sizeof(latin9) / sizeof(latin9[0]); i++)
+      c->high[latin9[i][0] - 0x80] = latin9[i][1];
+    c->kind = CHARSET_TABLE;
+    return true;
+  }
+
+  if ((c->cd = iconv_open("UTF-8", name)) == (iconv_t) -1)
+    return false;
+
+  c->kind = CHARSET_ICONV;
+  return true;
+}
+
+static size_t utf8_encode(uint32_t cp, char *out)
+{
+  if (cp < 0x80)
+  {
+    out[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800)
+  {
+    out[0] = 0xC0 | cp >> 6;
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+  out[0] = 0xE0 | cp >> 12;
+  out[1] = 0x80 | (cp >> 6 & 0x3F);
+  out[2] = 0x80 | (cp & 0x3F);
+  return 3;
+}
+
+/* Staging buffer for one call */
+struct out
+{
+  struct spill *body;
+  size_t len;
+  int failed;
+  char buf[CHARSET_OUT];
+};
+
+static void out_flush(struct out *o)
+{
+  if (o->len > 0 && spill_append(o->body, o->buf, o->len) < 0)
+    o->failed = -1;
+  o->len = 0;
+}
+
+static void out_replacement(struct out *o)
+{
+  if (o->len + 3 > sizeof(o->buf))
+    out_flush(o);
+  o->len += utf8_encode(0xFFFD, o->buf + o->len);
+}
+
+/* ASCII is copied in runs found 16/32 bytes at a time, long runs go
+ * straight from the record to the body */
+static void convert_table(struct charset *c, struct out *o,
+			  const char *data, size_t len)
+{
+  size_t i = 0, run;
+
+  while (i < len)
+  {
+    run = ascii_prefix(data + i, len - i);
+
+    if (run >= CHARSET_DIRECT)
+    {
+      out_flush(o);
+      if (spill_append(o->body, data + i, run) < 0)
+	o->failed = -1;
+    }
+    else
+    {
+      if (o->len + run > sizeof(o->buf))
+	out_flush(o);
+      memcpy(o->buf + o->len, data + i, run);
+      o->len += run;
+    }
+    i += run;
+
+    /* Non-ASCII bytes usually come alone, between runs */
+    while (i < len && (unsigned char) data[i] >= 0x80)
+    {
+      if (o->len + 3 > sizeof(o->buf))
+	out_flush(o);
+      o->len += utf8_encode(c->high[(unsigned char) data[i] - 0x80],
+			    o->buf + o->len);
+      i++;
+    }
+  }
+}
+
+/* Converts what it can of *in. Bytes that are not a character are
+ * replaced, an incomplete character at the end is left in *in. */
+static void convert_iconv(struct charset *c, struct out *o,
+			  char **in, size_t *in_len)
+{
+  char *dst;
+  size_t left;
+
+  while (*in_len > 0)
+  {
+    dst = o->buf + o->len;
+    left = sizeof(o->buf) - o->len;
+
+    if (iconv(c->cd, in, in_len, &dst, &left) != (size_t) -1)
+      o->len = dst - o->buf;
+    else
+    {
+      o->len = dst - o->buf;
+
+      if (errno == E2BIG)
+	out_flush(o);
+      else if (errno == EILSEQ)
+      {
+	out_replacement(o);
+	(*in)++;
+	(*in_len)--;
+      }
+      else
+	break;
+    }
+  }
+}
+
+/* Converts one chunk and appends it to out, whatever a character split
+ * across chunks needs is kept for the next call */
+int charset_append(struct charset *c, struct spill *out,
+		   const char *data, size_t len)
+{
+  struct out o = { .body = out };
+  char joined[sizeof(c->pending)];
+  char *in = (char *) data;
+  size_t take, left, used;
+
+  if (c->kind == CHARSET_TABLE)
+  {
+    convert_table(c, &o, data, len);
+    out_flush(&o);
+    return o.failed;
+  }
+
+  /* Finishes the character the last chunk ended inside of */
+  while (c->pending_len > 0 && len > 0)
+  {
+    take = len < sizeof(joined) - c->pending_len ? len : sizeof(joined) - c->pending_len;
+    memcpy(joined, c->pending, c->pending_len);
+    memcpy(joined + c->pending_len, data, take);
+
+    in = joined;
+    left = c->pending_len + take;
+    convert_iconv(c, &o, &in, &left);
+    used = in - joined;
+
+    if (used >= c->pending_len)
+    {
+      data += used - c->pending_len;
+      len -= used - c->pending_len;
+      c->pending_len = 0;
+    }
+    else if (left < sizeof(joined))
+    {
+      /* Still incomplete, and all of the chunk is in it */
+      memmove(c->pending, in, left);
+      c->pending_len = left;
+      out_flush(&o);
+      return o.failed;
+    }
+    else
+    {
+      out_replacement(&o);
+      memmove(c->pending, joined + 1, c->pending_len - 1);
+      c->pending_len--;
+    }
+  }
+
+  in = (char *) data;
+  convert_iconv(c, &o, &in, &len);
+
+  if (len > sizeof(c->pending))
+  {
+    out_replacement(&o);
+    len = 0;
+  }
+  memcpy(c->pending, in, len);
+  c->pending_len = len;
+
+  out_flush(&o);
+  return o.failed;
+}
+
+/* End of the body: a character cut short is replaced, and stateful
+ * encodings get back to their initial state */
+int charset_finish(struct charset *c, struct spill *out)
+{
+  struct out o = { .body = out };
+  char *dst;
+  size_t left;
+
+  if (c->kind == CHARSET_ICONV)
+  {
+    if (c->pending_len > 0)
+      out_replacement(&o);
+    c->pending_len = 0;
+
+    dst = o.buf + o.len;
+    left = sizeof(o.buf) - o.len;
+    iconv(c->cd, NULL, NULL, &dst, &left);
+    o.len = dst - o.buf;
+  }
+
+  out_flush(&o);
+  return o.failed;
+}
+
+void charset_close(struct charset *c)
+{
+  if (c->kind == CHARSET_ICONV)
+    iconv_close(c->cd);
+}
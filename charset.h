@@ -0,0 +1,28 @@
+#ifndef _CHARSET_H
+#define _CHARSET_H
+
+#include <iconv.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spill.h"
+
+/* Converts a body to UTF-8 chunk by chunk as records arrive. Single
+ * byte charsets use a table, anything else goes through iconv. */
+struct charset
+{
+  int kind;              /* enum charset_kind */
+  uint16_t high[128];    /* Code points of bytes 0x80-0xFF */
+  iconv_t cd;
+  char pending[16];      /* Incomplete character left by the last chunk */
+  size_t pending_len;
+};
+
+bool charset_open(struct charset *c, const char *meta);
+int charset_append(struct charset *c, struct spill *out,
+		   const char *data, size_t len);
+int charset_finish(struct charset *c, struct spill *out);
+void charset_close(struct charset *c);
+
+#endif /* _CHARSET_H */
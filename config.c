@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+struct config cfg =
+{
+  .trace_file = "",
+  .stats_file = "",
+  .show_timing = false,
+  .search_case = "smart",
+  .memory_limit = 64 << 20,
+  .download_dir = "downloads",
+  .cache_dir = "cache",
+  .max_redirects = 5,
+  .tls_ciphers = "auto",
+  .tls_curves = "auto",
+  .connect_timeout = 10000,
+  .handshake_timeout = 10000,
+  .first_byte_timeout = 15000,
+  .total_timeout = 60000,
+  .retries = 0,
+  .retry_delay = 500,
+  .render_cache = 8 << 20,
+  .proxy = "",
+  .proxy_listen = "127.0.0.1:1966",
+  .proxy_cert = "proxy.crt",
+  .proxy_key = "proxy.key",
+  .proxy_cache = 64 << 20,
+  .proxy_ttl = 300,
+  .live_after = 3000,
+  .live_buffer = 1 << 20,
+  .live_lines = 5000,
+  .parse_threads = 0,
+  .subscriptions = "subscriptions",
+  .feeds_concurrency = 16,
+  .feeds_per_host = 4,
+};
+
+static bool parse_bool(char *value)
+{
+  return !strcmp(value, "yes") || !strcmp(value, "true") || !strcmp(value, "1");
+}
+
+static void set_string(char *dest, char *value, size_t len)
+{
+  strncpy(dest, value, len-1);
+  dest[len-1] = 0;
+}
+
+/* Bytes, with an optional K, M or G suffix */
+static size_t parse_size(char *value)
+{
+  char *end;
+  size_t size = strtoull(value, &end, 10);
+
+  switch (*end)
+  {
+  case 'G': case 'g':
+    size <<= 10;
+    /* fall through */
+  case 'M': case 'm':
+    size <<= 10;
+    /* fall through */
+  case 'K': case 'k':
+    size <<= 10;
+  }
+
+  return size;
+}
+
+void load_config(char *path)
+{
+  char line[1024];
+  char *key, *value;
+  
+  FILE *fp = fopen(path, "r");
+
+  if (fp == NULL)
+    return;
+
+  /* Lines are "key value", '#' starts a comment */
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    key = strtok(line, " \t\r\n");
+    
+    if (key == NULL || key[0] == '#')
+      continue;
+
+    value = strtok(NULL, "\r\n");
+
+    if (value == NULL)
+      value = "";
+    
+    while (*value == ' ' || *value == '\t')
+      value++;
+    
+    if (!strcmp(key, "trace_file"))
+      set_string(cfg.trace_file, value, sizeof(cfg.trace_file));
+    else if (!strcmp(key, "stats_file"))
+      set_string(cfg.stats_file, value, sizeof(cfg.stats_file));
+    else if (!strcmp(key, "show_timing"))
+      cfg.show_timing = parse_bool(value);
+    else if (!strcmp(key, "search_case"))
+      set_string(cfg.search_case, value, sizeof(cfg.search_case));
+    else if (!strcmp(key, "memory_limit"))
+      cfg.memory_limit = parse_size(value);
+    else if (!strcmp(key, "download_dir"))
+      set_string(cfg.download_dir, value, sizeof(cfg.download_dir));
+    else if (!strcmp(key, "cache_dir"))
+      set_string(cfg.cache_dir, value, sizeof(cfg.cache_dir));
+    else if (!strcmp(key, "max_redirects"))
+      cfg.max_redirects = atoi(value);
+    else if (!strcmp(key, "tls_ciphers"))
+      set_string(cfg.tls_ciphers, value, sizeof(cfg.tls_ciphers));
+    else if (!strcmp(key, "tls_curves"))
+      set_string(cfg.tls_curves, value, sizeof(cfg.tls_curves));
+    else if (!strcmp(key, "connect_timeout"))
+      cfg.connect_timeout = atoi(value);
+    else if (!strcmp(key, "handshake_timeout"))
+      cfg.handshake_timeout = atoi(value);
+    else if (!strcmp(key, "first_byte_timeout"))
+      cfg.first_byte_timeout = atoi(value);
+    else if (!strcmp(key, "total_timeout"))
+      cfg.total_timeout = atoi(value);
+    else if (!strcmp(key, "retries"))
+      cfg.retries = atoi(value);
+    else if (!strcmp(key, "retry_delay"))
+      cfg.retry_delay = atoi(value);
+    else if (!strcmp(key, "render_cache"))
+      cfg.render_cache = parse_size(value);
+    else if (!strcmp(key, "proxy"))
+      set_string(cfg.proxy, value, sizeof(cfg.proxy));
+    else if (!strcmp(key, "proxy_listen"))
+      set_string(cfg.proxy_listen, value, sizeof(cfg.proxy_listen));
+    else if (!strcmp(key, "proxy_cert"))
+      set_string(cfg.proxy_cert, value, sizeof(cfg.proxy_cert));
+    else if (!strcmp(key, "proxy_key"))
+      set_string(cfg.proxy_key, value, sizeof(cfg.proxy_key));
+    else if (!strcmp(key, "proxy_cache"))
+      cfg.proxy_cache = parse_size(value);
+    else if (!strcmp(key, "proxy_ttl"))
+      cfg.proxy_ttl = atoi(value);
+    else if (!strcmp(key, "live_after"))
+      cfg.live_after = atoi(value);
+    else if (!strcmp(key, "live_buffer"))
+      cfg.live_buffer = parse_size(value);
+    else if (!strcmp(key, "live_lines"))
+      cfg.live_lines = atoi(value);
+    else if (!strcmp(key, "parse_threads"))
+      cfg.parse_threads = atoi(value);
+    else if (!strcmp(key, "subscriptions"))
+      set_string(cfg.subscriptions, value, sizeof(cfg.subscriptions));
+    else if (!strcmp(key, "feeds_concurrency"))
+      cfg.feeds_concurrency = atoi(value);
+    else if (!strcmp(key, "feeds_per_host"))
+      cfg.feeds_per_host = atoi(value);
+  }
+
+  fclose(fp);
+}
@@ -0,0 +1,45 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct config
+{
+  char trace_file[256];
+  char stats_file[256];
+  bool show_timing;
+  char search_case[10];
+  size_t memory_limit;   /* Larger responses go to a temporary file */
+  char download_dir[256];
+  char cache_dir[256];   /* Empty disables the persistent caches */
+  int max_redirects;
+  char tls_ciphers[512]; /* "auto" or mbedtls suite names, preferred first */
+  char tls_curves[128];  /* "auto" or curve names, preferred first */
+  int connect_timeout;   /* Milliseconds, 0 for none */
+  int handshake_timeout;
+  int first_byte_timeout;
+  int total_timeout;     /* Request to the end of the page, downloads excepted */
+  int retries;           /* Further attempts after connect failures and 40, 41, 44 */
+  int retry_delay;       /* Milliseconds before the first retry, doubling */
+  size_t render_cache;   /* Bytes of rendered lines kept, 0 disables */
+  char proxy[256];       /* HOST:PORT of a --proxy-serve to fetch through, empty for none */
+  char proxy_listen[256];
+  char proxy_cert[256];  /* PEM files the proxy serves TLS with */
+  char proxy_key[256];
+  size_t proxy_cache;    /* Bytes of complete responses the proxy keeps */
+  int proxy_ttl;         /* Seconds a cached response is served */
+  int live_after;        /* ms a text response may stay open before it is shown live, 0 disables */
+  size_t live_buffer;    /* Bytes kept of a live response */
+  int live_lines;        /* Lines kept of a live response */
+  int parse_threads;     /* Threads parsing and wrapping large pages, 0 for one per core */
+  char subscriptions[256]; /* Feed URLs, one per line */
+  int feeds_concurrency; /* Feeds fetched at once by a refresh */
+  int feeds_per_host;    /* Of those, from the same host */
+};
+
+extern struct config cfg;
+
+void load_config(char *path);
+
+#endif /* _CONFIG_H */
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "download.h"
+#include "url_parser.h"
+#include "config.h"
+#include "trace.h"
+#include "mem.h"
+
+#define DOWNLOAD_BUF (256*1024)
+
+/* An empty meta means text/gemini */
+bool mime_is_text(const char *meta)
+{
+  return meta[0] == 0 || !strncasecmp(meta, "text/", 5);
+}
+
+bool mime_is_gemini(const char *meta)
+{
+  return meta[0] == 0 || !strncasecmp(meta, "text/gemini", 11);
+}
+
+/* Bytes per second */
+double download_rate(struct download *dl)
+{
+  uint64_t us = dl->end > dl->start ? dl->end - dl->start : 1;
+
+  return dl->bytes * 1e6 / us;
+}
+
+/* Last segment of the URL path, or "download" */
+static void file_name(const char *url, char *name, size_t len)
+{
+  struct url_view view;
+  char path[1024];
+  char *base;
+
+  strcpy(name, "download");
+
+  if (url_parse(url, strlen(url), &view) < 0
+      || url_part_copy(&view, view.path, path, sizeof(path)) < 0)
+    return;
+
+  base = strrchr(path, '/');
+  base = base != NULL ? base + 1 : path;
+
+  if (base[0] != 0 && strcmp(base, ".") && strcmp(base, ".."))
+    snprintf(name, len, "%.200s", base);
+}
+
+/* Never overwrites, name.1, name.2, ... are tried instead */
+static int open_file(const char *url, struct download *dl)
+{
+  char name[256];
+  int fd;
+
+  file_name(url, name, sizeof(name));
+  mkdir(cfg.download_dir, 0755);
+
+  for (int i = 0; i < 1000; i++)
+  {
+    if (i == 0)
+      snprintf(dl->path, sizeof(dl->path), "%s/%s", cfg.download_dir, name);
+    else
+      snprintf(dl->path, sizeof(dl->path), "%s/%s.%d", cfg.download_dir, name, i);
+
+    fd = open(dl->path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+    if (fd >= 0 || errno != EEXIST)
+      return fd;
+  }
+
+  return -1;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0)
+  {
+    if ((ret = write(fd, buf, len)) < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+
+    buf += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+/* Progress line for a download in flight, it is read by the UI while
+ * the fetch thread updates it */
+void download_status(struct download *dl, char *out, size_t len)
+{
+  uint64_t start = __atomic_load_n(&dl->start, __ATOMIC_ACQUIRE);
+  uint64_t bytes = __atomic_load_n(&dl->bytes, __ATOMIC_RELAXED);
+  uint64_t us = start && trace_now() > start ? trace_now() - start : 1;
+
+  if (start == 0)
+  {
+    out[0] = 0;
+    return;
+  }
+
+  snprintf(out, len, "Downloading %s: %.1f MiB, %.1f MiB/s", dl->path,
+	   bytes / 1048576.0, bytes * 1e6 / us / 1048576.0);
+}
+
+/* Streams the rest of a response into a file in the download
+ * directory. Records are gathered into one fixed buffer so memory stays
+ * constant and the disk sees large writes. head is what was read along
+ * with the header. */
+int download(mbedtls_ssl_context *ssl, const char *head, size_t head_len,
+	     const char *url, struct download *dl)
+{
+  char *buf;
+  size_t used = 0;
+  int fd, ret;
+
+  memset(dl, 0, sizeof(struct download));
+
+  if ((buf = mem_malloc(MEM_RECV, DOWNLOAD_BUF)) == NULL
+      || (fd = open_file(url, dl)) < 0)
+  {
+    mem_free(buf);
+    dl->failed = true;
+    return -1;
+  }
+
+  __atomic_store_n(&dl->start, trace_now(), __ATOMIC_RELEASE);
+
+  if (write_all(fd, head, head_len) < 0)
+    goto fail;
+  __atomic_store_n(&dl->bytes, head_len, __ATOMIC_RELAXED);
+
+  while (1)
+  {
+    ret = mbedtls_ssl_read(ssl, (unsigned char *) buf + used, DOWNLOAD_BUF - used);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+
+    /* Past the read timeout the file is incomplete */
+    if (ret == MBEDTLS_ERR_SSL_TIMEOUT)
+      goto fail;
+
+    if (ret <= 0)
+      break;
+
+    used += ret;
+    __atomic_fetch_add(&dl->bytes, ret, __ATOMIC_RELAXED);
+
+    if (used == DOWNLOAD_BUF)
+    {
+      if (write_all(fd, buf, used) < 0)
+	goto fail;
+      used = 0;
+    }
+  }
+
+  if (used > 0 && write_all(fd, buf, used) < 0)
+    goto fail;
+
+  if (ret < 0 && ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+    goto fail;
+
+  close(fd);
+  mem_free(buf);
+  dl->end = trace_now();
+
+  return 0;
+
+ fail:
+  close(fd);
+  mem_free(buf);
+  unlink(dl->path);
+  dl->end = trace_now();
+  dl->failed = true;
+
+  return -1;
+}
@@ -0,0 +1,26 @@
+#ifndef _DOWNLOAD_H
+#define _DOWNLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mbedtls/ssl.h>
+
+struct download
+{
+  char path[1024];
+  uint64_t bytes;
+  uint64_t start;    /* trace_now() */
+  uint64_t end;
+  bool failed;
+};
+
+bool mime_is_text(const char *meta);
+bool mime_is_gemini(const char *meta);
+int download(mbedtls_ssl_context *ssl, const char *head, size_t head_len,
+	     const char *url, struct download *dl);
+double download_rate(struct download *dl);
+void download_status(struct download *dl, char *out, size_t len);
+
+#endif /* _DOWNLOAD_H */
@@ -0,0 +1,308 @@
+#include <string.h>
+#include <ctype.h>
+
+#include "export.h"
+#include "gemtext.h"
+#include "json.h"
+#include "config.h"
+#include "mem.h"
+#include "tab.h"
+#include "url_parser.h"
+
+/* Lines longer than the buffer are split, so memory stays bounded
+ * however large the input */
+#define EXPORT_BUF (1 << 20)
+
+static const char *type_names[] =
+{
+  [LINE_TEXT] = "text",
+  [LINE_LINK] = "link",
+  [LINE_PRE] = "pre",
+  [LINE_LIST] = "list",
+  [LINE_QUOTE] = "quote",
+};
+
+/* Lines are built here and written in large blocks. One line's JSON
+ * always fits past the flush threshold. */
+#define OUT_FLUSH EXPORT_BUF
+#define OUT_BUF (OUT_FLUSH + JSON_ESCAPED_MAX(EXPORT_BUF) + 256)
+
+static const char *skip_space(const char *s, const char *end)
+{
+  while (s < end && isspace((unsigned char) *s))
+    s++;
+  return s;
+}
+
+static char *put_u64(char *out, uint64_t n)
+{
+  char digits[20];
+  int i = 0;
+
+  do
+    digits[i++] = '0' + n % 10;
+  while ((n /= 10) > 0);
+
+  while (i > 0)
+    *out++ = digits[--i];
+
+  return out;
+}
+
+/* {"line":N,"type":...} with the markup taken off the text */
+static char *write_line(char *out, uint64_t n, enum line_type type,
+			bool preformatted, const char *line, size_t len)
+{
+  const char *end = line + len, *url, *label;
+  size_t url_len, label_len;
+
+  out = put_u64(stpcpy(out, "{\"line\":"), n);
+
+  switch (type)
+  {
+  case LINE_PRE_TOGGLE:
+    /* The alt text goes on the opening line */
+    if (preformatted)
+    {
+      out = stpcpy(out, ",\"type\":\"pre_start\",\"alt\":");
+      line = skip_space(line + 3, end);
+      out = json_escape(out, line, end - line);
+    }
+    else
+      out = stpcpy(out, ",\"type\":\"pre_end\"");
+    break;
+  case LINE_LINK:
+    line_link(line, len, &url, &url_len, &label, &label_len);
+    out = json_escape(stpcpy(out, ",\"type\":\"link\",\"url\":"), url, url_len);
+    out = json_escape(stpcpy(out, ",\"label\":"), label, label_len);
+    break;
+  case LINE_HEADING:
+  case LINE_SUBHEADING:
+  case LINE_SUBSUBHEADING:
+    out = stpcpy(out, ",\"type\":\"heading\",\"level\":");
+    *out++ = '1' + type - LINE_HEADING;
+    out = stpcpy(out, ",\"text\":");
+    while (line < end && *line == '#')
+      line++;
+    line = skip_space(line, end);
+    out = json_escape(out, line, end - line);
+    break;
+  case LINE_LIST:
+    line += 2;
+    /* fall through */
+  case LINE_QUOTE:
+    if (type == LINE_QUOTE)
+      line = skip_space(line + 1, end);
+    /* fall through */
+  default:
+    out = stpcpy(stpcpy(stpcpy(out, ",\"type\":\""), type_names[type]), "\",\"text\":");
+    out = json_escape(out, line, end - line);
+  }
+
+  return stpcpy(out, "}\n");
+}
+
+/* Converts everything read returns in a single pass, one JSON object per
+ * line. Returns the number of lines, -1 if reading failed. */
+int64_t export_jsonl(export_read_fn read, void *ctx, bool gemini, FILE *out)
+{
+  char *buf = mem_malloc(MEM_RECV, EXPORT_BUF);
+  char *obuf = mem_malloc(MEM_RECV, OUT_BUF), *o = obuf;
+  size_t have = 0, start, len;
+  uint64_t n = 0;
+  bool preformatted = false, eof = false;
+  enum line_type type;
+  char *nl;
+  int ret;
+
+  if (buf == NULL || obuf == NULL)
+  {
+    mem_free(buf);
+    mem_free(obuf);
+    return -1;
+  }
+
+  while (!eof)
+  {
+    if ((ret = read(ctx, buf + have, EXPORT_BUF - have)) < 0)
+      break;
+
+    eof = ret == 0;
+    have += ret;
+    start = 0;
+
+    while (start < have)
+    {
+      nl = memchr(buf + start, '\n', have - start);
+
+      /* Keep an unfinished line for the next read unless it fills
+       * the buffer or nothing more is coming */
+      if (nl == NULL && !eof && (start > 0 || have < EXPORT_BUF))
+	break;
+
+      len = (nl != NULL ? (size_t) (nl - buf) : have) - start;
+      if (len > 0 && buf[start+len-1] == '\r')
+	len--;
+
+      type = gemini ? classify_line(buf + start, len) : LINE_TEXT;
+      if (preformatted && type != LINE_PRE_TOGGLE)
+	type = LINE_PRE;
+      if (type == LINE_PRE_TOGGLE)
+	preformatted = !preformatted;
+
+      o = write_line(o, ++n, type, preformatted, buf + start, len);
+      if (o - obuf > OUT_FLUSH)
+      {
+	fwrite(obuf, 1, o - obuf, out);
+	o = obuf;
+      }
+
+      start = nl != NULL ? (size_t) (nl - buf) + 1 : have;
+    }
+
+    memmove(buf, buf + start, have - start);
+    have -= start;
+  }
+
+  fwrite(obuf, 1, o - obuf, out);
+  mem_free(buf);
+  mem_free(obuf);
+
+  return ret < 0 ? -1 : (int64_t) n;
+}
+
+static int read_fp(void *ctx, char *buf, size_t len)
+{
+  size_t ret = fread(buf, 1, len, ctx);
+
+  return ret == 0 && ferror((FILE *) ctx) ? -1 : (int) ret;
+}
+
+/* "-" is standard input */
+int64_t export_file(char *path, FILE *out)
+{
+  FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  int64_t ret;
+
+  if (fp == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+
+  ret = export_jsonl(read_fp, fp, true, out);
+
+  if (fp != stdin)
+    fclose(fp);
+
+  return ret;
+}
+
+/* The body read with the header comes first */
+struct ssl_reader
+{
+  mbedtls_ssl_context *ssl;
+  const char *head;
+  size_t head_len;
+};
+
+static int read_ssl(void *ctx, char *buf, size_t len)
+{
+  struct ssl_reader *r = ctx;
+  int ret;
+
+  if (r->head_len > 0)
+  {
+    if (len > r->head_len)
+      len = r->head_len;
+    memcpy(buf, r->head, len);
+    r->head += len;
+    r->head_len -= len;
+    return len;
+  }
+
+  do
+    ret = mbedtls_ssl_read(r->ssl, (unsigned char *) buf, len);
+  while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+  if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_SSL_CONN_EOF)
+    return 0;
+
+  return ret;
+}
+
+/* Streams the body straight from the connection, following redirects,
+ * so a response of any size converts without being held */
+int64_t export_url(struct session *s, char *url, FILE *out)
+{
+  char current[1025], request_line[1030];
+  char host[255], port[10], error[100];
+  struct arena page = {0};
+  struct spill head = {0};
+  struct trace trace;
+  struct response *resp;
+  struct conn conn;
+  mbedtls_ssl_context ssl;
+  const char *phase;
+  int64_t ret = -1;
+  int err;
+
+  if (strstr(url, "://") == NULL)
+    snprintf(current, sizeof(current), "gemini://%s", url);
+  else
+    snprintf(current, sizeof(current), "%s", url);
+
+  for (int redirects = 0; ; redirects++)
+  {
+    if (url_normalize(current, request_line, sizeof(request_line) - 2) < 0
+	|| url_address(request_line, host, sizeof(host), port, sizeof(port)) < 0)
+    {
+      fprintf(stderr, "Bad URL: %s\n", current);
+      break;
+    }
+    strcpy(current, request_line);
+    strcat(request_line, "\r\n");
+
+    trace_begin(&trace, current);
+
+    /* No total_timeout, dumps take as long as they take */
+    if ((err = dial(&conn, &ssl, s, host, port, 0, NULL, &trace, &phase)) != 0
+	|| (err = fetch_header(&conn, &ssl, request_line, NULL, &head, &trace, &phase)) != 0
+	|| (resp = read_response_header(head.data, &page)) == NULL)
+    {
+      dial_error(error, sizeof(error), phase, err, host);
+      fprintf(stderr, "%s: %s\n", current, error);
+      close_conn(&conn, &ssl);
+      break;
+    }
+
+    if ((resp->status == 30 || resp->status == 31) && redirects < cfg.max_redirects)
+    {
+      char target[1025];
+
+      if (resolve_link(current, resp->meta, target, sizeof(target)) < 0)
+	snprintf(target, sizeof(target), "%s", resp->meta);
+      strcpy(current, target);
+      close_conn(&conn, &ssl);
+      arena_reset(&page);
+      continue;
+    }
+
+    if (resp->status / 10 != 2 || !mime_is_text(resp->meta))
+      fprintf(stderr, "%s: %d %s\n", current, resp->status, resp->meta);
+    else
+    {
+      struct ssl_reader r = { &ssl, resp->body, head.len - (resp->body - head.data) };
+
+      ret = export_jsonl(read_ssl, &r, mime_is_gemini(resp->meta), out);
+    }
+
+    close_conn(&conn, &ssl);
+    break;
+  }
+
+  arena_free(&page);
+  spill_free(&head);
+
+  return ret;
+}
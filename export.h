@@ -0,0 +1,17 @@
+#ifndef _EXPORT_H
+#define _EXPORT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "net.h"
+
+/* Fills buf with up to len bytes, 0 at the end and < 0 on errors */
+typedef int (*export_read_fn)(void *ctx, char *buf, size_t len);
+
+int64_t export_jsonl(export_read_fn read, void *ctx, bool gemini, FILE *out);
+int64_t export_file(char *path, FILE *out);
+int64_t export_url(struct session *s, char *url, FILE *out);
+
+#endif /* _EXPORT_H */
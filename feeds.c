@@ -0,0 +1,846 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "feeds.h"
+#include "tab.h"
+#include "config.h"
+#include "url_parser.h"
+#include "download.h"
+#include "proxy.h"
+#include "mem.h"
+#include "hash.h"
+
+/* Feeds are gemtext pages listed one URL per line in the subscriptions
+ * file, entries are their links whose label starts with a date, as in
+ * "=> 2024-05-01-post.gmi 2024-05-01 A post". A refresh fetches every
+ * feed on feeds_concurrency threads, at most feeds_per_host at a time
+ * from one host so a large capsule does not hold up the rest. Bodies
+ * hashing the same as last time are not parsed again.
+ *
+ * What was found is kept in DIR/feeds, "F HASH URL TITLE" for a feed
+ * followed by "E DATE URL TITLE" for each of its entries. */
+
+#define FEEDS_THREADS_MAX 64
+#define FEED_ENTRIES_MAX 64
+#define FEEDS_PAGE_ENTRIES 200
+
+enum feed_result
+{
+  FEED_IDLE,         /* Not refreshed yet */
+  FEED_PENDING,
+  FEED_RUNNING,
+  FEED_UNCHANGED,
+  FEED_CHANGED,
+  FEED_FAILED,
+};
+
+struct entry
+{
+  char date[11];
+  char *url;         /* The title is in the same allocation */
+  char *title;
+  bool fresh;        /* Found by the last refresh */
+};
+
+struct feed
+{
+  char *url;
+  char title[128];
+  uint64_t hash;     /* Of the last body, 0 before the first */
+  struct entry *entries;
+  size_t entries_len, entries_size;
+  size_t fresh;
+  bool listed;       /* Still in the subscriptions file */
+  int host;          /* In the refresh's host table */
+  int result;        /* enum feed_result */
+  char error[64];
+};
+
+/* A host feeds are fetched from, for the limit per host and to resume
+ * its TLS session */
+struct host
+{
+  char name[255];
+  char port[10];
+  int busy;
+  struct refresh *refresh;   /* Whose lock guards the session */
+  bool valid;
+  mbedtls_ssl_session session;
+};
+
+struct refresh
+{
+  struct session *session;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;       /* A feed finished, its host has room */
+  struct host *hosts;
+  size_t hosts_len;
+  size_t left;               /* Feeds no thread has taken yet */
+  int per_host;              /* feeds_per_host, at least 1 */
+};
+
+/* Held by a refresh and while the page is written */
+static pthread_mutex_t feeds_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct feed *feeds = NULL;
+static size_t feeds_len = 0, feeds_size = 0;
+static char state_path[512] = "";
+static uint64_t refresh_us = 0;
+static bool refreshed = false;
+
+static void entries_free(struct entry *e, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    mem_free(e[i].url);
+  mem_free(e);
+}
+
+static struct feed *feed_find(const char *url)
+{
+  for (size_t i = 0; i < feeds_len; i++)
+    if (!strcmp(feeds[i].url, url))
+      return &feeds[i];
+
+  return NULL;
+}
+
+static struct feed *feed_add(const char *url)
+{
+  struct feed *f;
+
+  if ((f = feed_find(url)) != NULL)
+    return f;
+
+  if (feeds_len == feeds_size)
+  {
+    size_t size = feeds_size ? feeds_size * 2 : 64;
+    struct feed *tmp = mem_realloc(MEM_DOC, feeds, size * sizeof(struct feed));
+
+    if (tmp == NULL)
+      return NULL;
+    feeds = tmp;
+    feeds_size = size;
+  }
+
+  f = &feeds[feeds_len];
+  memset(f, 0, sizeof(struct feed));
+  if ((f->url = mem_malloc(MEM_DOC, strlen(url) + 1)) == NULL)
+    return NULL;
+  strcpy(f->url, url);
+  feeds_len++;
+
+  return f;
+}
+
+static void entry_add(struct feed *f, const char *date, const char *url,
+		      const char *title, size_t title_len, bool fresh)
+{
+  size_t url_len = strlen(url), size;
+  struct entry *e;
+
+  if (f->entries_len == f->entries_size)
+  {
+    size = f->entries_size ? f->entries_size * 2 : FEED_ENTRIES_MAX;
+    if ((e = mem_realloc(MEM_DOC, f->entries, size * sizeof(struct entry))) == NULL)
+      return;
+    f->entries = e;
+    f->entries_size = size;
+  }
+
+  e = &f->entries[f->entries_len];
+  if ((e->url = mem_malloc(MEM_DOC, url_len + title_len + 2)) == NULL)
+    return;
+
+  memcpy(e->date, date, 10);
+  e->date[10] = 0;
+  memcpy(e->url, url, url_len + 1);
+  e->title = e->url + url_len + 1;
+  memcpy(e->title, title, title_len);
+  e->title[title_len] = 0;
+  e->fresh = fresh;
+
+  if (fresh)
+    f->fresh++;
+  f->entries_len++;
+}
+
+/* YYYY-MM-DD */
+static bool is_date(const char *s, size_t len)
+{
+  if (len < 10 || s[4] != '-' || s[7] != '-')
+    return false;
+
+  for (int i = 0; i < 10; i++)
+    if (i != 4 && i != 7 && !isdigit((unsigned char) s[i]))
+      return false;
+
+  return len == 10 || !isdigit((unsigned char) s[10]);
+}
+
+/* Newest first */
+static int entry_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct entry *) b)->date, ((const struct entry *) a)->date);
+}
+
+/* Sorts the entries and keeps the newest FEED_ENTRIES_MAX, wherever in
+ * the page they were */
+static void entries_keep_newest(struct feed *f)
+{
+  qsort(f->entries, f->entries_len, sizeof(struct entry), entry_cmp);
+
+  for (size_t i = FEED_ENTRIES_MAX; i < f->entries_len; i++)
+  {
+    if (f->entries[i].fresh)
+      f->fresh--;
+    mem_free(f->entries[i].url);
+  }
+
+  if (f->entries_len > FEED_ENTRIES_MAX)
+    f->entries_len = FEED_ENTRIES_MAX;
+}
+
+/* Reads the title and dated links of a changed feed. Entries whose URL
+ * the feed did not have before are fresh, none are on its first fetch. */
+static void parse_feed(struct feed *f, struct arena *page, const char *text, size_t len)
+{
+  struct entry *old = f->entries;
+  size_t old_len = f->entries_len;
+  bool known = f->hash != 0;
+  struct document doc;
+
+  doc_parse(&doc, page, text, len, true);
+
+  f->entries = NULL;
+  f->entries_len = f->entries_size = 0;
+  f->fresh = 0;
+  f->title[0] = 0;
+
+  for (size_t i = 0; i < doc.lines_len; i++)
+  {
+    const char *line = text + doc.lines[i].off, *url, *label;
+    size_t url_len, label_len, skip;
+    char link[1025], abs[1025];
+    bool fresh;
+
+    if (f->title[0] == 0 && doc.lines[i].type == LINE_HEADING)
+    {
+      for (skip = 1; skip < doc.lines[i].len && isspace((unsigned char) line[skip]); skip++)
+	;
+      snprintf(f->title, sizeof(f->title), "%.*s", (int) (doc.lines[i].len - skip), line + skip);
+      continue;
+    }
+
+    if (doc.lines[i].type != LINE_LINK)
+      continue;
+
+    line_link(line, doc.lines[i].len, &url, &url_len, &label, &label_len);
+    if (url_len == 0 || url_len >= sizeof(link) || !is_date(label, label_len))
+      continue;
+
+    memcpy(link, url, url_len);
+    link[url_len] = 0;
+    if (resolve_link(f->url, link, abs, sizeof(abs)) < 0)
+      continue;
+
+    /* The title is what follows the date and its separator */
+    for (skip = 10; skip < label_len
+	   && (isspace((unsigned char) label[skip]) || label[skip] == '-' || label[skip] == ':');
+	 skip++)
+      ;
+
+    fresh = known;
+    for (size_t j = 0; j < old_len && fresh; j++)
+      if (!strcmp(old[j].url, abs))
+	fresh = false;
+
+    entry_add(f, label, abs, label + skip, label_len - skip, fresh);
+  }
+
+  entries_keep_newest(f);
+  entries_free(old, old_len);
+}
+
+static void resume(void *ctx, mbedtls_ssl_context *ssl)
+{
+  struct host *h = ctx;
+
+  pthread_mutex_lock(&h->refresh->lock);
+  if (h->valid)
+    mbedtls_ssl_set_session(ssl, &h->session);
+  pthread_mutex_unlock(&h->refresh->lock);
+}
+
+static void save_session(void *ctx, mbedtls_ssl_context *ssl)
+{
+  struct host *h = ctx;
+
+  pthread_mutex_lock(&h->refresh->lock);
+  if (h->valid)
+    mbedtls_ssl_session_free(&h->session);
+  mbedtls_ssl_session_init(&h->session);
+  h->valid = mbedtls_ssl_get_session(ssl, &h->session) == 0;
+  pthread_mutex_unlock(&h->refresh->lock);
+}
+
+/* HOST and PORT of a gemini:// URL, without the brackets of IPv6 */
+static int url_host(const char *url, char *host, size_t host_len, char *port, size_t port_len)
+{
+  struct url_view view;
+  char scheme[16];
+
+  if (url_parse(url, strlen(url), &view) < 0
+      || url_part_copy(&view, view.scheme, scheme, sizeof(scheme)) <= 0
+      || strcmp(scheme, "gemini"))
+    return -1;
+
+  return url_address(url, host, host_len, port, port_len);
+}
+
+/* Fetches a feed into body, following redirects. Returns the response
+ * or NULL with the feed's error set. */
+static struct response *fetch(struct refresh *r, struct feed *f,
+			      struct arena *page, struct spill *body)
+{
+  char url[1025], next[1025], line[1030], host[255], port[10];
+  char proxy_host[255], proxy_port[10];
+  struct response *resp;
+  struct dial_hooks hooks = {0};
+  struct conn conn;
+  mbedtls_ssl_context ssl;
+  const char *phase;
+  bool proxied = cfg.proxy[0] && proxy_address(cfg.proxy, proxy_host, sizeof(proxy_host),
+					      proxy_port, sizeof(proxy_port)) == 0;
+  int ret;
+
+  snprintf(url, sizeof(url), "%s", f->url);
+
+  for (int redirects = 0; ; redirects++)
+  {
+    /* Sessions are kept for the host the feed is on, redirects
+     * elsewhere do without */
+    struct host *h = &r->hosts[f->host];
+
+    if (url_host(url, host, sizeof(host), port, sizeof(port)) < 0)
+    {
+      snprintf(f->error, sizeof(f->error), "Not a gemini:// URL");
+      return NULL;
+    }
+    if (redirects > 0 && (strcmp(host, h->name) || strcmp(port, h->port)))
+      h = NULL;
+    if (proxied)
+    {
+      strcpy(host, proxy_host);
+      strcpy(port, proxy_port);
+    }
+
+    hooks.ctx = h;
+    hooks.resume = h != NULL ? resume : NULL;
+    hooks.save = h != NULL ? save_session : NULL;
+
+    snprintf(line, sizeof(line), "%s\r\n", url);
+    if ((ret = dial(&conn, &ssl, r->session, host, port, cfg.total_timeout,
+		    &hooks, NULL, &phase)) != 0
+	|| (ret = fetch_header(&conn, &ssl, line, NULL, body, NULL, &phase)) != 0
+	|| (resp = read_response_header(body->data, page)) == NULL)
+    {
+      close_conn(&conn, &ssl);
+      dial_error(f->error, sizeof(f->error), phase, ret, host);
+      return NULL;
+    }
+
+    if (resp->status / 10 == 2 && resp->body != NULL)
+    {
+      size_t head = resp->body - body->data;
+
+      ret = read_response(&ssl, body, NULL, NULL);
+      spill_finish(body);
+      resp->body = body->data + head;
+
+      if (ret == MBEDTLS_ERR_SSL_TIMEOUT)
+      {
+	close_conn(&conn, &ssl);
+	snprintf(f->error, sizeof(f->error), "Timed out");
+	return NULL;
+      }
+    }
+    close_conn(&conn, &ssl);
+
+    if (resp->status / 10 != 3)
+      return resp;
+
+    if (redirects == cfg.max_redirects
+	|| resolve_link(url, resp->meta, next, sizeof(next)) < 0)
+    {
+      snprintf(f->error, sizeof(f->error), "Too many redirects");
+      return NULL;
+    }
+    strcpy(url, next);
+    arena_reset(page);
+  }
+}
+
+static void refresh_feed(struct refresh *r, struct feed *f,
+			 struct arena *page, struct spill *body)
+{
+  struct response *resp = fetch(r, f, page, body);
+  uint64_t hash;
+  size_t len;
+
+  if (resp == NULL)
+    goto fail;
+
+  if (resp->status != 20)
+  {
+    snprintf(f->error, sizeof(f->error), "%d %.50s", resp->status, resp->meta);
+    goto fail;
+  }
+  if (!mime_is_gemini(resp->meta))
+  {
+    snprintf(f->error, sizeof(f->error), "Not gemtext");
+    goto fail;
+  }
+
+  /* Unchanged feeds are done without being parsed */
+  len = body->len - (resp->body - body->data);
+  hash = hash_bytes(resp->body, len);
+  if (hash == f->hash)
+  {
+    f->fresh = 0;
+    for (size_t i = 0; i < f->entries_len; i++)
+      f->entries[i].fresh = false;
+    f->result = FEED_UNCHANGED;
+    return;
+  }
+
+  parse_feed(f, page, resp->body, len);
+  f->hash = hash;
+  f->result = FEED_CHANGED;
+  return;
+
+ fail:
+  f->result = FEED_FAILED;
+}
+
+/* Takes the first feed waiting whose host has room, until none wait */
+static void *refresh_worker(void *arg)
+{
+  struct refresh *r = arg;
+  struct arena page = {0};
+  struct spill body = { .limit = cfg.memory_limit };
+  struct feed *f;
+
+  pthread_mutex_lock(&r->lock);
+
+  while (r->left > 0)
+  {
+    f = NULL;
+    for (size_t i = 0; i < feeds_len && f == NULL; i++)
+      if (feeds[i].result == FEED_PENDING
+	  && r->hosts[feeds[i].host].busy < r->per_host)
+	f = &feeds[i];
+
+    if (f == NULL)
+    {
+      pthread_cond_wait(&r->cond, &r->lock);
+      continue;
+    }
+
+    f->result = FEED_RUNNING;
+    r->hosts[f->host].busy++;
+    r->left--;
+    pthread_mutex_unlock(&r->lock);
+
+    refresh_feed(r, f, &page, &body);
+    arena_reset(&page);
+
+    pthread_mutex_lock(&r->lock);
+    r->hosts[f->host].busy--;
+    pthread_cond_broadcast(&r->cond);
+  }
+
+  pthread_mutex_unlock(&r->lock);
+
+  arena_free(&page);
+  spill_free(&body);
+
+  return NULL;
+}
+
+static int host_index(struct refresh *r, const char *name, const char *port)
+{
+  for (size_t i = 0; i < r->hosts_len; i++)
+    if (!strcmp(r->hosts[i].name, name) && !strcmp(r->hosts[i].port, port))
+      return i;
+
+  snprintf(r->hosts[r->hosts_len].name, sizeof(r->hosts[0].name), "%s", name);
+  snprintf(r->hosts[r->hosts_len].port, sizeof(r->hosts[0].port), "%s", port);
+  r->hosts[r->hosts_len].refresh = r;
+
+  return r->hosts_len++;
+}
+
+static void feeds_save()
+{
+  char tmp[520];
+  FILE *fp;
+
+  if (state_path[0] == 0)
+    return;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", state_path);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return;
+
+  for (size_t i = 0; i < feeds_len; i++)
+  {
+    fprintf(fp, "F %016llx %s %s\n", (unsigned long long) feeds[i].hash,
+	    feeds[i].url, feeds[i].title);
+    for (size_t j = 0; j < feeds[i].entries_len; j++)
+      fprintf(fp, "E %s %s %s\n", feeds[i].entries[j].date,
+	      feeds[i].entries[j].url, feeds[i].entries[j].title);
+  }
+
+  /* Replaced whole, a crash keeps the last state */
+  if (fclose(fp) == 0)
+    rename(tmp, state_path);
+}
+
+static void refresh_all(struct session *s)
+{
+  pthread_t threads[FEEDS_THREADS_MAX];
+  struct refresh r = { .session = s };
+  char host[255], port[10];
+  int n = 0, concurrency;
+
+  /* Limits of 0 or less would leave every feed waiting */
+  r.per_host = cfg.feeds_per_host > 0 ? cfg.feeds_per_host : 1;
+  concurrency = cfg.feeds_concurrency > 0 ? cfg.feeds_concurrency : 1;
+
+  if (feeds_len == 0
+      || (r.hosts = mem_calloc(MEM_DOC, feeds_len, sizeof(struct host))) == NULL)
+    return;
+
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.cond, NULL);
+
+  for (size_t i = 0; i < feeds_len; i++)
+  {
+    feeds[i].error[0] = 0;
+    if (url_host(feeds[i].url, host, sizeof(host), port, sizeof(port)) < 0)
+    {
+      snprintf(feeds[i].error, sizeof(feeds[i].error), "Not a gemini:// URL");
+      feeds[i].result = FEED_FAILED;
+      continue;
+    }
+
+    feeds[i].host = host_index(&r, host, port);
+    feeds[i].result = FEED_PENDING;
+    r.left++;
+  }
+
+  for (size_t i = 0; i < r.left && i < (size_t) concurrency
+	 && i < FEEDS_THREADS_MAX; i++)
+    if (pthread_create(&threads[n], NULL, refresh_worker, &r) == 0)
+      n++;
+
+  /* Without threads the refresh still happens, one feed at a time */
+  if (n == 0)
+    refresh_worker(&r);
+  for (int i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+
+  for (size_t i = 0; i < r.hosts_len; i++)
+    if (r.hosts[i].valid)
+      mbedtls_ssl_session_free(&r.hosts[i].session);
+  mem_free(r.hosts);
+  pthread_cond_destroy(&r.cond);
+  pthread_mutex_destroy(&r.lock);
+
+  feeds_save();
+}
+
+/* One absolute gemini:// URL, without its fragment */
+static int feed_url(const char *in, char *out, size_t len)
+{
+  char host[255], port[10], *fragment;
+
+  if (url_normalize(in, out, len) < 0
+      || url_host(out, host, sizeof(host), port, sizeof(port)) < 0)
+    return -1;
+
+  if ((fragment = strchr(out, '#')) != NULL)
+    *fragment = 0;
+
+  return 0;
+}
+
+/* Brings the list in line with the subscriptions file, which may have
+ * been edited by hand */
+static void read_subscriptions()
+{
+  char line[1100], url[1025];
+  size_t kept = 0;
+  FILE *fp;
+
+  for (size_t i = 0; i < feeds_len; i++)
+    feeds[i].listed = false;
+
+  if ((fp = fopen(cfg.subscriptions, "r")) != NULL)
+  {
+    struct feed *f;
+    char *s;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      s = strtok(line, " \t\r\n");
+      if (s == NULL || s[0] == '#' || feed_url(s, url, sizeof(url)) < 0)
+	continue;
+
+      if ((f = feed_add(url)) != NULL)
+	f->listed = true;
+    }
+
+    fclose(fp);
+  }
+
+  for (size_t i = 0; i < feeds_len; i++)
+    if (feeds[i].listed)
+      feeds[kept++] = feeds[i];
+    else
+    {
+      entries_free(feeds[i].entries, feeds[i].entries_len);
+      mem_free(feeds[i].url);
+    }
+  feeds_len = kept;
+}
+
+/* Reads what the last refresh found */
+void feeds_load(const char *dir)
+{
+  char line[2200];
+  char *hash, *url, *title, *date;
+  struct feed *f = NULL;
+  FILE *fp;
+
+  if (dir[0] == 0)
+    return;
+
+  mkdir(dir, 0755);
+  snprintf(state_path, sizeof(state_path), "%s/feeds", dir);
+
+  if ((fp = fopen(state_path, "r")) == NULL)
+    return;
+
+  pthread_mutex_lock(&feeds_lock);
+
+  while (fgets(line, sizeof(line), fp) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = 0;
+
+    if (!strncmp(line, "F ", 2))
+    {
+      hash = strtok(line + 2, " ");
+      url = strtok(NULL, " ");
+      title = strtok(NULL, "");
+
+      if (hash == NULL || url == NULL || (f = feed_add(url)) == NULL)
+	continue;
+      f->hash = strtoull(hash, NULL, 16);
+      snprintf(f->title, sizeof(f->title), "%s", title != NULL ? title : "");
+    }
+    else if (!strncmp(line, "E ", 2) && f != NULL)
+    {
+      date = strtok(line + 2, " ");
+      url = strtok(NULL, " ");
+      title = strtok(NULL, "");
+
+      /* Saved newest first */
+      if (date != NULL && url != NULL && is_date(date, strlen(date))
+	  && f->entries_len < FEED_ENTRIES_MAX)
+	entry_add(f, date, url, title != NULL ? title : "",
+		  title != NULL ? strlen(title) : 0, false);
+    }
+  }
+
+  pthread_mutex_unlock(&feeds_lock);
+
+  fclose(fp);
+}
+
+/* Adds url to the subscriptions file. Returns 1 when it is there
+ * already, -1 when it is not a gemini:// URL or cannot be written. */
+int feeds_subscribe(const char *url)
+{
+  char line[1100], normal[1025];
+  FILE *fp;
+
+  if (feed_url(url, normal, sizeof(normal)) < 0)
+    return -1;
+
+  if ((fp = fopen(cfg.subscriptions, "r")) != NULL)
+  {
+    char *s, other[1025];
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+      if ((s = strtok(line, " \t\r\n")) != NULL
+	  && feed_url(s, other, sizeof(other)) == 0 && !strcmp(other, normal))
+      {
+	fclose(fp);
+	return 1;
+      }
+
+    fclose(fp);
+  }
+
+  if ((fp = fopen(cfg.subscriptions, "a")) == NULL)
+    return -1;
+  fprintf(fp, "%s\n", normal);
+
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+struct item
+{
+  struct entry *e;
+  struct feed *f;
+};
+
+static int item_cmp(const void *a, const void *b)
+{
+  return entry_cmp(((const struct item *) a)->e, ((const struct item *) b)->e);
+}
+
+static void write_entries(FILE *fp)
+{
+  struct item *items;
+  size_t len = 0;
+
+  for (size_t i = 0; i < feeds_len; i++)
+    len += feeds[i].entries_len;
+
+  if (len == 0)
+  {
+    fputs("No dated links yet\n", fp);
+    return;
+  }
+
+  if ((items = mem_malloc(MEM_DOC, len * sizeof(struct item))) == NULL)
+    return;
+
+  len = 0;
+  for (size_t i = 0; i < feeds_len; i++)
+    for (size_t j = 0; j < feeds[i].entries_len; j++)
+    {
+      items[len].e = &feeds[i].entries[j];
+      items[len++].f = &feeds[i];
+    }
+
+  qsort(items, len, sizeof(struct item), item_cmp);
+
+  for (size_t i = 0; i < len && i < FEEDS_PAGE_ENTRIES; i++)
+    fprintf(fp, "=> %s %s%s %s: %s\n", items[i].e->url, items[i].e->date,
+	    items[i].e->fresh ? " new" : "",
+	    items[i].f->title[0] ? items[i].f->title : items[i].f->url,
+	    items[i].e->title);
+
+  mem_free(items);
+}
+
+static void write_feeds(FILE *fp)
+{
+  for (size_t i = 0; i < feeds_len; i++)
+  {
+    struct feed *f = &feeds[i];
+
+    fprintf(fp, "=> %s %s", f->url, f->title[0] ? f->title : f->url);
+    if (f->result == FEED_CHANGED && f->fresh > 0)
+      fprintf(fp, " (%zu new)", f->fresh);
+    else if (f->result == FEED_FAILED)
+      fprintf(fp, " (%s)", f->error);
+    fputc('\n', fp);
+  }
+}
+
+/* about:feeds, the latest entries of every feed, after refreshing them
+ * all when asked */
+char *feeds_page(char *buf, struct session *s, bool refresh)
+{
+  size_t size, changed = 0, failed = 0, fresh = 0;
+  char *page = NULL;
+  FILE *fp;
+
+  pthread_mutex_lock(&feeds_lock);
+
+  read_subscriptions();
+
+  if (refresh)
+  {
+    uint64_t start = trace_now();
+
+    refresh_all(s);
+    refresh_us = trace_now() - start;
+    refreshed = true;
+  }
+
+  if ((fp = open_memstream(&page, &size)) == NULL)
+  {
+    pthread_mutex_unlock(&feeds_lock);
+    return buf;
+  }
+
+  fputs("# Feeds\n\n", fp);
+
+  for (size_t i = 0; i < feeds_len; i++)
+  {
+    changed += feeds[i].result == FEED_CHANGED;
+    failed += feeds[i].result == FEED_FAILED;
+    fresh += feeds[i].fresh;
+  }
+
+  if (feeds_len == 0)
+    fprintf(fp, "No subscriptions, :subscribe adds the page you are on to %s\n",
+	    cfg.subscriptions);
+  else if (!refreshed)
+    fprintf(fp, "%zu feeds, :refresh fetches them all\n", feeds_len);
+  else
+    fprintf(fp, "%zu feeds refreshed in %.2fs: %zu changed, %zu failed, %zu new entries\n",
+	    feeds_len, refresh_us / 1e6, changed, failed, fresh);
+
+  if (feeds_len > 0)
+  {
+    fputs("\n## Entries\n\n", fp);
+    write_entries(fp);
+    fputs("\n## Subscriptions\n\n", fp);
+    write_feeds(fp);
+  }
+
+  fclose(fp);
+
+  pthread_mutex_unlock(&feeds_lock);
+
+  buf = mem_realloc(MEM_RECV, buf, size+1);
+  memcpy(buf, page, size+1);
+  free(page);
+
+  return buf;
+}
+
+void feeds_free()
+{
+  pthread_mutex_lock(&feeds_lock);
+
+  for (size_t i = 0; i < feeds_len; i++)
+  {
+    entries_free(feeds[i].entries, feeds[i].entries_len);
+    mem_free(feeds[i].url);
+  }
+  mem_free(feeds);
+  feeds = NULL;
+  feeds_len = feeds_size = 0;
+
+  pthread_mutex_unlock(&feeds_lock);
+}
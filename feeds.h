@@ -0,0 +1,11 @@
+#ifndef _FEEDS_H
+#define _FEEDS_H
+
+#include "net.h"
+
+void feeds_load(const char *dir);
+int feeds_subscribe(const char *url);
+char *feeds_page(char *buf, struct session *s, bool refresh);
+void feeds_free();
+
+#endif /* _FEEDS_H */
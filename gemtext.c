@@ -0,0 +1,470 @@
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "gemtext.h"
+#include "mem.h"
+#include "pool.h"
+
+/* Scans doc->text for newlines from 0, adding lines as it goes and
+ * leaving *start at the beginning of the unfinished line. Returns how
+ * far it got, the rest is left to the scalar loop. */
+typedef size_t (*split_fn)(struct document *doc, size_t *start);
+
+static split_fn split = NULL;
+
+/* Without a lines array only counts, so the array can be sized exactly */
+static inline void add_line(struct document *doc, size_t off, size_t len)
+{
+  if (doc->lines == NULL)
+  {
+    doc->lines_len++;
+    return;
+  }
+
+  if (len > 0 && doc->text[off+len-1] == '\r')
+    len--;
+  if (len > UINT32_MAX)
+    len = UINT32_MAX;
+
+  doc->lines[doc->lines_len].off = off;
+  doc->lines[doc->lines_len].len = len;
+  doc->lines[doc->lines_len].type = LINE_TEXT;
+  doc->lines_len++;
+}
+
+/* Every set bit in mask is a newline at base + bit */
+static inline void add_lines(struct document *doc, uint64_t mask, size_t base, size_t *start)
+{
+  if (doc->lines == NULL && mask)
+  {
+    doc->lines_len += __builtin_popcountll(mask);
+    *start = base + 63 - __builtin_clzll(mask) + 1;
+    return;
+  }
+
+  while (mask)
+  {
+    size_t pos = base + __builtin_ctzll(mask);
+    mask &= mask - 1;
+
+    add_line(doc, *start, pos - *start);
+    *start = pos + 1;
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t split_sse2(struct document *doc, size_t *start)
+{
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i;
+
+  for (i = 0; i + 64 <= doc->len; i += 64)
+  {
+    const __m128i *p = (const __m128i *) (doc->text + i);
+    uint64_t m0 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), nl));
+    uint64_t m1 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p+1), nl));
+    uint64_t m2 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p+2), nl));
+    uint64_t m3 = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p+3), nl));
+
+    add_lines(doc, m0 | m1 << 16 | m2 << 32 | m3 << 48, i, start);
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t split_avx2(struct document *doc, size_t *start)
+{
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i;
+
+  for (i = 0; i + 64 <= doc->len; i += 64)
+  {
+    const __m256i *p = (const __m256i *) (doc->text + i);
+    uint64_t m0 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p), nl));
+    uint64_t m1 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(p+1), nl));
+
+    add_lines(doc, m0 | m1 << 32, i, start);
+  }
+
+  return i;
+}
+#endif
+
+static size_t split_none(struct document *doc, size_t *start)
+{
+  return 0;
+}
+
+static void choose_split()
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    split = split_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    split = split_sse2;
+  else
+#endif
+    split = split_none;
+}
+
+/* Which newline scan doc_parse() uses on this CPU */
+const char *doc_parse_path()
+{
+  if (split == NULL)
+    choose_split();
+
+#ifdef HAVE_X86_SIMD
+  if (split == split_avx2)
+    return "AVX2";
+  if (split == split_sse2)
+    return "SSE2";
+#endif
+  return "scalar";
+}
+
+/* Type of a line by its leading bytes, outside of preformatted blocks */
+enum line_type classify_line(const char *line, size_t len)
+{
+  int level = 0;
+
+  if (len == 0)
+    return LINE_TEXT;
+
+  switch (line[0])
+  {
+  case '`':
+    if (len >= 3 && line[1] == '`' && line[2] == '`')
+      return LINE_PRE_TOGGLE;
+    break;
+  case '=':
+    if (len >= 2 && line[1] == '>')
+      return LINE_LINK;
+    break;
+  case '#':
+    while ((size_t) level < len && line[level] == '#')
+      level++;
+
+    if (level > 3)
+      level = 3;
+
+    return LINE_HEADING + level - 1;
+  case '*':
+    if (len >= 2 && line[1] == ' ')
+      return LINE_LIST;
+    break;
+  case '>':
+    return LINE_QUOTE;
+  }
+
+  return LINE_TEXT;
+}
+
+/* "=>" [whitespace] URL [whitespace label] */
+void line_link(const char *line, size_t len,
+	       const char **url, size_t *url_len,
+	       const char **label, size_t *label_len)
+{
+  size_t i = 2, start;
+
+  while (i < len && isspace((unsigned char) line[i]))
+    i++;
+
+  start = i;
+  while (i < len && !isspace((unsigned char) line[i]))
+    i++;
+
+  *url = line + start;
+  *url_len = i - start;
+
+  while (i < len && isspace((unsigned char) line[i]))
+    i++;
+
+  *label = line + i;
+  *label_len = len - i;
+}
+
+/* Types of lines from to to, starting in or out of a preformatted
+ * block. Returns whether it ends in one, and counts the links. */
+static bool classify_range(struct document *doc, size_t from, size_t to,
+			   bool preformatted, size_t *links)
+{
+  *links = 0;
+
+  for (size_t i = from; i < to; i++)
+  {
+    struct doc_line *line = &doc->lines[i];
+    enum line_type type = classify_line(doc->text + line->off, line->len);
+
+    if (preformatted && type != LINE_PRE_TOGGLE)
+      type = LINE_PRE;
+
+    if (type == LINE_PRE_TOGGLE)
+      preformatted = !preformatted;
+    else if (type == LINE_LINK)
+      (*links)++;
+
+    line->type = type;
+  }
+
+  return preformatted;
+}
+
+static void list_links(struct document *doc, size_t from, size_t to, size_t *out)
+{
+  for (size_t i = from; i < to; i++)
+    if (doc->lines[i].type == LINE_LINK)
+      *out++ = i;
+}
+
+static void classify(struct document *doc, struct arena *page)
+{
+  classify_range(doc, 0, doc->lines_len, false, &doc->links_len);
+
+  if (doc->links_len == 0)
+    return;
+
+  if ((doc->links = arena_alloc(page, doc->links_len * sizeof(size_t))) == NULL)
+  {
+    doc->links_len = 0;
+    return;
+  }
+
+  list_links(doc, 0, doc->lines_len, doc->links);
+}
+
+static void split_lines(struct document *doc)
+{
+  size_t start = 0, i;
+  const char *p;
+
+  i = split(doc, &start);
+
+  while (i < doc->len && (p = memchr(doc->text + i, '\n', doc->len - i)) != NULL)
+  {
+    i = p - doc->text;
+    add_line(doc, start, i - start);
+    start = ++i;
+  }
+
+  if (start < doc->len)
+    add_line(doc, start, doc->len - start);
+}
+
+/* Pages of PARSE_PARALLEL bytes and up are parsed in chunks on the
+ * pool. Chunks start after a newline so no line spans two, and are
+ * classified as if out of a preformatted block; the few that start
+ * inside one are done again once the toggles before them are
+ * counted. */
+#define PARSE_CHUNK_MIN (1 << 20)
+
+struct chunk
+{
+  struct document part;   /* The chunk's text, and its lines once split */
+  size_t off;             /* Of the text in the document */
+  size_t line;            /* Its first line in the document */
+  size_t links, link;     /* Its link count and first link */
+  bool pre;               /* Starts inside a preformatted block */
+  bool toggled;           /* Ends in the other state than it starts */
+};
+
+struct parse_job
+{
+  struct document *doc;
+  struct chunk *chunks;
+};
+
+static void chunk_count(void *arg, size_t i)
+{
+  struct parse_job *job = arg;
+
+  split_lines(&job->chunks[i].part);
+}
+
+static void chunk_split(void *arg, size_t i)
+{
+  struct parse_job *job = arg;
+  struct chunk *c = &job->chunks[i];
+
+  c->part.lines = job->doc->lines + c->line;
+  c->part.lines_len = 0;
+  split_lines(&c->part);
+
+  for (size_t j = 0; j < c->part.lines_len; j++)
+    c->part.lines[j].off += c->off;
+
+  if (job->doc->gemini)
+    c->toggled = classify_range(job->doc, c->line, c->line + c->part.lines_len,
+				false, &c->links);
+}
+
+static void chunk_fix(void *arg, size_t i)
+{
+  struct parse_job *job = arg;
+  struct chunk *c = &job->chunks[i];
+
+  if (c->pre)
+    classify_range(job->doc, c->line, c->line + c->part.lines_len, true, &c->links);
+}
+
+static void chunk_links(void *arg, size_t i)
+{
+  struct parse_job *job = arg;
+  struct chunk *c = &job->chunks[i];
+
+  list_links(job->doc, c->line, c->line + c->part.lines_len, job->doc->links + c->link);
+}
+
+static bool parse_chunks(struct document *doc, struct arena *page)
+{
+  struct parse_job job = { doc, NULL };
+  size_t size, n = 0, off = 0, end, lines = 0, links = 0;
+  bool pre = false;
+  const char *nl;
+
+  size = doc->len / (pool_size() * 4);
+  if (size < PARSE_CHUNK_MIN)
+    size = PARSE_CHUNK_MIN;
+
+  if ((job.chunks = mem_calloc(MEM_DOC, doc->len / size + 1, sizeof(struct chunk))) == NULL)
+    return false;
+
+  while (off < doc->len)
+  {
+    end = doc->len - off > size ? off + size : doc->len;
+    if (end < doc->len)
+      end = (nl = memchr(doc->text + end, '\n', doc->len - end)) != NULL
+	? (size_t) (nl - doc->text) + 1 : doc->len;
+
+    job.chunks[n].part.text = doc->text + off;
+    job.chunks[n].part.len = end - off;
+    job.chunks[n].off = off;
+    n++;
+    off = end;
+  }
+
+  pool_run(chunk_count, &job, n);
+
+  /* Where each chunk's lines go */
+  for (size_t i = 0; i < n; i++)
+  {
+    job.chunks[i].line = lines;
+    lines += job.chunks[i].part.lines_len;
+  }
+
+  if (lines > 0 && (doc->lines = arena_alloc(page, lines * sizeof(struct doc_line))) == NULL)
+    goto done;
+  doc->lines_len = lines;
+
+  pool_run(chunk_split, &job, n);
+
+  if (!doc->gemini)
+    goto done;
+
+  /* Preformatted state carried across chunk boundaries */
+  for (size_t i = 0; i < n; i++)
+  {
+    job.chunks[i].pre = pre;
+    pre ^= job.chunks[i].toggled;
+  }
+  pool_run(chunk_fix, &job, n);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    job.chunks[i].link = links;
+    links += job.chunks[i].links;
+  }
+
+  if (links > 0 && (doc->links = arena_alloc(page, links * sizeof(size_t))) != NULL)
+  {
+    doc->links_len = links;
+    pool_run(chunk_links, &job, n);
+  }
+
+ done:
+  mem_free(job.chunks);
+  return true;
+}
+
+/* Split text into lines with a vectorized newline scan, then classify
+ * every line by its leading bytes. The first scan only counts lines so
+ * the page arena holds the index in a single allocation. Large pages
+ * do both per chunk on every core. */
+void doc_parse(struct document *doc, struct arena *page,
+	       const char *text, size_t len, bool gemini)
+{
+  size_t count;
+
+  memset(doc, 0, sizeof(struct document));
+  doc->text = text;
+  doc->len = len;
+  doc->gemini = gemini;
+
+  if (split == NULL)
+    choose_split();
+
+  if (len >= PARSE_PARALLEL && pool_size() > 1 && parse_chunks(doc, page))
+    return;
+
+  split_lines(doc);
+
+  if ((count = doc->lines_len) == 0)
+    return;
+
+  doc->lines_len = 0;
+  if ((doc->lines = arena_alloc(page, count * sizeof(struct doc_line))) == NULL)
+    return;
+
+  split_lines(doc);
+
+  if (gemini)
+    classify(doc, page);
+}
+
+/* Copy the URL of the nth link */
+int doc_link(struct document *doc, size_t n, char *out, size_t len)
+{
+  struct doc_line *line;
+  const char *url, *label;
+  size_t url_len, label_len;
+
+  if (n >= doc->links_len)
+    return -1;
+
+  line = &doc->lines[doc->links[n]];
+  line_link(doc->text + line->off, line->len, &url, &url_len, &label, &label_len);
+
+  if (url_len >= len)
+    return -1;
+
+  memcpy(out, url, url_len);
+  out[url_len] = 0;
+
+  return url_len;
+}
+
+/* Index of the line containing offset */
+size_t doc_line_at(struct document *doc, size_t offset)
+{
+  size_t lo = 0, hi = doc->lines_len;
+
+  while (hi - lo > 1)
+  {
+    size_t mid = (lo + hi) / 2;
+
+    if (doc->lines[mid].off <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
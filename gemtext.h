@@ -0,0 +1,56 @@
+#ifndef _GEMTEXT_H
+#define _GEMTEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define PARSE_PARALLEL (8 << 20) /* Pages parsed on every core from here */
+
+enum line_type
+{
+  LINE_TEXT,
+  LINE_LINK,
+  LINE_PRE_TOGGLE,
+  LINE_PRE,
+  LINE_HEADING,
+  LINE_SUBHEADING,
+  LINE_SUBSUBHEADING,
+  LINE_LIST,
+  LINE_QUOTE,
+};
+
+struct doc_line
+{
+  size_t off;        /* Offset of the line in the text */
+  uint32_t len;      /* Without the line ending */
+  uint8_t type;      /* enum line_type */
+};
+
+struct document
+{
+  const char *text;
+  size_t len;
+  bool gemini;
+  
+  struct doc_line *lines;
+  size_t lines_len;
+
+  size_t *links;     /* Line of every link, in order */
+  size_t links_len;
+};
+
+enum line_type classify_line(const char *line, size_t len);
+void line_link(const char *line, size_t len,
+	       const char **url, size_t *url_len,
+	       const char **label, size_t *label_len);
+
+void doc_parse(struct document *doc, struct arena *page,
+	       const char *text, size_t len, bool gemini);
+int doc_link(struct document *doc, size_t n, char *out, size_t len);
+size_t doc_line_at(struct document *doc, size_t offset);
+const char *doc_parse_path();
+
+#endif /* _GEMTEXT_H */
@@ -0,0 +1,15 @@
+#include "hash.h"
+
+uint64_t hash_bytes(const void *data, size_t len)
+{
+  const unsigned char *s = data;
+  uint64_t h = 14695981039346656037ULL;
+
+  while (len--)
+  {
+    h ^= *s++;
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
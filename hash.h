@@ -0,0 +1,11 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FNV-1a, for the tables of URLs, terms and feed bodies. Feed states
+ * keep these, so it does not change. */
+uint64_t hash_bytes(const void *data, size_t len);
+
+#endif /* _HASH_H */
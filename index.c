@@ -0,0 +1,1254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "trace.h"
+#include "mem.h"
+#include "hash.h"
+
+/* Full-text index of the gemtext pages fetched so far, kept in memory
+ * as a hash table of terms whose postings are varint pairs of document
+ * id delta and term frequency. Pages are tokenized and added on a
+ * thread of their own.
+ *
+ * DIR/index.log has a record per page, appended as the pages come in.
+ * A record is its varint length followed by
+ *   url, title   varint length and bytes each
+ *   hash         8 bytes, FNV-1a of the text, so unchanged pages are skipped
+ *   terms        varint count, then the page's distinct terms in order,
+ *                front coded against the one before (varint shared prefix,
+ *                varint suffix length, suffix) with a varint frequency
+ *
+ * On exit, once the log has grown to INDEX_COMPACT of DIR/index, the
+ * whole index is written inverted to DIR/index and the log emptied:
+ * "GIDX1", varint document count, every document's url, title and hash,
+ * varint term count, then the terms in order, front coded, each with
+ * varint df, last document and postings length and the postings. Pages
+ * indexed again since are left out and the rest numbered anew. Loading
+ * reads that and replays what the log has on top. */
+
+#define INDEX_TEXT_MAX (4 << 20)    /* Longer pages are indexed up to here */
+#define INDEX_QUEUE_MAX (32 << 20)  /* Pages queued past this are dropped */
+#define INDEX_COMPACT 4             /* Log bytes times this past the base's */
+#define PAGE_TERMS_MAX (256 << 10)  /* Tokens looked at per page */
+#define QUERY_TERMS_MAX 16
+#define TERM_MIN 2
+#define TERM_MAX 64
+#define TITLE_MAX 200
+#define RESULTS_MAX 50
+
+struct bytes
+{
+  uint8_t *data;
+  size_t len;
+  size_t size;
+};
+
+struct term
+{
+  uint64_t hash;
+  char *text;           /* NULL for an empty slot */
+  uint32_t len;
+  uint32_t df;          /* Documents containing the term */
+  uint32_t last_doc;
+  struct bytes postings;
+};
+
+struct doc
+{
+  char *url;            /* One allocation holding url and title */
+  char *title;
+  uint64_t hash;
+  bool stale;           /* The URL was indexed again since */
+};
+
+/* A distinct term of one page, pointing into a scratch buffer */
+struct page_term
+{
+  const char *text;
+  uint32_t len;
+  uint32_t tf;
+};
+
+struct job
+{
+  struct job *next;
+  char *url;
+  char *text;           /* In the same allocation as the job */
+  size_t len;
+};
+
+static struct term *terms = NULL;
+static size_t terms_size = 0;
+static size_t terms_len = 0;
+
+static struct doc *docs = NULL;
+static uint32_t docs_len = 0;
+static uint32_t docs_size = 0;
+
+/* Latest document of every URL, as document id + 1 */
+static uint32_t *urls = NULL;
+static size_t urls_size = 0;
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static char base_path[512];
+static char log_path[512];
+static FILE *log_fp = NULL;
+static size_t log_records = 0;   /* Since DIR/index was written */
+
+static struct job *queue_head = NULL, *queue_tail = NULL;
+static size_t queue_bytes = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t worker;
+static bool running = false;
+static bool stopping = false;
+static bool loaded = false;
+
+static int bytes_reserve(struct bytes *b, size_t n)
+{
+  size_t size = b->size ? b->size : 8;
+  uint8_t *data;
+
+  if (b->len + n <= b->size)
+    return 0;
+
+  while (size < b->len + n)
+    size *= 2;
+
+  if ((data = mem_realloc(MEM_CACHE, b->data, size)) == NULL)
+    return -1;
+
+  b->data = data;
+  b->size = size;
+
+  return 0;
+}
+
+static int put_varint(struct bytes *b, uint64_t v)
+{
+  if (bytes_reserve(b, 10) < 0)
+    return -1;
+
+  while (v >= 0x80)
+  {
+    b->data[b->len++] = v | 0x80;
+    v >>= 7;
+  }
+  b->data[b->len++] = v;
+
+  return 0;
+}
+
+static int put_bytes(struct bytes *b, const void *p, size_t len)
+{
+  if (put_varint(b, len) < 0 || bytes_reserve(b, len) < 0)
+    return -1;
+
+  memcpy(b->data + b->len, p, len);
+  b->len += len;
+
+  return 0;
+}
+
+/* NULL when the input ends inside the varint */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+  int shift = 0;
+
+  *v = 0;
+
+  while (p < end && shift < 64)
+  {
+    *v |= (uint64_t) (*p & 0x7F) << shift;
+    if (!(*p++ & 0x80))
+      return p;
+    shift += 7;
+  }
+
+  return NULL;
+}
+
+static int put_u64(struct bytes *b, uint64_t v)
+{
+  if (bytes_reserve(b, 8) < 0)
+    return -1;
+
+  for (int i = 0; i < 8; i++)
+    b->data[b->len++] = v >> (8 * i);
+
+  return 0;
+}
+
+static const uint8_t *get_u64(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+  if (end - p < 8)
+    return NULL;
+
+  *v = 0;
+  for (int i = 0; i < 8; i++)
+    *v |= (uint64_t) p[i] << (8 * i);
+
+  return p + 8;
+}
+
+/* Length of the prefix a and b have in common */
+static size_t shared_prefix(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  size_t n = 0;
+
+  while (n < a_len && n < b_len && a[n] == b[n])
+    n++;
+
+  return n;
+}
+
+/*** Tables ***/
+
+static struct term *find_term(const char *text, size_t len, uint64_t hash)
+{
+  size_t i;
+
+  if (terms_size == 0)
+    return NULL;
+
+  for (i = hash & (terms_size - 1); terms[i].text != NULL; i = (i + 1) & (terms_size - 1))
+    if (terms[i].hash == hash && terms[i].len == len && !memcmp(terms[i].text, text, len))
+      return &terms[i];
+
+  return &terms[i];
+}
+
+static int grow_terms()
+{
+  struct term *old = terms;
+  size_t old_size = terms_size;
+  size_t size = terms_size ? terms_size * 2 : 4096;
+
+  if ((terms = mem_calloc(MEM_CACHE, size, sizeof(struct term))) == NULL)
+  {
+    terms = old;
+    return -1;
+  }
+
+  terms_size = size;
+
+  for (size_t i = 0; i < old_size; i++)
+    if (old[i].text != NULL)
+      *find_term(old[i].text, old[i].len, old[i].hash) = old[i];
+
+  mem_free(old);
+
+  return 0;
+}
+
+static uint32_t *find_url(const char *url, uint64_t hash)
+{
+  size_t i;
+
+  for (i = hash & (urls_size - 1); urls[i] != 0; i = (i + 1) & (urls_size - 1))
+    if (!strcmp(docs[urls[i] - 1].url, url))
+      return &urls[i];
+
+  return &urls[i];
+}
+
+static int grow_urls()
+{
+  uint32_t *old = urls;
+  size_t old_size = urls_size;
+  size_t size = urls_size ? urls_size * 2 : 1024;
+
+  if ((urls = mem_calloc(MEM_CACHE, size, sizeof(uint32_t))) == NULL)
+  {
+    urls = old;
+    return -1;
+  }
+
+  urls_size = size;
+
+  for (size_t i = 0; i < old_size; i++)
+    if (old[i] != 0)
+    {
+      const char *url = docs[old[i] - 1].url;
+      *find_url(url, hash_bytes(url, strlen(url))) = old[i];
+    }
+
+  mem_free(old);
+
+  return 0;
+}
+
+/* The document already indexed for url, or NULL */
+static struct doc *url_doc(const char *url)
+{
+  uint32_t id;
+
+  if (urls_size == 0)
+    return NULL;
+
+  id = *find_url(url, hash_bytes(url, strlen(url)));
+
+  return id ? &docs[id - 1] : NULL;
+}
+
+/* The id of a new document, which the URL now finds, -1 without memory */
+static int64_t new_doc(const char *url, const char *title, uint64_t hash)
+{
+  size_t url_len = strlen(url), title_len = strlen(title);
+  uint32_t id = docs_len, *slot;
+  struct doc *d;
+
+  if (docs_len == docs_size)
+  {
+    uint32_t size = docs_size ? docs_size * 2 : 1024;
+    struct doc *grown = mem_realloc(MEM_CACHE, docs, size * sizeof(struct doc));
+
+    if (grown == NULL)
+      return -1;
+    docs = grown;
+    docs_size = size;
+  }
+
+  if ((docs_len + 1) * 10 > urls_size * 7 && grow_urls() < 0)
+    return -1;
+
+  d = &docs[id];
+  if ((d->url = mem_malloc(MEM_CACHE, url_len + title_len + 2)) == NULL)
+    return -1;
+  memcpy(d->url, url, url_len + 1);
+  d->title = d->url + url_len + 1;
+  memcpy(d->title, title, title_len + 1);
+  d->hash = hash;
+  d->stale = false;
+
+  slot = find_url(url, hash_bytes(url, url_len));
+  if (*slot != 0)
+    docs[*slot - 1].stale = true;
+  *slot = id + 1;
+  docs_len++;
+
+  return id;
+}
+
+/* Adds a page to the in-memory index, with the write lock held */
+static int add_doc(const char *url, const char *title, uint64_t hash,
+		   struct page_term *pt, size_t n)
+{
+  int64_t id = new_doc(url, title, hash);
+  struct term *t;
+
+  if (id < 0)
+    return -1;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    uint64_t h = hash_bytes(pt[i].text, pt[i].len);
+
+    if ((terms_len + 1) * 10 > terms_size * 7 && grow_terms() < 0)
+      return -1;
+
+    t = find_term(pt[i].text, pt[i].len, h);
+
+    if (t->text == NULL)
+    {
+      if ((t->text = mem_malloc(MEM_CACHE, pt[i].len)) == NULL)
+	return -1;
+      memcpy(t->text, pt[i].text, pt[i].len);
+      t->len = pt[i].len;
+      t->hash = h;
+      terms_len++;
+    }
+
+    /* Ids only grow, the first delta is from 0 */
+    if (put_varint(&t->postings, id - t->last_doc) < 0
+	|| put_varint(&t->postings, pt[i].tf) < 0)
+      return -1;
+    t->last_doc = id;
+    t->df++;
+  }
+
+  return 0;
+}
+
+/*** Tokenizer ***/
+
+static bool is_word(unsigned char c)
+{
+  return isalnum(c) || c >= 0x80;
+}
+
+static int compare_terms(const void *a, const void *b)
+{
+  const struct page_term *x = a, *y = b;
+  int ret = memcmp(x->text, y->text, x->len < y->len ? x->len : y->len);
+
+  return ret ? ret : (int) x->len - (int) y->len;
+}
+
+/* Lower-cased words of text into scratch, which holds len bytes, and
+ * out as distinct terms in order with their frequency */
+static size_t tokenize(const char *text, size_t len, char *scratch,
+		       struct page_term *out, size_t max)
+{
+  size_t n = 0, d = 0, i = 0, start;
+
+  while (i < len && n < max)
+  {
+    while (i < len && !is_word(text[i]))
+      i++;
+    for (start = i; i < len && is_word(text[i]); i++)
+      ;
+
+    if (i - start < TERM_MIN || i - start > TERM_MAX)
+      continue;
+
+    out[n].text = scratch;
+    out[n].len = i - start;
+    out[n].tf = 1;
+    for (size_t j = start; j < i; j++)
+      *scratch++ = tolower((unsigned char) text[j]);
+    n++;
+  }
+
+  qsort(out, n, sizeof(struct page_term), compare_terms);
+
+  for (i = 0; i < n; i++)
+  {
+    if (d > 0 && out[d-1].len == out[i].len && !memcmp(out[d-1].text, out[i].text, out[i].len))
+      out[d-1].tf++;
+    else
+      out[d++] = out[i];
+  }
+
+  return d;
+}
+
+/* Text of the first heading, empty without one */
+static void page_title(const char *text, size_t len, char *title)
+{
+  const char *p = text, *end = text + len, *nl;
+  size_t n;
+
+  title[0] = 0;
+
+  for (; p < end; p = nl + 1)
+  {
+    if ((nl = memchr(p, '\n', end - p)) == NULL)
+      nl = end;
+
+    if (*p != '#')
+      continue;
+
+    while (p < nl && (*p == '#' || *p == ' ' || *p == '\t'))
+      p++;
+    n = nl - p;
+    if (n > 0 && p[n-1] == '\r')
+      n--;
+    if (n > TITLE_MAX)
+      n = TITLE_MAX;
+
+    memcpy(title, p, n);
+    title[n] = 0;
+    return;
+  }
+}
+
+/*** Log ***/
+
+static int encode_record(struct bytes *b, const char *url, const char *title,
+			 uint64_t hash, struct page_term *pt, size_t n)
+{
+  if (put_bytes(b, url, strlen(url)) < 0 || put_bytes(b, title, strlen(title)) < 0
+      || put_u64(b, hash) < 0 || put_varint(b, n) < 0)
+    return -1;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    size_t shared = i > 0 ? shared_prefix(pt[i].text, pt[i].len, pt[i-1].text, pt[i-1].len) : 0;
+
+    if (put_varint(b, shared) < 0
+	|| put_bytes(b, pt[i].text + shared, pt[i].len - shared) < 0
+	|| put_varint(b, pt[i].tf) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static const uint8_t *get_string(const uint8_t *p, const uint8_t *end, char *out, size_t max)
+{
+  uint64_t len;
+
+  if ((p = get_varint(p, end, &len)) == NULL || len >= max || len > (uint64_t) (end - p))
+    return NULL;
+
+  memcpy(out, p, len);
+  out[len] = 0;
+
+  return p + len;
+}
+
+/* One record's body back into add_doc(), -1 if it is malformed */
+static int replay_record(const uint8_t *p, const uint8_t *end, struct bytes *scratch)
+{
+  char url[1025], title[TITLE_MAX + 1];
+  struct page_term *pt;
+  struct doc *d;
+  uint64_t hash, n, shared, len, tf;
+  char *text;
+  int ret = 0;
+
+  if ((p = get_string(p, end, url, sizeof(url))) == NULL
+      || (p = get_string(p, end, title, sizeof(title))) == NULL
+      || (p = get_u64(p, end, &hash)) == NULL
+      || (p = get_varint(p, end, &n)) == NULL || n > PAGE_TERMS_MAX)
+    return -1;
+
+  /* Terms first, then the page_term array pointing at them */
+  scratch->len = 0;
+  if (bytes_reserve(scratch, n * (TERM_MAX + sizeof(struct page_term))) < 0)
+    return -1;
+  pt = (struct page_term *) scratch->data;
+  text = (char *) (pt + n);
+
+  for (uint64_t i = 0; i < n; i++)
+  {
+    if ((p = get_varint(p, end, &shared)) == NULL
+	|| (p = get_varint(p, end, &len)) == NULL
+	|| shared + len > TERM_MAX || len > (uint64_t) (end - p)
+	|| (i > 0 ? shared > pt[i-1].len : shared > 0))
+      return -1;
+
+    if (i > 0)
+      memcpy(text, pt[i-1].text, shared);
+    memcpy(text + shared, p, len);
+    p += len;
+
+    if ((p = get_varint(p, end, &tf)) == NULL)
+      return -1;
+
+    pt[i].text = text;
+    pt[i].len = shared + len;
+    pt[i].tf = tf;
+    text += TERM_MAX;
+  }
+
+  /* Pages the log shares with DIR/index when writing it was cut short */
+  pthread_rwlock_wrlock(&index_lock);
+  if ((d = url_doc(url)) == NULL || d->hash != hash)
+    ret = add_doc(url, title, hash, pt, n);
+  pthread_rwlock_unlock(&index_lock);
+
+  log_records++;
+
+  return ret;
+}
+
+static uint8_t *read_all(const char *path, size_t *size)
+{
+  uint8_t *data = NULL;
+  long len;
+  FILE *fp;
+
+  if ((fp = fopen(path, "r")) == NULL)
+    return NULL;
+
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  rewind(fp);
+
+  if (len > 0 && (data = mem_malloc(MEM_CACHE, len)) != NULL
+      && fread(data, 1, len, fp) != (size_t) len)
+  {
+    mem_free(data);
+    data = NULL;
+  }
+
+  fclose(fp);
+  *size = len;
+
+  return data;
+}
+
+/* Whether a term's postings read back as exactly df pairs of known
+ * documents, in id order and ending at last_doc, as search() walks
+ * them without looking again */
+static bool postings_valid(const uint8_t *p, uint64_t len, uint64_t df, uint64_t last_doc)
+{
+  const uint8_t *end = p + len;
+  uint64_t delta, tf, doc = 0;
+
+  if (df == 0)
+    return false;
+
+  for (uint64_t i = 0; i < df; i++)
+  {
+    if ((p = get_varint(p, end, &delta)) == NULL || (p = get_varint(p, end, &tf)) == NULL
+	|| (i > 0 && delta == 0) || delta >= docs_len - doc)
+      return false;
+    doc += delta;
+  }
+
+  return p == end && doc == last_doc;
+}
+
+/* Reads DIR/index, -1 if it is damaged and whatever came before the
+ * damage is kept */
+static int load_base()
+{
+  char url[1025], title[TITLE_MAX + 1], text[TERM_MAX];
+  const uint8_t *p, *end;
+  uint64_t n, hash, shared, len, df, last_doc, postings_len;
+  uint8_t *data;
+  size_t size, prev_len = 0;
+  struct term *t;
+  int ret = -1;
+
+  if ((data = read_all(base_path, &size)) == NULL)
+    return 0;
+
+  p = data;
+  end = data + size;
+
+  if (size < 5 || memcmp(p, "GIDX1", 5) || (p = get_varint(p + 5, end, &n)) == NULL)
+    goto done;
+
+  pthread_rwlock_wrlock(&index_lock);
+
+  for (uint64_t i = 0; i < n; i++)
+    if ((p = get_string(p, end, url, sizeof(url))) == NULL
+	|| (p = get_string(p, end, title, sizeof(title))) == NULL
+	|| (p = get_u64(p, end, &hash)) == NULL
+	|| new_doc(url, title, hash) < 0)
+      goto unlock;
+
+  if ((p = get_varint(p, end, &n)) == NULL)
+    goto unlock;
+
+  for (uint64_t i = 0; i < n; i++)
+  {
+    if ((p = get_varint(p, end, &shared)) == NULL
+	|| (p = get_varint(p, end, &len)) == NULL
+	|| shared > prev_len || shared + len > TERM_MAX || len > (uint64_t) (end - p))
+      goto unlock;
+
+    memcpy(text + shared, p, len);
+    p += len;
+    len += shared;
+    prev_len = len;
+
+    if ((p = get_varint(p, end, &df)) == NULL
+	|| (p = get_varint(p, end, &last_doc)) == NULL
+	|| last_doc >= docs_len
+	|| (p = get_varint(p, end, &postings_len)) == NULL
+	|| postings_len > (uint64_t) (end - p)
+	|| !postings_valid(p, postings_len, df, last_doc))
+      goto unlock;
+
+    if ((terms_len + 1) * 10 > terms_size * 7 && grow_terms() < 0)
+      goto unlock;
+
+    hash = hash_bytes(text, len);
+    t = find_term(text, len, hash);
+    if (t->text != NULL
+	|| (t->text = mem_malloc(MEM_CACHE, len)) == NULL
+	|| (t->postings.data = mem_malloc(MEM_CACHE, postings_len)) == NULL)
+      goto unlock;
+
+    memcpy(t->text, text, len);
+    memcpy(t->postings.data, p, postings_len);
+    p += postings_len;
+    t->hash = hash;
+    t->len = len;
+    t->df = df;
+    t->last_doc = last_doc;
+    t->postings.len = t->postings.size = postings_len;
+    terms_len++;
+  }
+
+  ret = 0;
+
+ unlock:
+  pthread_rwlock_unlock(&index_lock);
+ done:
+  if (ret < 0)
+    fprintf(stderr, "%s is damaged, some pages will not be found\n", base_path);
+  mem_free(data);
+
+  return ret;
+}
+
+/* Replays the log, cutting off a record left half written */
+static void load_log()
+{
+  struct bytes scratch = {0};
+  const uint8_t *p, *end;
+  uint64_t len;
+  uint8_t *data;
+  size_t size;
+
+  if ((data = read_all(log_path, &size)) == NULL)
+    return;
+
+  for (p = data, end = data + size; p < end; p += len)
+  {
+    const uint8_t *body = get_varint(p, end, &len);
+
+    if (body == NULL || len > (uint64_t) (end - body)
+	|| replay_record(body, body + len, &scratch) < 0)
+      break;
+    len += body - p;
+  }
+
+  if (p < end && truncate(log_path, p - data) < 0)
+    perror(log_path);
+
+  mem_free(scratch.data);
+  mem_free(data);
+}
+
+static int compare_term_text(const void *a, const void *b)
+{
+  const struct term *x = *(struct term **) a, *y = *(struct term **) b;
+  int ret = memcmp(x->text, y->text, x->len < y->len ? x->len : y->len);
+
+  return ret ? ret : (int) x->len - (int) y->len;
+}
+
+/* Written out a megabyte at a time */
+static int flush_bytes(struct bytes *b, FILE *fp, size_t above)
+{
+  if (b->len <= above)
+    return 0;
+
+  if (fwrite(b->data, 1, b->len, fp) != b->len)
+    return -1;
+  b->len = 0;
+
+  return 0;
+}
+
+/* Whether any of t's documents is still its URL's latest */
+static bool term_live(const struct term *t, const uint32_t *ids)
+{
+  const uint8_t *p = t->postings.data, *end = p + t->postings.len;
+  uint64_t delta, tf, doc = 0;
+
+  while ((p = get_varint(p, end, &delta)) != NULL && (p = get_varint(p, end, &tf)) != NULL)
+    if (ids[doc += delta] != UINT32_MAX)
+      return true;
+
+  return false;
+}
+
+/* t's postings without stale documents and in the new ids, into out,
+ * with df and last_doc to match */
+static int renumber_postings(const struct term *t, const uint32_t *ids, struct bytes *out,
+			     uint32_t *df, uint32_t *last_doc)
+{
+  const uint8_t *p = t->postings.data, *end = p + t->postings.len;
+  uint64_t delta, tf, doc = 0;
+
+  out->len = 0;
+  *df = *last_doc = 0;
+
+  while ((p = get_varint(p, end, &delta)) != NULL && (p = get_varint(p, end, &tf)) != NULL)
+  {
+    if (ids[doc += delta] == UINT32_MAX)
+      continue;
+    if (put_varint(out, ids[doc] - *last_doc) < 0 || put_varint(out, tf) < 0)
+      return -1;
+    *last_doc = ids[doc];
+    (*df)++;
+  }
+
+  return 0;
+}
+
+/* The index in memory to DIR/index, through a temporary file so a crash
+ * leaves the old one, then the log it now holds is emptied */
+static void write_base()
+{
+  char tmp_path[520];
+  struct bytes b = {0}, postings = {0};
+  struct term **sorted;
+  uint32_t *ids, live = 0, df, last_doc;
+  size_t n = 0;
+  int ret = 0;
+  FILE *fp;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", base_path);
+
+  sorted = mem_malloc(MEM_CACHE, (terms_len + 1) * sizeof(struct term *));
+  ids = mem_malloc(MEM_CACHE, (docs_len + 1) * sizeof(uint32_t));
+  if (sorted == NULL || ids == NULL || (fp = fopen(tmp_path, "w")) == NULL)
+  {
+    mem_free(ids);
+    mem_free(sorted);
+    return;
+  }
+
+  /* Pages indexed again keep only their latest text */
+  for (uint32_t i = 0; i < docs_len; i++)
+    ids[i] = docs[i].stale ? UINT32_MAX : live++;
+
+  for (size_t i = 0; i < terms_size; i++)
+    if (terms[i].text != NULL && (live == docs_len || term_live(&terms[i], ids)))
+      sorted[n++] = &terms[i];
+  qsort(sorted, n, sizeof(struct term *), compare_term_text);
+
+  if (bytes_reserve(&b, 5) == 0)
+  {
+    memcpy(b.data, "GIDX1", 5);
+    b.len = 5;
+  }
+  ret |= put_varint(&b, live);
+
+  for (uint32_t i = 0; i < docs_len && ret == 0; i++)
+    if (!docs[i].stale)
+      ret |= put_bytes(&b, docs[i].url, strlen(docs[i].url))
+	| put_bytes(&b, docs[i].title, strlen(docs[i].title))
+	| put_u64(&b, docs[i].hash)
+	| flush_bytes(&b, fp, 1 << 20);
+
+  ret |= put_varint(&b, n);
+
+  for (size_t i = 0; i < n && ret == 0; i++)
+  {
+    struct term *t = sorted[i];
+    size_t shared = i > 0 ? shared_prefix(t->text, t->len, sorted[i-1]->text, sorted[i-1]->len) : 0;
+
+    ret |= put_varint(&b, shared)
+      | put_bytes(&b, t->text + shared, t->len - shared);
+
+    if (live == docs_len)
+      ret |= put_varint(&b, t->df)
+	| put_varint(&b, t->last_doc)
+	| put_bytes(&b, t->postings.data, t->postings.len);
+    else if ((ret |= renumber_postings(t, ids, &postings, &df, &last_doc)) == 0)
+      ret |= put_varint(&b, df)
+	| put_varint(&b, last_doc)
+	| put_bytes(&b, postings.data, postings.len);
+
+    ret |= flush_bytes(&b, fp, 1 << 20);
+  }
+
+  ret |= flush_bytes(&b, fp, 0);
+  ret |= fflush(fp) | fsync(fileno(fp));
+  ret |= fclose(fp);
+
+  if (ret == 0 && rename(tmp_path, base_path) == 0)
+  {
+    if (log_fp != NULL)
+      fclose(log_fp);
+    log_fp = NULL;
+    if (truncate(log_path, 0) < 0)
+      perror(log_path);
+  }
+  else
+    unlink(tmp_path);
+
+  mem_free(postings.data);
+  mem_free(b.data);
+  mem_free(ids);
+  mem_free(sorted);
+}
+
+/* Rewriting DIR/index costs its whole size, so it waits until replaying
+ * the log would cost a good part of that */
+static bool log_large()
+{
+  struct stat base, log;
+
+  if (log_records == 0 || stat(log_path, &log) < 0)
+    return false;
+
+  return stat(base_path, &base) < 0 || log.st_size * INDEX_COMPACT >= base.st_size;
+}
+
+static void index_job(struct job *job)
+{
+  char title[TITLE_MAX + 1];
+  char *scratch;
+  struct page_term *pt;
+  struct bytes rec = {0}, head = {0};
+  struct doc *d;
+  uint64_t hash = hash_bytes(job->text, job->len);
+  size_t n, max = job->len / (TERM_MIN + 1) + 1;
+  bool unchanged;
+
+  pthread_rwlock_rdlock(&index_lock);
+  d = url_doc(job->url);
+  unchanged = d != NULL && d->hash == hash;
+  pthread_rwlock_unlock(&index_lock);
+
+  if (unchanged)
+    return;
+
+  if (max > PAGE_TERMS_MAX)
+    max = PAGE_TERMS_MAX;
+
+  scratch = mem_malloc(MEM_CACHE, job->len + 1);
+  pt = mem_malloc(MEM_CACHE, max * sizeof(struct page_term));
+
+  if (scratch != NULL && pt != NULL)
+  {
+    n = tokenize(job->text, job->len, scratch, pt, max);
+    page_title(job->text, job->len, title);
+
+    if (encode_record(&rec, job->url, title, hash, pt, n) == 0
+	&& put_varint(&head, rec.len) == 0)
+    {
+      if (log_fp != NULL)
+      {
+	fwrite(head.data, 1, head.len, log_fp);
+	fwrite(rec.data, 1, rec.len, log_fp);
+	fflush(log_fp);
+      }
+
+      pthread_rwlock_wrlock(&index_lock);
+      add_doc(job->url, title, hash, pt, n);
+      pthread_rwlock_unlock(&index_lock);
+      log_records++;
+    }
+  }
+
+  mem_free(head.data);
+  mem_free(rec.data);
+  mem_free(pt);
+  mem_free(scratch);
+}
+
+static void *index_thread(void *arg)
+{
+  struct job *job;
+
+  load_base();
+  load_log();
+  log_fp = fopen(log_path, "a");
+  __atomic_store_n(&loaded, true, __ATOMIC_RELEASE);
+
+  while (1)
+  {
+    pthread_mutex_lock(&queue_lock);
+
+    while (queue_head == NULL && !stopping)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+
+    if ((job = queue_head) == NULL)
+    {
+      pthread_mutex_unlock(&queue_lock);
+      break;
+    }
+
+    if ((queue_head = job->next) == NULL)
+      queue_tail = NULL;
+    queue_bytes -= job->len;
+
+    pthread_mutex_unlock(&queue_lock);
+
+    index_job(job);
+    mem_free(job);
+  }
+
+  if (log_large())
+    write_base();
+
+  return NULL;
+}
+
+/* Loads DIR/index and DIR/index.log in the background, an empty dir
+ * disables the index */
+void index_start(const char *dir)
+{
+  if (dir[0] == 0)
+    return;
+
+  mkdir(dir, 0755);
+  snprintf(base_path, sizeof(base_path), "%s/index", dir);
+  snprintf(log_path, sizeof(log_path), "%s/index.log", dir);
+
+  if (pthread_create(&worker, NULL, index_thread, NULL) == 0)
+    running = true;
+}
+
+/* Queues a copy of a page for the index thread, from any thread */
+void index_add(const char *url, const char *text, size_t len)
+{
+  size_t url_len = strlen(url);
+  struct job *job;
+
+  if (!running)
+    return;
+
+  if (len > INDEX_TEXT_MAX)
+    len = INDEX_TEXT_MAX;
+
+  pthread_mutex_lock(&queue_lock);
+  if (queue_bytes + len > INDEX_QUEUE_MAX)
+  {
+    pthread_mutex_unlock(&queue_lock);
+    return;
+  }
+  queue_bytes += len;
+  pthread_mutex_unlock(&queue_lock);
+
+  if ((job = mem_malloc(MEM_CACHE, sizeof(struct job) + url_len + 1 + len)) == NULL)
+  {
+    pthread_mutex_lock(&queue_lock);
+    queue_bytes -= len;
+    pthread_mutex_unlock(&queue_lock);
+    return;
+  }
+
+  job->next = NULL;
+  job->url = (char *) (job + 1);
+  memcpy(job->url, url, url_len + 1);
+  job->text = job->url + url_len + 1;
+  memcpy(job->text, text, len);
+  job->len = len;
+
+  pthread_mutex_lock(&queue_lock);
+  if (queue_tail != NULL)
+    queue_tail->next = job;
+  else
+    queue_head = job;
+  queue_tail = job;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/*** Queries ***/
+
+struct hit
+{
+  uint32_t doc;
+  double score;
+};
+
+static int compare_terms_df(const void *a, const void *b)
+{
+  const struct term *x = *(struct term **) a, *y = *(struct term **) b;
+
+  return x->df < y->df ? -1 : x->df > y->df;
+}
+
+static int compare_hits(const void *a, const void *b)
+{
+  const struct hit *x = a, *y = b;
+
+  if (x->score != y->score)
+    return x->score < y->score ? 1 : -1;
+  return x->doc < y->doc ? 1 : -1;
+}
+
+/* Pages holding every term, newest first among equal scores, with the
+ * read lock held. Returns how many, *hits is the caller's to free. */
+static size_t search(struct term **found, size_t n, struct hit **hits)
+{
+  size_t len = 0, kept = 0;
+  double idf;
+
+  qsort(found, n, sizeof(struct term *), compare_terms_df);
+
+  /* The rarest term bounds the result */
+  if ((*hits = mem_malloc(MEM_CACHE, (found[0]->df + 1) * sizeof(struct hit))) == NULL)
+    return 0;
+
+  for (size_t t = 0; t < n; t++)
+  {
+    const uint8_t *p = found[t]->postings.data;
+    const uint8_t *end = p + found[t]->postings.len;
+    uint64_t delta, tf, doc = 0;
+    size_t h = 0;
+
+    kept = 0;
+
+    idf = log((docs_len + 1.0) / found[t]->df);
+
+    while (p < end && (t == 0 ? len < found[0]->df : h < len))
+    {
+      if ((p = get_varint(p, end, &delta)) == NULL || (p = get_varint(p, end, &tf)) == NULL)
+	break;
+      doc += delta;
+
+      if (t == 0)
+      {
+	(*hits)[len].doc = doc;
+	(*hits)[len++].score = tf * idf;
+	continue;
+      }
+
+      /* Both are in id order, keep what this term also has */
+      while (h < len && (*hits)[h].doc < doc)
+	h++;
+      if (h < len && (*hits)[h].doc == doc)
+      {
+	(*hits)[kept] = (*hits)[h++];
+	(*hits)[kept++].score += tf * idf;
+      }
+    }
+
+    if (t > 0)
+      len = kept;
+  }
+
+  /* Pages visited again are only found through their latest text */
+  kept = 0;
+  for (size_t i = 0; i < len; i++)
+    if (!docs[(*hits)[i].doc].stale)
+      (*hits)[kept++] = (*hits)[i];
+  len = kept;
+
+  qsort(*hits, len, sizeof(struct hit), compare_hits);
+
+  return len;
+}
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = tolower((unsigned char) c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* Query strings are percent-encoded, '+' is a space too */
+static void decode_query(const char *in, char *out, size_t len)
+{
+  size_t n = 0;
+
+  for (; *in && n + 1 < len; in++)
+  {
+    if (*in == '%' && hex_value(in[1]) >= 0 && hex_value(in[2]) >= 0)
+    {
+      out[n++] = hex_value(in[1]) * 16 + hex_value(in[2]);
+      in += 2;
+    }
+    else
+      out[n++] = *in == '+' ? ' ' : *in;
+  }
+
+  out[n] = 0;
+}
+
+static void write_results(FILE *fp, const char *query)
+{
+  char scratch[1024];
+  struct page_term qt[QUERY_TERMS_MAX];
+  struct term *found[QUERY_TERMS_MAX];
+  struct hit *hits = NULL;
+  size_t n, len = 0;
+  uint64_t start = trace_now();
+
+  n = tokenize(query, strlen(query), scratch, qt, QUERY_TERMS_MAX);
+
+  pthread_rwlock_rdlock(&index_lock);
+
+  fprintf(fp, "%u pages, %lu terms indexed\n\n", docs_len, (unsigned long) terms_len);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    found[i] = find_term(qt[i].text, qt[i].len, hash_bytes(qt[i].text, qt[i].len));
+
+    if (found[i] == NULL || found[i]->text == NULL)
+      goto done;
+  }
+
+  if (n > 0)
+    len = search(found, n, &hits);
+
+ done:
+  fprintf(fp, "## %s\n\n", query);
+  fprintf(fp, "%lu pages in %.2fms\n\n", (unsigned long) len, (trace_now() - start) / 1000.0);
+
+  for (size_t i = 0; i < len && i < RESULTS_MAX; i++)
+  {
+    struct doc *d = &docs[hits[i].doc];
+    fprintf(fp, "=> %s %s\n", d->url, d->title[0] ? d->title : d->url);
+  }
+
+  pthread_rwlock_unlock(&index_lock);
+
+  mem_free(hits);
+}
+
+/* Gemtext for about:search?terms, pages holding all of them */
+char *index_page(char *buf, const char *query)
+{
+  char terms_text[1024];
+  char *page = NULL;
+  size_t size;
+  FILE *fp;
+
+  if ((fp = open_memstream(&page, &size)) == NULL)
+    return buf;
+
+  decode_query(query, terms_text, sizeof(terms_text));
+
+  fputs("# Search\n\n", fp);
+
+  if (!running)
+    fputs("The index is off, cache_dir is empty\n", fp);
+  else if (!__atomic_load_n(&loaded, __ATOMIC_ACQUIRE))
+    fputs("The index is still loading\n", fp);
+  else if (terms_text[0] == 0)
+    fputs("Open about:search?words to find visited pages holding all the words\n", fp);
+  else
+    write_results(fp, terms_text);
+
+  fclose(fp);
+
+  buf = mem_realloc(MEM_RECV, buf, size+1);
+  memcpy(buf, page, size+1);
+  free(page);
+
+  return buf;
+}
+
+/* Indexes what is still queued, writes DIR/index and frees everything */
+void index_stop()
+{
+  if (!running)
+    return;
+
+  pthread_mutex_lock(&queue_lock);
+  stopping = true;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+
+  pthread_join(worker, NULL);
+  running = false;
+
+  if (log_fp != NULL)
+    fclose(log_fp);
+  log_fp = NULL;
+
+  for (size_t i = 0; i < terms_size; i++)
+    if (terms[i].text != NULL)
+    {
+      mem_free(terms[i].text);
+      mem_free(terms[i].postings.data);
+    }
+  for (uint32_t i = 0; i < docs_len; i++)
+    mem_free(docs[i].url);
+
+  mem_free(terms);
+  mem_free(docs);
+  mem_free(urls);
+  terms = NULL;
+  docs = NULL;
+  urls = NULL;
+  terms_size = terms_len = urls_size = 0;
+  docs_len = docs_size = 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <stddef.h>
+
+void index_start(const char *dir);
+void index_add(const char *url, const char *text, size_t len);
+char *index_page(char *buf, const char *query);
+void index_stop();
+
+#endif /* _INDEX_H */
@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "json.h"
+#include "utf8.h"
+
+/* Printable ASCII other than '"' and '\' is copied as it is */
+static bool plain[256];
+static bool plain_ready = false;
+
+static void init_plain()
+{
+  for (int c = 0x20; c < 0x80; c++)
+    plain[c] = c != '"' && c != '\\';
+  plain_ready = true;
+}
+
+/* Length of the run from s that needs no escaping */
+static size_t plain_scalar(const unsigned char *s, size_t len)
+{
+  size_t i = 0;
+
+  while (i < len && plain[s[i]])
+    i++;
+
+  return i;
+}
+
+#ifdef HAVE_X86_SIMD
+/* 16 bytes at a time: anything below 0x20 or from 0x80 (signed compare
+ * catches both), or a quote or backslash ends the run */
+__attribute__((target("sse2")))
+static size_t plain_run(const unsigned char *s, size_t len)
+{
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  size_t i;
+  unsigned mask;
+
+  for (i = 0; i + 16 <= len; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space),
+			       _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+
+    if ((mask = _mm_movemask_epi8(bad)))
+      return i + __builtin_ctz(mask);
+  }
+
+  return i + plain_scalar(s + i, len - i);
+}
+#else
+#define plain_run plain_scalar
+#endif
+
+/* Writes str as a quoted JSON string to out, which has room for
+ * JSON_ESCAPED_MAX(len) bytes, and returns the end. Runs that need no
+ * escaping are copied whole, invalid UTF-8 becomes U+FFFD so the
+ * output always parses. */
+char *json_escape(char *out, const char *str, size_t len)
+{
+  const unsigned char *s = (const unsigned char *) str;
+  size_t i = 0, run;
+  uint32_t cp;
+  int n;
+
+  if (!plain_ready)
+    init_plain();
+
+  *out++ = '"';
+
+  while (i < len)
+  {
+    run = i + plain_run(s + i, len - i);
+
+    if (run > i)
+    {
+      memcpy(out, s + i, run - i);
+      out += run - i;
+      i = run;
+      continue;
+    }
+
+    switch (s[i])
+    {
+    case '"':  out = stpcpy(out, "\\\""); break;
+    case '\\': out = stpcpy(out, "\\\\"); break;
+    case '\t': out = stpcpy(out, "\\t"); break;
+    case '\n': out = stpcpy(out, "\\n"); break;
+    case '\r': out = stpcpy(out, "\\r"); break;
+    default:
+      if (s[i] < 0x20)
+	out += sprintf(out, "\\u%04x", s[i]);
+      else
+      {
+	n = utf8_decode((const char *) s + i, len - i, &cp);
+
+	if (cp == 0xFFFD && n == 1)
+	  out = stpcpy(out, "\\ufffd");
+	else
+	{
+	  memcpy(out, s + i, n);
+	  out += n;
+	}
+
+	i += n;
+	continue;
+      }
+    }
+
+    i++;
+  }
+
+  *out++ = '"';
+
+  return out;
+}
+
+void json_string(FILE *fp, const char *str, size_t len)
+{
+  char buf[JSON_ESCAPED_MAX(256)];
+
+  putc('"', fp);
+
+  /* Pieces go out without their quotes, split on character boundaries
+   * so U+FFFD only replaces bytes that really are invalid */
+  while (len > 256)
+  {
+    size_t n = 256;
+
+    while (n > 0 && ((unsigned char) str[n] & 0xC0) == 0x80)
+      n--;
+    if (n == 0)
+      n = 256;
+
+    fwrite(buf + 1, 1, json_escape(buf, str, n) - buf - 2, fp);
+    str += n;
+    len -= n;
+  }
+
+  fwrite(buf + 1, 1, json_escape(buf, str, len) - buf - 2, fp);
+  putc('"', fp);
+}
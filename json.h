@@ -0,0 +1,13 @@
+#ifndef _JSON_H
+#define _JSON_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Room json_escape() may need for len bytes of input */
+#define JSON_ESCAPED_MAX(len) (6 * (len) + 2)
+
+char *json_escape(char *out, const char *str, size_t len);
+void json_string(FILE *fp, const char *str, size_t len);
+
+#endif /* _JSON_H */
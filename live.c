@@ -0,0 +1,152 @@
+#include <string.h>
+
+#include "live.h"
+#include "mem.h"
+
+void live_init(struct live *l)
+{
+  memset(l, 0, sizeof(*l));
+  pthread_mutex_init(&l->lock, NULL);
+}
+
+/* Sets up an empty ring, the last one is reused when it is the same
+ * size */
+int live_start(struct live *l, size_t size, size_t max_lines)
+{
+  if (size == 0)
+    size = 1;
+
+  if (l->ring == NULL || l->size != size)
+  {
+    mem_free(l->ring);
+    if ((l->ring = mem_malloc(MEM_RECV, size)) == NULL)
+    {
+      l->size = 0;
+      return -1;
+    }
+    l->size = size;
+  }
+
+  l->start = l->len = l->lines = 0;
+  l->max_lines = max_lines > 0 ? max_lines : 1;
+  l->notified = false;
+  __atomic_store_n(&l->stop, false, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+static size_t count_lines(const char *s, size_t len)
+{
+  const char *end = s + len;
+  size_t n = 0;
+
+  while ((s = memchr(s, '\n', end - s)) != NULL)
+  {
+    n++;
+    s++;
+  }
+
+  return n;
+}
+
+/* Drops n bytes from the front */
+static void drop(struct live *l, size_t n)
+{
+  size_t first = l->size - l->start < n ? l->size - l->start : n;
+
+  l->lines -= count_lines(l->ring + l->start, first);
+  l->lines -= count_lines(l->ring, n - first);
+  l->start = (l->start + n) % l->size;
+  l->len -= n;
+}
+
+/* Drops the first line, or everything when the ring holds no line end */
+static void drop_line(struct live *l)
+{
+  size_t first = l->size - l->start < l->len ? l->size - l->start : l->len;
+  char *nl;
+
+  if ((nl = memchr(l->ring + l->start, '\n', first)) != NULL)
+    drop(l, nl - (l->ring + l->start) + 1);
+  else if ((nl = memchr(l->ring, '\n', l->len - first)) != NULL)
+    drop(l, first + (nl - l->ring) + 1);
+  else
+    drop(l, l->len);
+}
+
+/* Adds text, pushing out the oldest lines. Returns true when the UI
+ * needs waking, which is once until it copies the text. */
+bool live_append(struct live *l, const char *data, size_t len)
+{
+  size_t end, first;
+  bool wake;
+  char *nl;
+
+  /* More than fits at once: only its last whole lines are kept */
+  if (len > l->size)
+  {
+    data += len - l->size;
+    len = l->size;
+    if ((nl = memchr(data, '\n', len)) != NULL)
+    {
+      len -= nl + 1 - data;
+      data = nl + 1;
+    }
+  }
+
+  pthread_mutex_lock(&l->lock);
+
+  if (l->len + len > l->size)
+  {
+    drop(l, l->len + len - l->size);
+
+    /* Whatever is left of a cut line goes too */
+    if (l->len > 0 && l->ring[(l->start + l->size - 1) % l->size] != '\n')
+      drop_line(l);
+  }
+
+  end = (l->start + l->len) % l->size;
+  first = l->size - end < len ? l->size - end : len;
+  memcpy(l->ring + end, data, first);
+  memcpy(l->ring, data + first, len - first);
+  l->len += len;
+  l->lines += count_lines(data, len);
+
+  while (l->lines > l->max_lines)
+    drop_line(l);
+
+  wake = !l->notified;
+  l->notified = true;
+
+  pthread_mutex_unlock(&l->lock);
+
+  return wake;
+}
+
+/* Copies the text to out, which has room for size + 1 bytes, and
+ * NUL-terminates it */
+size_t live_copy(struct live *l, char *out)
+{
+  size_t len, first;
+
+  pthread_mutex_lock(&l->lock);
+
+  len = l->len;
+  first = l->size - l->start < len ? l->size - l->start : len;
+  memcpy(out, l->ring + l->start, first);
+  memcpy(out + first, l->ring, len - first);
+  l->notified = false;
+
+  pthread_mutex_unlock(&l->lock);
+
+  out[len] = 0;
+
+  return len;
+}
+
+void live_free(struct live *l)
+{
+  mem_free(l->ring);
+  l->ring = NULL;
+  l->size = l->start = l->len = l->lines = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _LIVE_H
+#define _LIVE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The latest lines of a response that does not end. The fetch thread
+ * appends, the UI copies out what is there; whole lines are dropped
+ * from the front to stay within size bytes and max_lines lines. */
+struct live
+{
+  pthread_mutex_t lock;
+  char *ring;
+  size_t size;
+  size_t start, len;     /* The text begins at start and may wrap */
+  size_t lines;          /* Line ends in the ring */
+  size_t max_lines;
+  bool notified;         /* The UI has been told about new text */
+  bool stop;             /* The UI wants the fetch to end */
+};
+
+void live_init(struct live *l);
+int live_start(struct live *l, size_t size, size_t max_lines);
+bool live_append(struct live *l, const char *data, size_t len);
+size_t live_copy(struct live *l, char *out);
+void live_free(struct live *l);
+
+#endif /* _LIVE_H */
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* ppoll() */
+
 #include <mbedtls/platform.h>
 
 #include <stdio.h>
@@ -5,10 +7,40 @@
 #include <libgen.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <poll.h>
 
-#include "url_parser.h"
 #include "term.h"
 #include "net.h"
+#include "trace.h"
+#include "config.h"
+#include "stats.h"
+#include "mem.h"
+#include "search.h"
+#include "download.h"
+#include "redirect.h"
+#include "tab.h"
+#include "bench.h"
+#include "export.h"
+#include "index.h"
+#include "proxy.h"
+#include "pool.h"
+#include "feeds.h"
+#include "titan.h"
+#include "serve.h"
+
+#define TAB_MAX 16
+
+/* Milliseconds fetches get to end on quit */
+#define EXIT_WAIT 2000
+
+/* Only interrupts the wait for input, which then redraws */
+static void on_resize(int sig)
+{
+}
 
 char *remove_spaces(char *str)
 {
@@ -23,244 +55,303 @@ char *remove_spaces(char *str)
   return str;
 }
 
-void strpre(char* s, const char* t)
-{
-  size_t len = strlen(t);
-  memmove(s + len, s, strlen(s) + 1);
-  memcpy(s, t, len);
-}
-
-void setup_request(struct parsed_url *url, char *get_request)
+/* "ignore", "match", or "smart": ignore case unless the pattern has capitals */
+bool search_ignore_case(char *pattern)
 {
-  char *scheme;
-  char port[10];
-  char *path;
-  char *query;
-  
-  if (url->scheme[0] == 0)
-    scheme = "gemini";
-  else
-    scheme = url->scheme;
-  
-  if (url->port)
-  {
-    strcpy(port, ":");
-    strcat(port, url->port);
-  }
-  else
-    strcpy(port, "");
+  if (!strcmp(cfg.search_case, "ignore"))
+    return true;
+  if (!strcmp(cfg.search_case, "match"))
+    return false;
   
-  if (url->path)
-    path = url->path;
-  else
-    path = "";
-  
-  if (url->query)
-  {
-    query = malloc(strlen(url->query)+1);
-    strcpy(query, "?");
-    strcat(query, url->query);
-  }
-  else
-  {
-    query = malloc(1);
-    strcpy(query, "");
-  }
+  for (; *pattern; pattern++)
+    if (isupper((unsigned char) *pattern))
+      return false;
   
-  sprintf(get_request, "%s://%s%s/%s%s\r\n", scheme, url->host, port, path, query);
-  free(query);
+  return true;
 }
 
-struct response
-{
-  int status;
-  char meta[1025];
-  char *body;
-};
-
-struct response *read_response_header(char *buf)
+/* URL for ":open ARG": a link number on the page, or the URL as typed */
+char *link_target(struct tab *t, char *arg, char *out, size_t len, char *error_msg)
 {
-  char status[3] = "";
-  bool in_meta = false;
-  
-  struct response *resp = malloc(sizeof(struct response));
+  bool isnum = true;
+  char link[1025];
   
-  int i=0;
-  
-  do
+  for (unsigned long i=0; i < strlen(arg); i++)
   {
-    if (buf[0] == 0) /* malformed response */
+    if (!(arg[i] >= '0' && arg[i] <= '9'))
     {
-      strcpy(status, "00");
+      isnum = false;
       break;
     }
-    
-    if (!in_meta)
-    {
-      if (buf[0] == ' ')
-      {
-	in_meta = true;
-	i=0;
-      }
-      else
-      {
-	if (strlen(status) < 2)
-	{
-	  status[i] = buf[0];
-	  i++;
-	}
-	else
-	  strcpy(status, "00");
-      }
-    }
-    else
-    {
-      if (strlen(resp->meta) < 1024)
-      {
-	resp->meta[i] = buf[0];
-	i++;
-      }
-      else
-	break;
-    }
   }
-  while (buf++[0] != '\r');
-  if (buf[0] != '\n')
-    strcpy(status, "00");
-  else
-    buf++;
-  
-  resp->meta[i-1] = 0x0;
-  resp->status = (int) strtol(status, NULL, 10);
+
+  if (!isnum)
+  {
+    snprintf(out, len, "%s", arg);
+    return out;
+  }
   
-  if (status[0] == '2')
-    resp->body = buf;
+  if (!tab_shown(t) || doc_link(&t->doc, strtol(arg, NULL, 10), link, sizeof(link)) < 0)
+    strcpy(error_msg, "Link doesn't exist");
+  else if (resolve_link(t->page_url, link, out, len) < 0)
+    strcpy(error_msg, "Invalid link");
   else
-    resp->body = NULL;
+    return out;
   
-  return resp;
-}
-
-void free_response(struct response *resp)
-{
-  free(resp);
+  return NULL;
 }
 
-void parse_input_url(char *get_request, char *server_name, char *server_port, char *scheme)
+/* Parses the latest live text, keeping the last line in view unless
+ * the page was scrolled up */
+static void live_update(struct tab *t, struct winsize ws)
 {
-  char *tmp;
-
-  if (!strncmp(get_request, "about:", 6))
-  {
-    memmove(get_request, get_request+6, strlen(get_request+6));
-    get_request[strlen(get_request+6)] = 0;
-    strcpy(scheme, "about");
-
-    return;
-  }
-  else if (!(tmp = strstr(get_request, "://")))
-    strpre(get_request, "://");
-  else if (!strncmp(get_request, "file", 4))
-  {
-    memmove(get_request, get_request+7, strlen(get_request+7));
-    get_request[strlen(get_request+7)] = 0;
-    strcpy(scheme, "file");
-
-    return;
-  }    
-  
-  struct parsed_url *url;
-  url = parse_url(get_request);
+  long page_rows = ws.ws_row > 1 ? ws.ws_row - 1 : 1;
+  long total;
   
-  strcpy(scheme, url->scheme);
-  
-  setup_request(url, get_request);
-  
-  /* Setup server details */ 
-  strcpy(server_name, url->host);
-    
-  if (url->port)  
-    strcpy(server_port, url->port);
-  else
-    strcpy(server_port, "1965");
+  tab_live_update(t);
   
-  parsed_url_free(url);
+  if (t->follow)
+  {
+    total = layout_update(&t->layout, &t->doc, ws);
+    t->start_line = total > page_rows ? total - page_rows : 0;
+  }
 }
 
-char *read_file(char *buf, char *file_name)
+/* Draws a loaded tab */
+void draw_page(struct tab *t, struct winsize ws)
 {
-  char ch;
-  int size;
-  int i = 0;
-
-  FILE *fp = fopen(file_name, "r");
-   
-  if(fp != NULL)
+  if (!strcmp(t->scheme, "gemini") || t->scheme[0] == 0 || !strcmp(t->scheme, "titan"))
   {
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    buf = realloc(buf, size+1);
+    char error_text[20] = "";
+    struct response *resp = t->resp;
     
-    while((ch = getc(fp)) != EOF)
-      buf[i++] = ch;
-    
-    fclose(fp);
-    buf[i] = 0;
+    switch (resp != NULL ? resp->status : 0)
+    {
+    case 0:  /* Internal error, or the fetch failed before a header */
+      printf("CLIENT ERROR: %s", t->error_msg[0] ? t->error_msg : "Internal");
+      break;
+    case 10: /* Input */
+    case 11: /* Sensitive Input */
+      break;
+    case 20: /* Print text */
+      if (mime_is_text(resp->meta))
+	print_text(&t->doc, &t->layout, ws, t->start_line, &t->search);
+      else if (t->dl.failed)
+	printf("Download of %s failed", resp->meta);
+      else
+	printf("Saved %s (%s) to %s, %.1f MiB at %.1f MiB/s",
+	       t->page_url, resp->meta, t->dl.path,
+	       t->dl.bytes / 1048576.0, download_rate(&t->dl) / 1048576.0);
+      break;
+    case 30: /* Redirects are followed while fetching */
+    case 31:
+      printf("Redirect to %s", resp->meta);
+      break;
+    case 40: /* Errors */
+      strcpy(error_text, "Temporary failure");
+      goto server_error;
+    case 41:
+      strcpy(error_text, "Server unavailable");
+      goto server_error;
+    case 42:
+      strcpy(error_text, "CGI error");
+      goto server_error;
+    case 43:
+      strcpy(error_text, "Proxy error");
+      goto server_error;
+    case 44:
+      strcpy(error_text, "Slow down");
+      goto server_error;
+    case 50:
+      strcpy(error_text, "Permanent failure");
+      goto server_error;
+    case 51:
+      strcpy(error_text, "Not found");
+      goto server_error;
+    case 52:
+      strcpy(error_text, "Gone");
+      goto server_error;
+    case 53:
+      strcpy(error_text, "Proxy refused");
+      goto server_error;
+    case 59:
+      strcpy(error_text, "Bad request");
+      goto server_error;
+    case 60:
+      strcpy(error_text, "Cert required");
+      goto server_error;
+    case 61:
+      strcpy(error_text, "Cert not allowed");
+      goto server_error;
+    case 62:
+      strcpy(error_text, "Cert not valid");
+      goto server_error;
+    default:
+      printf("CLIENT ERROR: Unknown status");
+      break;
+      
+      /* Print errors */
+    server_error:
+      printf("SERVER ERROR: %s: \"%s\"", error_text, resp->meta);
+      break;
+    }
   }
-  else
-  {
-    buf = realloc(buf, 20);
-
-    strcpy(buf, "File not found");
- }
+  else if (!strcmp(t->scheme, "file") || !strcmp(t->scheme, "about"))
+    print_text(&t->doc, &t->layout, ws, t->start_line, &t->search);
   
-  return buf;
+  fflush(stdout);
 }
 
 int main(int argc, char **argv)
 {
   int exit_code = 0;
   
-  mbedtls_net_context server_fd;
-  mbedtls_entropy_context entropy;
-  mbedtls_ctr_drbg_context ctr_drbg;
-  mbedtls_ssl_context ssl;
-  mbedtls_ssl_config conf;
-  mbedtls_x509_crt cacert;
+  struct session session;
   char *pers = "gemini_client";
-  char certs_path[] = "./certs";
+  char config_path[] = "./gemini.conf";
 
-  struct print_info pinfo;
   bool is_running = true;
   struct winsize ws;
   char command[100] = "";
   char error_msg[100] = "";
+  char status_text[300];
   unsigned long i;
-  int start_line=0;
   static struct termios oldt;
-  bool new_request = true;
+  int wakeup[2];
+  FILE *out = NULL;
+  struct sigaction resize = { .sa_handler = on_resize };
+  sigset_t winch, waiting;
   
-  char server_name[255];
-  char server_port[10];
-  char get_request[1025];
-  char scheme[100];
-
-  pinfo.links = NULL;
+  struct tab *tabs[TAB_MAX];
+  int tabs_len = 0, current = 0;
+  struct tab *t;
   
   /*** INIT ***/
   
-  /* Args */ 
-  if (argc > 1)
-    strcpy(get_request, argv[1]);
-  else
-    strcpy(get_request, "about:newtab");
+  /* The JSON lines get stdout to themselves, diagnostics go to stderr */
+  if (argc > 2 && !strcmp(argv[1], "--to-jsonl"))
+  {
+    if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+    {
+      perror("stdout");
+      return 1;
+    }
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+  }
+  
+  /* Resizes are only let through while waiting for input, before any
+   * thread starts so none of them is interrupted */
+  sigemptyset(&winch);
+  sigaddset(&winch, SIGWINCH);
+  pthread_sigmask(SIG_BLOCK, &winch, &waiting);
+  sigaction(SIGWINCH, &resize, NULL);
+  
+  /* A server closing while a request or upload is still being sent is
+   * a write error, not the end of the program */
+  signal(SIGPIPE, SIG_IGN);
+  
+  /* Config */
+  load_config(config_path);
+  mem_init();
+  trace_open(cfg.trace_file);
+  redirect_load(cfg.cache_dir);
+  feeds_load(cfg.cache_dir);
+  index_start(cfg.cache_dir);
+  pool_start(cfg.parse_threads);
   
   /* Net */
-  init_session(&server_fd, &entropy, &ctr_drbg, &conf, &cacert);
-  init_rng(&entropy, &ctr_drbg, pers);
-  load_tofu_certs(&cacert, certs_path);
+  init_session(&session);
+  strcpy(session.certs_path, "./certs");
+  init_rng(&session.entropy, &session.ctr_drbg, pers);
+  load_tofu_certs(&session.cacert, session.certs_path);
+  setup_conf(&session);
+  
+  if (argc > 2 && !strcmp(argv[1], "--bench-handshake"))
+  {
+    exit_code = bench_handshake(&session, argv[2], argc > 3 ? atoi(argv[3]) : 100);
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (out != NULL)
+  {
+    if (strstr(argv[2], "://") && strncmp(argv[2], "file://", 7))
+      exit_code = export_url(&session, argv[2], out) < 0;
+    else
+      exit_code = export_file(strncmp(argv[2], "file://", 7) ? argv[2] : argv[2]+7, out) < 0;
+    
+    if (fclose(out) != 0)
+      exit_code = 1;
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (argc > 2 && !strcmp(argv[1], "--bench-jsonl"))
+  {
+    exit_code = bench_jsonl(argv[2]);
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (argc > 2 && !strcmp(argv[1], "--bench-parse"))
+  {
+    exit_code = bench_parse(argv[2]);
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (argc > 1 && !strcmp(argv[1], "--bench-url"))
+  {
+    exit_code = bench_url();
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (argc > 1 && !strcmp(argv[1], "--proxy-serve"))
+  {
+    exit_code = proxy_serve(&session, argc > 2 ? argv[2] : cfg.proxy_listen);
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (argc > 1 && !strcmp(argv[1], "--serve-test"))
+  {
+    exit_code = serve_test(&session, argc > 2 ? argv[2] : SERVE_TEST_ADDR);
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (argc > 3 && !strcmp(argv[1], "--upload"))
+  {
+    exit_code = upload_url(&session, argv[2], argv[3]);
+    free_session(&session);
+    return exit_code;
+  }
+  
+  if (argc > 2 && !strcmp(argv[1], "--bench-keys"))
+  {
+    exit_code = bench_keys(argv[2], argc > 3 ? argv[3] : NULL);
+    free_session(&session);
+    return exit_code;
+  }
+  
+  /* Tabs load on their own threads and wake the UI through a pipe */
+  if (pipe(wakeup) < 0)
+  {
+    perror("pipe");
+    return 1;
+  }
+  tabs_init(&session, wakeup[1]);
+  
+  /* Args */ 
+  if ((tabs[0] = tab_new()) == NULL)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  tabs_len = 1;
+  tab_open(tabs[0], argc > 1 ? argv[1] : "about:newtab");
   
   /* Term */ 
   
@@ -269,12 +360,10 @@ int main(int argc, char **argv)
   
   /*** Running ***/
   
-  int buflen = 1;
-  char *buf = malloc(buflen);
-  struct response *resp;
-  
   while(is_running == true)
   {
+    t = tabs[current];
+    
     /* Screensize */
     ioctl(STDIN_FILENO, TIOCGWINSZ, &ws);
     
@@ -283,243 +372,343 @@ int main(int argc, char **argv)
     
     /* Clear screen */
     fputs("\e[H\e[2J\e[3J", stdout);
-    fflush(stdout);
     
-    /* Clears the keyboard buffer */
-    fflush(stdin);
+    uint64_t frame_start = trace_now();
     
-    fputs("Loading...\n", stdout);
-    /* Send recive requests */
-    if (new_request)
+    if (tab_state(t) == TAB_LOADING)
     {
-    request:
-      parse_input_url(get_request, server_name, server_port, scheme);
-      
-      if (!strcmp(scheme, "gemini") || scheme[0] == 0)
-      {
-	open_conn(&server_fd, server_name, server_port);
-	config(&server_fd, &ctr_drbg, &ssl, &conf, &cacert, server_name);
-	check_cert(&ssl, &cacert, certs_path, server_name);
-	handshake(&ssl);
-	request(&ssl, get_request);
-	buf = read_response(&ssl, buf, &buflen); 
-	close_conn(&ssl);
-	
-	free_response(resp);
-	resp = read_response_header(buf);
-      }
-      else if (!strcmp(scheme, "file"))
-	buf = read_file(buf, get_request);
-      else if (!strcmp(scheme, "about"))
-      {
-	strpre(get_request, "built-in/");
-	strcat(get_request, ".gmi");
-	buf = read_file(buf, get_request);
-      }
-      
-      new_request = false;
+      download_status(&t->dl, status_text, sizeof(status_text));
+      if (status_text[0] == 0)
+	upload_status(&t->ul, status_text, sizeof(status_text));
+      printf("Loading %s\n%s", t->get_request, status_text);
+      fflush(stdout);
     }
-
-    /* Free current links */
-    free_info(pinfo);
-
-    fputs("\e[H\e[2J\e[3J", stdout);
-    
-    if (!strcmp(scheme, "gemini") || scheme[0] == 0)
+    else
     {
-      char error_text[20] = "";
+      draw_page(t, ws);
+      stats_frame(trace_now() - frame_start);
       
-      switch (resp->status)
+      /* First paint of a navigation finishes its trace */
+      if (!t->painted)
       {
-      case 0:  /* Internal error */
-	strcpy(error_text, "Internal");
-	goto error;
-      case 10: /* Input */
-      case 11: /* Sensitive Input */
-	break;
-      case 20: /* Print text */
-	pinfo = print_text(resp->body, ws, start_line, true);
-	break;
-      case 30: /* Redirect temporary */
-      case 31: /* Redirect permanent */
-	strcpy(get_request, resp->meta);
-	goto request;
-	break;
-      case 40: /* Errors */
-	strcpy(error_text, "Temporary failure");
-	goto server_error;
-      case 41:
-	strcpy(error_text, "Server unavailable");
-	goto server_error;
-      case 42:
-	strcpy(error_text, "CGI error");
-	goto server_error;
-      case 43:
-	strcpy(error_text, "Proxy error");
-	goto server_error;
-      case 44:
-	strcpy(error_text, "Slow down");
-	goto server_error;
-      case 50:
-	strcpy(error_text, "Permanent failure");
-	goto server_error;
-      case 51:
-	strcpy(error_text, "Not found");
-	goto server_error;
-      case 52:
-	strcpy(error_text, "Gone");
-	goto server_error;
-      case 53:
-	strcpy(error_text, "Proxy refused");
-	goto server_error;
-      case 59:
-	strcpy(error_text, "Bad request");
-	goto server_error;
-      case 60:
-	strcpy(error_text, "Cert required");
-	goto server_error;
-      case 61:
-	strcpy(error_text, "Cert not allowed");
-	goto server_error;
-      case 62:
-	strcpy(error_text, "Cert not valid");
-	goto server_error;
-      default:
-	strcpy(error_text, "Unknown status");
+	t->painted = true;
+	
+	if (t->trace.active)
+	{
+	  trace_mark(&t->trace, PHASE_PAINT);
+	  trace_status(&t->trace, t->timing_text, sizeof(t->timing_text));
+	  trace_end(&t->trace);
+	}
 	
-	/* Print errors */
-      error:
-	printf("CLIENT ERROR: %s", error_text);
-	fflush(stdout);
-	break;
-      server_error:
-	printf("SERVER ERROR: %s: \"%s\"", error_text, resp->meta);
-	fflush(stdout);
-	break;
+	if (t->error_msg[0] != 0)
+	  strcpy(error_msg, t->error_msg);
       }
     }
-    else if (!strcmp(scheme, "file"))
-    {
-      bool is_gmi = false;
-
-      if (!strcmp(get_request+strlen(get_request)-3, "gmi"))
-	is_gmi = true;
-
-      pinfo = print_text(buf, ws, start_line, is_gmi);
-    }
-    else if (!strcmp(scheme, "about"))
-      pinfo = print_text(buf, ws, start_line, true);
     
     /* Set cursor to bottom and display command */
     
     char *display_text;
     
-    if (error_msg[0] != 0)
-      display_text = error_msg;
-    else
-    {
-      display_text = command;
+    if (error_msg[0] == 0)
       /* Show cursor */
       show_cursor(true);
-    }
 
   input:
-    printf("\e[%d;H%s", ws.ws_row, display_text);
+    if (error_msg[0] != 0)
+      display_text = error_msg;
+    else if (command[0] == 0 && cfg.show_timing)
+      display_text = t->timing_text;
+    else
+      display_text = command;
+    
+    /* Which tab this is, once there are several */
+    if (tabs_len > 1)
+      snprintf(status_text, sizeof(status_text), "[%d/%d] %s", current+1, tabs_len, display_text);
+    else
+      snprintf(status_text, sizeof(status_text), "%s", display_text);
+    
+    printf("\e[%d;H%s\e[K", ws.ws_row, status_text);
     fflush(stdout);
     
     /* Clear error message */
     memset(error_msg, 0, sizeof(error_msg));
     
+    /* Wait for a key or a finished tab, a loading tab redraws its
+     * progress every 100ms and a resize right away */
+    struct pollfd fds[2] =
+    {
+      { .fd = STDIN_FILENO, .events = POLLIN },
+      { .fd = wakeup[0], .events = POLLIN },
+    };
+    struct timespec progress = { .tv_nsec = 100000000 };
+    
+    if (ppoll(fds, 2, tab_state(t) == TAB_LOADING ? &progress : NULL, &waiting) <= 0)
+      continue;
+    
+    if (fds[1].revents & POLLIN)
+    {
+      bool finished;
+      struct tab *done = tab_finished(wakeup[0], &finished);
+      
+      if (done != NULL && !finished)
+      {
+	/* More of a live page, shown unless something else is coming */
+	if (done->closed || done->pending[0] != 0)
+	  goto input;
+	live_update(done, ws);
+      }
+      else if (done != NULL && done->closed)
+	tab_free(done);
+      else if (done != NULL && done->pending[0] != 0)
+	tab_open(done, done->pending);
+      else if (done != NULL && done->live.ring != NULL)
+	/* The end of a live page */
+	live_update(done, ws);
+      else if (done != NULL && done != t && done->trace.active)
+      {
+	/* Background tabs are not painted, their trace ends here */
+	trace_status(&done->trace, done->timing_text, sizeof(done->timing_text));
+	trace_end(&done->trace);
+      }
+      
+      if (done == t)
+	continue;
+      goto input;
+    }
+    
     /* Get character */
-    char *token;
+    char *token, input_char;
+    char target[1025];
     bool redraw = false;
-    switch (parse_input(getchar(), command))
+    
+    if (read(STDIN_FILENO, &input_char, 1) != 1)
+      break;
+    
+    switch (parse_input(input_char, command))
     {
     case 0:
       break;
     case 1:      
-      token = strtok(command, " ");
+      /* Search patterns may contain spaces */
+      if (command[0] == '/')
+	token = command;
+      else
+	token = strtok(command, " ");
       
-      if (!strcmp(token, ":quit"))
+      if (token[0] == '/' || !strcmp(token, ":next") || !strcmp(token, ":prev"))
+      {
+	if (!tab_shown(t) || t->doc.text == NULL)
+	  strcpy(error_msg, "Nothing to search");
+	else
+	{
+	  struct search *search = &t->search;
+	  
+	  /* New pattern searches from the top, n/N step from the current match */
+	  if (token[0] == '/' && token[1] != 0)
+	  {
+	    search_build(search, t->doc.text, t->doc.len, token+1,
+			 search_ignore_case(command+1));
+	    search_next(search, 0, true);
+	  }
+	  else if (search->count)
+	  {
+	    if (!strcmp(token, ":prev"))
+	      search_next(search, search->matches[search->current], false);
+	    else
+	      search_next(search, search->matches[search->current]+1, true);
+	  }
+	  
+	  if (search->count)
+	  {
+	    t->start_line = line_at_offset(&t->doc, &t->layout, search->matches[search->current], ws);
+	    snprintf(error_msg, sizeof(error_msg), "/%.60s  %lu of %lu", search->pattern,
+		     (unsigned long) search->current+1, (unsigned long) search->count);
+	    redraw = true;
+	  }
+	  else if (search->pattern[0])
+	    snprintf(error_msg, sizeof(error_msg), "Pattern not found: %.60s", search->pattern);
+	  else
+	    strcpy(error_msg, "No previous search");
+	}
+      }
+      else if (!strcmp(token, ":quit"))
       {
 	is_running = false;
 	redraw = true;
       }
-      else if (!strcmp(token, ":down"))
+      else if (!strcmp(token, ":down") || !strcmp(token, ":up")
+	       || !strcmp(token, ":pagedown") || !strcmp(token, ":pageup")
+	       || !strcmp(token, ":halfdown") || !strcmp(token, ":halfup")
+	       || !strcmp(token, ":top") || !strcmp(token, ":bottom")
+	       || !strcmp(token, ":line"))
       {
-	if (!pinfo.reached_end)
+	if (tab_shown(t))
 	{
-	  start_line++;
+	  /* Scrolling only needs the row index, never a walk of the page */
+	  char *arg = strtok(NULL, " ");
+	  long count = arg != NULL && atol(arg) > 0 ? atol(arg) : 1;
+	  long page_rows = ws.ws_row > 1 ? ws.ws_row - 1 : 1;
+	  long total = layout_update(&t->layout, &t->doc, ws);
+	  long row = t->start_line;
+	  
+	  if (!strcmp(token, ":down"))
+	    row += count;
+	  else if (!strcmp(token, ":up"))
+	    row -= count;
+	  else if (!strcmp(token, ":pagedown"))
+	    row += count * page_rows;
+	  else if (!strcmp(token, ":pageup"))
+	    row -= count * page_rows;
+	  else if (!strcmp(token, ":halfdown"))
+	    row += count * (page_rows / 2 ? page_rows / 2 : 1);
+	  else if (!strcmp(token, ":halfup"))
+	    row -= count * (page_rows / 2 ? page_rows / 2 : 1);
+	  else if (!strcmp(token, ":top"))
+	    row = 0;
+	  else if (!strcmp(token, ":bottom"))
+	    row = total;
+	  else if (t->doc.lines_len > 0)
+	    row = layout_line_row(&t->layout, &t->doc, count - 1);
+	  
+	  /* The last screen ends on the last row */
+	  if (row > total - page_rows)
+	    row = total - page_rows;
+	  if (row < 0)
+	    row = 0;
+	  
+	  if (row != t->start_line)
+	  {
+	    t->start_line = row;
+	    redraw = true;
+	  }
+	  
+	  /* Live pages follow new lines again once back at the end */
+	  t->follow = row >= total - page_rows;
+	}
+      }
+      else if (!strcmp(token, ":open") || !strcmp(token, ":tabopen"))
+      {
+	bool background = !strcmp(token, ":tabopen");
+	
+	token = strtok(NULL, " ");
+	if (token == NULL)
+	  strcpy(error_msg, "Invalid URL");
+	else if (link_target(t, token, target, sizeof(target), error_msg) == NULL)
+	  ;
+	else if (!background)
+	{
+	  tab_open(t, target);
 	  redraw = true;
 	}
+	else if (tabs_len == TAB_MAX)
+	  strcpy(error_msg, "Too many tabs");
+	else if ((tabs[tabs_len] = tab_new()) == NULL)
+	  strcpy(error_msg, "Out of memory");
+	else
+	{
+	  /* Loads while this tab stays in front */
+	  tabs_len++;
+	  tab_open(tabs[tabs_len-1], target);
+	  snprintf(error_msg, sizeof(error_msg), "Opening in tab %d", tabs_len);
+	}
       }
-      else if (!strcmp(token, ":up"))
+      else if (!strcmp(token, ":tabnew"))
       {
-	if (start_line > 0)
+	token = strtok(NULL, " ");
+	
+	if (tabs_len == TAB_MAX)
+	  strcpy(error_msg, "Too many tabs");
+	else if ((tabs[tabs_len] = tab_new()) == NULL)
+	  strcpy(error_msg, "Out of memory");
+	else
 	{
-	  start_line--;
+	  current = tabs_len++;
+	  tab_open(tabs[current], token != NULL ? token : "about:newtab");
 	  redraw = true;
 	}
-      } 
-      else if (!strcmp(token, ":open"))
+      }
+      else if (!strcmp(token, ":tabnext") || !strcmp(token, ":tabprev"))
+      {
+	/* Tabs keep their parsed page, switching is only a redraw */
+	if (!strcmp(token, ":tabnext"))
+	  current = (current + 1) % tabs_len;
+	else
+	  current = (current + tabs_len - 1) % tabs_len;
+	redraw = true;
+      }
+      else if (!strcmp(token, ":tabclose"))
+      {
+	/* A tab still loading is freed when its fetch is done */
+	if (tab_state(t) == TAB_LOADING || tab_state(t) == TAB_LIVE)
+	{
+	  t->closed = true;
+	  tab_stop(t);
+	}
+	else
+	  tab_free(t);
+	
+	memmove(tabs + current, tabs + current + 1, (tabs_len - current - 1) * sizeof(struct tab *));
+	tabs_len--;
+	
+	if (tabs_len == 0)
+	  is_running = false;
+	else if (current == tabs_len)
+	  current--;
+	redraw = true;
+      }
+      else if (!strcmp(token, ":help"))
+      {
+	tab_open(t, "about:help");
+	redraw = true;
+      }
+      else if (!strcmp(token, ":refresh"))
+      {
+	/* Fetched on the tab's thread, the UI stays usable */
+	tab_open(t, "about:feeds?refresh");
+	redraw = true;
+      }
+      else if (!strcmp(token, ":subscribe"))
       {
 	token = strtok(NULL, " ");
-	if (token != NULL)
+	
+	if (token != NULL && link_target(t, token, target, sizeof(target), error_msg) == NULL)
+	  ;
+	else
 	{
-	  bool isnum = true;
-	  for (unsigned long i=0; i < strlen(token); i++)
-	  {
-	    if (!(token[i] >= '0' && token[i] <= '9'))
-	    {
-	      isnum = false;
-	      break;
-	    }
-	  }
-
-	  if (isnum)
-	  {
-	    long num = strtol(token, NULL, 10);
-	    char new_get_request[1025];
-
-	    if (num < pinfo.links_len)
-	    {
-	      strcpy(new_get_request, pinfo.links[num]);
-	      
-	      if (!strstr(new_get_request, "://"))
-	      {
-		int i,j;
-	      
-		for (i = strlen(get_request); i; i--)
-		  if (get_request[i] == '/')
-		    break;
-		
-		for (j = 0; j < 1024; j++)
-		  get_request[i+j+1] = new_get_request[j];
-		
-		get_request[i+j] = 0;
-	      }
-	      else
-		strcpy(get_request, new_get_request);
-
-	      new_request = true;
-	    }
-	    else
-	      strcpy(error_msg, "Link doesn't exist");
-	  }
+	  char *url = token != NULL ? target : t->page_url;
+	  int ret = feeds_subscribe(url);
+	  
+	  if (ret == 0)
+	    snprintf(error_msg, sizeof(error_msg), "Subscribed to %.80s", url);
+	  else if (ret == 1)
+	    strcpy(error_msg, "Already subscribed");
 	  else
-	  {
-	    strcpy(get_request, token);
-	    new_request = true;
-	  }
+	    strcpy(error_msg, "Only gemini:// pages can be subscribed to");
 	}
-	else	
-	  strcpy(error_msg, "Invalid URL");
       }
-      else if (!strcmp(token, ":help"))
+      else if (!strcmp(token, ":upload"))
       {
-	strcpy(get_request, "about:help");
-	new_request = true;
+	char *path = strtok(NULL, " ");
+	
+	/* Without a URL the page itself is replaced */
+	token = strtok(NULL, " ");
+	if (token == NULL && !strncmp(t->page_url, "gemini://", 9))
+	{
+	  snprintf(target, sizeof(target), "titan%s", t->page_url + 6);
+	  token = target;
+	}
+	
+	if (path == NULL || token == NULL)
+	  strcpy(error_msg, "Usage: :upload FILE [titan://URL]");
+	else if (strncmp(token, "titan://", 8))
+	  strcpy(error_msg, "Uploads go to titan:// URLs");
+	else if (tab_upload(t, token, path) < 0)
+	  strcpy(error_msg, "Wait for the page to finish loading");
+	else
+	  redraw = true;
       }
+      else if (!strcmp(token, ":timing"))
+	cfg.show_timing = !cfg.show_timing;
       else if (strcmp(token, ":")) /* Ignore empty command */
 	strcpy(error_msg, "Unknown command");
       
@@ -527,28 +716,36 @@ int main(int argc, char **argv)
       for (i = 0; i < sizeof(command); i++)
 	command[i] = 0x0;
 
-      if (new_request)
-	redraw = true;
-
       if (!redraw)
 	goto input;
       
       break;
     }
+    
+    if (!redraw)
+      goto input;
   }
   
   /*** EXIT ***/
   
-  /* Free */
-  free_session(&server_fd, &entropy, &ctr_drbg, &conf, &cacert);
-  free(buf);
-  free_response(resp);
-  free_info(pinfo);
-  
-  /* Term */
+  /* Term, first so nothing below can leave it raw */
   reset_term(oldt);
   show_cursor(true);
   
+  /* Fetches still running use the session and the caches, they are
+   * stopped and joined first. Any that will not end keep them. */
+  if (tabs_stop(wakeup[0], EXIT_WAIT))
+  {
+    for (int j = 0; j < tabs_len; j++)
+      tab_free(tabs[j]);
+    free_session(&session);
+    redirect_free();
+    feeds_free();
+  }
+  index_stop();
+  trace_close();
+  stats_dump(cfg.stats_file);
+  
   if(exit_code != MBEDTLS_EXIT_SUCCESS)
   {
     char error_buf[100];
@@ -0,0 +1,180 @@
+#include <mbedtls/platform.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+/* Every allocation is prefixed with its size and tag */
+union mem_header
+{
+  struct
+  {
+    size_t size;
+    enum mem_tag tag;
+  } h;
+  max_align_t align;
+};
+
+struct mem_counter mem_counters[MEM_COUNT];
+static struct mem_counter mem_total;
+
+static const char *tag_names[MEM_COUNT] =
+{
+  "TLS",
+  "Receive buffer",
+  "Document/links",
+  "URL parsing",
+  "Caches",
+};
+
+static void update_peak(uint64_t *peak, uint64_t current)
+{
+  uint64_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+  while (current > seen
+	 && !__atomic_compare_exchange_n(peak, &seen, current, true,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Fetches run on their own threads, so counters are atomic */
+static void account(enum mem_tag tag, long long size)
+{
+  struct mem_counter *c = &mem_counters[tag];
+
+  update_peak(&c->peak, __atomic_add_fetch(&c->current, size, __ATOMIC_RELAXED));
+  update_peak(&mem_total.peak, __atomic_add_fetch(&mem_total.current, size, __ATOMIC_RELAXED));
+}
+
+void *mem_malloc(enum mem_tag tag, size_t size)
+{
+  union mem_header *hdr = malloc(sizeof(union mem_header) + size);
+
+  if (hdr == NULL)
+    return NULL;
+
+  hdr->h.size = size;
+  hdr->h.tag = tag;
+  __atomic_fetch_add(&mem_counters[tag].allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mem_total.allocs, 1, __ATOMIC_RELAXED);
+  account(tag, size);
+  
+  return hdr + 1;
+}
+
+void *mem_calloc(enum mem_tag tag, size_t n, size_t size)
+{
+  void *ptr;
+
+  if (size && n > SIZE_MAX / size)
+    return NULL;
+  
+  if ((ptr = mem_malloc(tag, n * size)) != NULL)
+    memset(ptr, 0, n * size);
+
+  return ptr;
+}
+
+void *mem_realloc(enum mem_tag tag, void *ptr, size_t size)
+{
+  union mem_header *hdr;
+  size_t old;
+  
+  if (ptr == NULL)
+    return mem_malloc(tag, size);
+
+  hdr = (union mem_header *) ptr - 1;
+  old = hdr->h.size;
+  tag = hdr->h.tag;
+  
+  if ((hdr = realloc(hdr, sizeof(union mem_header) + size)) == NULL)
+    return NULL;
+
+  hdr->h.size = size;
+  account(tag, (long long) size - (long long) old);
+  
+  return hdr + 1;
+}
+
+void mem_free(void *ptr)
+{
+  union mem_header *hdr;
+  
+  if (ptr == NULL)
+    return;
+
+  hdr = (union mem_header *) ptr - 1;
+  __atomic_fetch_add(&mem_counters[hdr->h.tag].frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mem_total.frees, 1, __ATOMIC_RELAXED);
+  account(hdr->h.tag, -(long long) hdr->h.size);
+  free(hdr);
+}
+
+static void *tls_calloc(size_t n, size_t size)
+{
+  return mem_calloc(MEM_TLS, n, size);
+}
+
+static bool tls_tracked = false;
+
+void mem_init()
+{
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+  mbedtls_platform_set_calloc_free(tls_calloc, mem_free);
+  tls_tracked = true;
+#else
+  (void) tls_calloc;
+#endif
+}
+
+static void write_counter(FILE *fp, const char *name, struct mem_counter *c)
+{
+  fprintf(fp, "* %s: %.1f KiB, peak %.1f KiB, %lu allocations, %lu live\n",
+	  name, c->current / 1024.0, c->peak / 1024.0,
+	  (unsigned long) c->allocs, (unsigned long) (c->allocs - c->frees));
+}
+
+/* Gemtext report for about:memory */
+char *mem_page(char *buf)
+{
+  char *page = NULL;
+  size_t size;
+  long rss = 0;
+  FILE *fp;
+
+  if ((fp = fopen("/proc/self/statm", "r")) != NULL)
+  {
+    if (fscanf(fp, "%*s %ld", &rss) != 1)
+      rss = 0;
+    fclose(fp);
+  }
+  
+  if ((fp = open_memstream(&page, &size)) == NULL)
+    return buf;
+
+  fputs("# Memory\n\n", fp);
+  fputs("## Subsystems\n\n", fp);
+  
+  for (int i = 0; i < MEM_COUNT; i++)
+    write_counter(fp, tag_names[i], &mem_counters[i]);
+  
+  fputs("\n", fp);
+  write_counter(fp, "Total", &mem_total);
+  
+  if (rss)
+    fprintf(fp, "* Resident: %.1f KiB\n", rss * sysconf(_SC_PAGESIZE) / 1024.0);
+
+  if (!tls_tracked)
+    fputs("\nTLS allocations are not tracked, mbedtls was built without MBEDTLS_PLATFORM_MEMORY\n", fp);
+  
+  fclose(fp);
+
+  buf = mem_realloc(MEM_RECV, buf, size+1);
+  memcpy(buf, page, size+1);
+  free(page);
+  
+  return buf;
+}
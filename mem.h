@@ -0,0 +1,34 @@
+#ifndef _MEM_H
+#define _MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum mem_tag
+{
+  MEM_TLS,      /* mbedtls, through mbedtls_platform_set_calloc_free() */
+  MEM_RECV,     /* Receive buffer */
+  MEM_DOC,      /* Response header, document and links */
+  MEM_URL,      /* URL parsing */
+  MEM_CACHE,    /* Caches kept across pages */
+  MEM_COUNT,
+};
+
+struct mem_counter
+{
+  uint64_t current;
+  uint64_t peak;
+  uint64_t allocs;
+  uint64_t frees;
+};
+
+extern struct mem_counter mem_counters[MEM_COUNT];
+
+void mem_init();
+void *mem_malloc(enum mem_tag tag, size_t size);
+void *mem_calloc(enum mem_tag tag, size_t n, size_t size);
+void *mem_realloc(enum mem_tag tag, void *ptr, size_t size);
+void mem_free(void *ptr);
+char *mem_page(char *buf);
+
+#endif /* _MEM_H */
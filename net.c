@@ -1,7 +1,38 @@
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <mbedtls/ssl_ciphersuites.h>
+#include <mbedtls/ecp.h>
 
 #include "net.h"
+#include "config.h"
+#include "url_parser.h"
+
+/* Fetches run on their own threads and share the certificate chain */
+static pthread_rwlock_t cert_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* And the random generator, which mbedtls only locks itself when built
+ * with MBEDTLS_THREADING_C */
+static pthread_mutex_t rng_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int locked_random(void *ctr_drbg, unsigned char *out, size_t len)
+{
+  int ret;
+
+  pthread_mutex_lock(&rng_lock);
+  ret = mbedtls_ctr_drbg_random(ctr_drbg, out, len);
+  pthread_mutex_unlock(&rng_lock);
+
+  return ret;
+}
 
 static void my_debug(void *ctx, int level,
 		     const char *file, int line,
@@ -13,17 +44,12 @@ static void my_debug(void *ctx, int level,
   fflush( (FILE *)ctx );
 }
 
-void init_session(mbedtls_net_context *server_fd,
-		  mbedtls_entropy_context *entropy,
-		  mbedtls_ctr_drbg_context *ctr_drbg,
-		  mbedtls_ssl_config *conf,
-		  mbedtls_x509_crt *cacert)
+void init_session(struct session *s)
 {
-  mbedtls_net_init(server_fd);
-  mbedtls_ctr_drbg_init(ctr_drbg);
-  mbedtls_ssl_config_init(conf);
-  mbedtls_x509_crt_init(cacert);
-  mbedtls_entropy_init(entropy);
+  mbedtls_ctr_drbg_init(&s->ctr_drbg);
+  mbedtls_ssl_config_init(&s->conf);
+  mbedtls_x509_crt_init(&s->cacert);
+  mbedtls_entropy_init(&s->entropy);
 }
 
 int init_rng(mbedtls_entropy_context *entropy, mbedtls_ctr_drbg_context *ctr_drbg, char *pers)
@@ -49,28 +75,263 @@ int load_tofu_certs(mbedtls_x509_crt *cacert, char *certs_path)
   return ret;
 }
 
-int open_conn(mbedtls_net_context *server_fd, char *server_name, char *server_port)
+/* Milliseconds until the nearer of the phase and fetch deadlines,
+ * or -1 without either */
+static int conn_remaining(struct conn *c)
+{
+  uint64_t now = trace_now(), until = 0;
+
+  if (c->deadline && (until == 0 || c->deadline < until))
+    until = c->deadline;
+  if (c->end && (until == 0 || c->end < until))
+    until = c->end;
+
+  if (until == 0)
+    return -1;
+  if (until <= now)
+    return 0;
+
+  /* Rounded up, a 0 timeout would block for ever in mbedtls */
+  return (until - now + 999) / 1000;
+}
+
+/* The phase deadline is timeout_ms from now, 0 for none */
+void conn_deadline(struct conn *c, int timeout_ms)
+{
+  c->deadline = timeout_ms > 0 ? trace_now() + timeout_ms * 1000ULL : 0;
+}
+
+static int conn_send(void *ctx, const unsigned char *buf, size_t len)
+{
+  return mbedtls_net_send(&((struct conn *) ctx)->net, buf, len);
+}
+
+/* timeout is the read_timeout idle limit, the deadlines can only
+ * shorten it */
+static int conn_recv(void *ctx, unsigned char *buf, size_t len, uint32_t timeout)
+{
+  struct conn *c = ctx;
+  int remaining = conn_remaining(c);
+
+  if (remaining == 0)
+    return MBEDTLS_ERR_SSL_TIMEOUT;
+  if (remaining > 0 && (timeout == 0 || (uint32_t) remaining < timeout))
+    timeout = remaining;
+
+  return mbedtls_net_recv_timeout(&c->net, buf, len, timeout);
+}
+
+/* Non-blocking connect to each address in turn until the connect
+ * deadline. getaddrinfo() itself cannot be bounded. */
+static int connect_timeout(struct conn *c, char *server_name, char *server_port)
+{
+  struct addrinfo hints, *list, *cur;
+  int ret = MBEDTLS_ERR_NET_UNKNOWN_HOST;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  if (getaddrinfo(server_name, server_port, &hints, &list) != 0)
+    return MBEDTLS_ERR_NET_UNKNOWN_HOST;
+
+  for (cur = list; cur != NULL; cur = cur->ai_next)
+  {
+    struct pollfd pfd;
+    int fd, err = 0;
+    socklen_t err_len = sizeof(err);
+
+    fd = socket(cur->ai_family, cur->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		cur->ai_protocol);
+    if (fd < 0)
+    {
+      ret = MBEDTLS_ERR_NET_SOCKET_FAILED;
+      continue;
+    }
+
+    if (connect(fd, cur->ai_addr, cur->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+      close(fd);
+      ret = MBEDTLS_ERR_NET_CONNECT_FAILED;
+      continue;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    if (poll(&pfd, 1, conn_remaining(c)) == 0)
+    {
+      close(fd);
+      ret = MBEDTLS_ERR_SSL_TIMEOUT;
+      break;
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0)
+    {
+      close(fd);
+      ret = MBEDTLS_ERR_NET_CONNECT_FAILED;
+      continue;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    c->net.fd = fd;
+    ret = 0;
+    break;
+  }
+
+  freeaddrinfo(list);
+
+  return ret;
+}
+
+/* total_ms bounds everything from here to the end of the response.
+ * Failures here and below are returned, not printed, since fetches run
+ * while the screen is drawn; the caller says what went wrong. */
+int open_conn(struct conn *c, char *server_name, char *server_port, int total_ms)
 {
   int ret;
   
-  if((ret = mbedtls_net_connect(server_fd, server_name,
-				server_port, MBEDTLS_NET_PROTO_TCP))!= 0)
-    printf("Connecting to tcp failed\n  ! mbedtls_net_connect returned %d\n\n", ret);
+  mbedtls_net_init(&c->net);
+  c->end = total_ms > 0 ? trace_now() + total_ms * 1000ULL : 0;
+  conn_deadline(c, cfg.connect_timeout);
+  
+  if((ret = connect_timeout(c, server_name, server_port))!= 0)
+    return ret;
+  
+  /* mbedtls writes each handshake message on its own, which Nagle
+   * holds back until the server's delayed ACK, about 40ms a flight */
+  setsockopt(c->net.fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
   
   return ret;
 }
 
-int config(mbedtls_net_context *server_fd,
-	   mbedtls_ctr_drbg_context *ctr_drbg,
-	   mbedtls_ssl_context *ssl,
-	   mbedtls_ssl_config *conf,
-	   mbedtls_x509_crt *cacert,
-	   char *server_name)
+/* Preference lists handed to mbedtls, which keeps the pointers */
+static int ciphersuites[256];
+static mbedtls_ecp_group_id curves[32];
+
+/* Append id unless it is already there or mbedtls lacks it */
+static void add_ciphersuite(int *len, int id)
+{
+  if (*len >= (int) (sizeof(ciphersuites)/sizeof(int)) - 1
+      || mbedtls_ssl_ciphersuite_from_id(id) == NULL)
+    return;
+
+  for (int i = 0; i < *len; i++)
+    if (ciphersuites[i] == id)
+      return;
+
+  ciphersuites[(*len)++] = id;
+}
+
+static void add_curve(int *len, mbedtls_ecp_group_id id)
+{
+  const mbedtls_ecp_group_id *have;
+
+  if (*len >= (int) (sizeof(curves)/sizeof(curves[0])) - 1)
+    return;
+
+  for (int i = 0; i < *len; i++)
+    if (curves[i] == id)
+      return;
+
+  for (have = mbedtls_ecp_grp_id_list(); *have != MBEDTLS_ECP_DP_NONE; have++)
+    if (*have == id)
+    {
+      curves[(*len)++] = id;
+      return;
+    }
+}
+
+/* AES-GCM only beats ChaCha20-Poly1305 with hardware AES */
+static bool have_aes()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("aes");
+#elif defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* ECDHE first, ECDSA before RSA since capsules mostly use EC keys and
+ * the signature is cheaper to check, then whatever else mbedtls has.
+ * tls_ciphers replaces the preferred part with its own list. */
+static void setup_ciphersuites(mbedtls_ssl_config *conf)
+{
+  int len = 0;
+  const int *id;
+
+  if (strcmp(cfg.tls_ciphers, "auto"))
+  {
+    char list[sizeof(cfg.tls_ciphers)], *name, *save;
+
+    strcpy(list, cfg.tls_ciphers);
+    for (name = strtok_r(list, ", ", &save); name; name = strtok_r(NULL, ", ", &save))
+      add_ciphersuite(&len, mbedtls_ssl_get_ciphersuite_id(name));
+  }
+  else if (have_aes())
+  {
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256);
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256);
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256);
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256);
+  }
+  else
+  {
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256);
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256);
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256);
+    add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256);
+  }
+
+  add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384);
+  add_ciphersuite(&len, MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384);
+
+  for (id = mbedtls_ssl_list_ciphersuites(); *id != 0; id++)
+    add_ciphersuite(&len, *id);
+
+  ciphersuites[len] = 0;
+  mbedtls_ssl_conf_ciphersuites(conf, ciphersuites);
+}
+
+/* X25519 is several times faster than the NIST curves in mbedtls */
+static void setup_curves(mbedtls_ssl_config *conf)
+{
+  int len = 0;
+  const mbedtls_ecp_group_id *id;
+
+  if (strcmp(cfg.tls_curves, "auto"))
+  {
+    char list[sizeof(cfg.tls_curves)], *name, *save;
+    const mbedtls_ecp_curve_info *info;
+
+    strcpy(list, cfg.tls_curves);
+    for (name = strtok_r(list, ", ", &save); name; name = strtok_r(NULL, ", ", &save))
+      if ((info = mbedtls_ecp_curve_info_from_name(name)) != NULL)
+	add_curve(&len, info->grp_id);
+  }
+  else
+  {
+    add_curve(&len, MBEDTLS_ECP_DP_CURVE25519);
+    add_curve(&len, MBEDTLS_ECP_DP_SECP256R1);
+    add_curve(&len, MBEDTLS_ECP_DP_SECP384R1);
+  }
+
+  for (id = mbedtls_ecp_grp_id_list(); *id != MBEDTLS_ECP_DP_NONE; id++)
+    add_curve(&len, *id);
+
+  curves[len] = MBEDTLS_ECP_DP_NONE;
+  mbedtls_ssl_conf_curves(conf, curves);
+}
+
+/* Shared by every connection, so it is set up once */
+int setup_conf(struct session *s)
 {
   int ret;
-  
-  /* Setup SSL context */
-  mbedtls_ssl_init(ssl);
+  mbedtls_ssl_config *conf = &s->conf;
   
   if((ret = mbedtls_ssl_config_defaults(conf,
 					MBEDTLS_SSL_IS_CLIENT,
@@ -78,67 +339,176 @@ int config(mbedtls_net_context *server_fd,
 					MBEDTLS_SSL_PRESET_DEFAULT))!= 0)
   {
     printf("Setting up the SSL/TLS structure failed\n  ! mbedtls_ssl_config_defaults returned %d\n\n", ret);
-    goto exit;
+    return ret;
   } 
   
   /* OPTIONAL is not optimal for security,
    * but makes interop easier in this simplified example */
   mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
-  mbedtls_ssl_conf_ca_chain(conf, cacert, NULL);
-  mbedtls_ssl_conf_rng(conf, mbedtls_ctr_drbg_random, ctr_drbg);
+  mbedtls_ssl_conf_ca_chain(conf, &s->cacert, NULL);
+  mbedtls_ssl_conf_rng(conf, locked_random, &s->ctr_drbg);
   mbedtls_ssl_conf_dbg(conf, my_debug, stdout);
+  mbedtls_ssl_conf_read_timeout(conf, 10000);
   
-  if((ret = mbedtls_ssl_setup(ssl, conf))!= 0)
-  {
-    printf("Setting up the SSL/TLS structure failed\n  ! mbedtls_ssl_setup returned %d\n\n", ret);
+  setup_ciphersuites(conf);
+  setup_curves(conf);
+  
+  return ret;
+}
+
+int config(struct conn *c,
+	   mbedtls_ssl_context *ssl,
+	   struct session *s,
+	   char *server_name)
+{
+  int ret;
+  
+  /* Setup SSL context */
+  mbedtls_ssl_init(ssl);
+  
+  if((ret = mbedtls_ssl_setup(ssl, &s->conf))!= 0)
     goto exit;
-  }
   
   if((ret = mbedtls_ssl_set_hostname(ssl, server_name))!= 0)
-  {
-    printf("Setting up the SSL/TLS structure failed\n  ! mbedtls_ssl_set_hostname returned %d\n\n", ret);
     goto exit;
+  
+  mbedtls_ssl_set_bio(ssl, c, conn_send, NULL, conn_recv);
+  
+exit:
+  return ret;
+}
+
+/* The proxy's side: the same suites and curves, no client certificates */
+int setup_server_conf(struct session *s, mbedtls_ssl_config *conf,
+		      mbedtls_x509_crt *cert, mbedtls_pk_context *key)
+{
+  int ret;
+  
+  if((ret = mbedtls_ssl_config_defaults(conf,
+					MBEDTLS_SSL_IS_SERVER,
+					MBEDTLS_SSL_TRANSPORT_STREAM,
+					MBEDTLS_SSL_PRESET_DEFAULT))!= 0)
+  {
+    printf("Setting up the SSL/TLS structure failed\n  ! mbedtls_ssl_config_defaults returned %d\n\n", ret);
+    return ret;
   }
   
+  mbedtls_ssl_conf_authmode(conf, MBEDTLS_SSL_VERIFY_NONE);
+  mbedtls_ssl_conf_rng(conf, locked_random, &s->ctr_drbg);
   mbedtls_ssl_conf_read_timeout(conf, 10000);
-  mbedtls_ssl_set_bio(ssl, server_fd, mbedtls_net_send, mbedtls_net_recv, mbedtls_net_recv_timeout);
   
-exit:
+  setup_ciphersuites(conf);
+  setup_curves(conf);
+  
+  if((ret = mbedtls_ssl_conf_own_cert(conf, cert, key))!= 0)
+    printf("Setting up the SSL/TLS structure failed\n  ! mbedtls_ssl_conf_own_cert returned %d\n\n", ret);
+  
   return ret;
 }
 
-int check_cert(mbedtls_ssl_context *ssl, mbedtls_x509_crt *cacert, char *certs_path, char *server_name)
+/* An accepted connection, read through the same deadlines */
+int config_server(struct conn *c, mbedtls_ssl_context *ssl, mbedtls_ssl_config *conf)
+{
+  int ret;
+  
+  c->deadline = 0;
+  c->end = 0;
+  setsockopt(c->net.fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  
+  mbedtls_ssl_init(ssl);
+  
+  if((ret = mbedtls_ssl_setup(ssl, conf))!= 0)
+  {
+    printf("Setting up the SSL/TLS structure failed\n  ! mbedtls_ssl_setup returned %d\n\n", ret);
+    return ret;
+  }
+  
+  mbedtls_ssl_set_bio(ssl, c, conn_send, NULL, conn_recv);
+  
+  return 0;
+}
+
+int send_all(mbedtls_ssl_context *ssl, const char *buf, size_t len)
+{
+  int ret;
+
+  while (len > 0)
+  {
+    ret = mbedtls_ssl_write(ssl, (const unsigned char *) buf, len);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (ret <= 0)
+      return -1;
+
+    buf += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+/* A client's request line, without CRLF. Returns how many bytes came
+ * after it, such as the start of a titan:// upload, which are left in
+ * line past the CRLF. */
+int read_request(mbedtls_ssl_context *ssl, char *line, size_t size)
+{
+  size_t len = 0;
+  char *end;
+  int ret;
+
+  while (len + 1 < size)
+  {
+    ret = mbedtls_ssl_read(ssl, (unsigned char *) line + len, size - len - 1);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (ret <= 0)
+      return -1;
+
+    len += ret;
+    line[len] = 0;
+
+    if ((end = strstr(line, "\r\n")) != NULL)
+    {
+      *end = 0;
+      return len - (end + 2 - line);
+    }
+  }
+
+  return -1;
+}
+
+int check_cert(mbedtls_ssl_context *ssl, struct session *s, char *server_name)
 {
   uint32_t ret;
   
   if((ret = mbedtls_ssl_get_verify_result(ssl))!= 0)
   {
+    mbedtls_x509_crt *cacert = &s->cacert;
+    char *certs_path = s->certs_path;
     mbedtls_x509_crt peer_cert;
     FILE *fp;
     char buf[512];
     
     sprintf(buf, "%s/%s.crt", certs_path, server_name);
     
-    /* Check if PEM exists */
-    if (access(buf, F_OK) != -1) {
-      /* If it does and it didn't validate, exit */
-      
-      printf("Verifying peer X.509 certificate failed\n");
-      
-      mbedtls_x509_crt_verify_info(buf, sizeof(buf), "  ! ", ret);
-      
-      printf("%s\n", buf);
-    } else {
+    /* One already saved that did not validate is left to the caller,
+     * resumed sessions may not have the peer's */
+    if (access(buf, F_OK) == -1 && mbedtls_ssl_get_peer_cert(ssl) != NULL) {
       /* Save cert if it didn't exist */
       peer_cert = *mbedtls_ssl_get_peer_cert(ssl);
-      fp = fopen(buf, "w"); 
       
-      for (int i = 0; (unsigned long) i < peer_cert.raw.len; i++)
-	fprintf(fp, "%c", peer_cert.raw.p[i]);
+      /* Without certs_path it is only trusted until exit */
+      if ((fp = fopen(buf, "w")) != NULL)
+      {
+	fwrite(peer_cert.raw.p, 1, peer_cert.raw.len, fp);
+	fclose(fp);
+      }
       
+      pthread_rwlock_wrlock(&cert_lock);
       mbedtls_x509_crt_parse_der(cacert, peer_cert.raw.p, peer_cert.raw.len);
-      
-      fclose(fp);
+      pthread_rwlock_unlock(&cert_lock);
     }
   }
   
@@ -149,15 +519,17 @@ int handshake(mbedtls_ssl_context *ssl)
 {
   int ret;
   
+  /* Verification reads the certificates TOFU adds to */
+  pthread_rwlock_rdlock(&cert_lock);
+  
   while((ret = mbedtls_ssl_handshake(ssl))!= 0)
   {
     if(ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
-    {
-      printf("Performing the SSL/TLS handshake failed\n  ! mbedtls_ssl_handshake returned -0x%x\n\n", (unsigned int)-ret);
       break;
-    }
   }
   
+  pthread_rwlock_unlock(&cert_lock);
+  
   return ret;
 }
 
@@ -165,30 +537,63 @@ int request(mbedtls_ssl_context *ssl, char *request)
 {
   int ret;
   
-  while((ret = mbedtls_ssl_write(ssl, (unsigned char *) request, strlen(request)+1))<= 0)
+  while((ret = mbedtls_ssl_write(ssl, (unsigned char *) request, strlen(request)))<= 0)
   {
     if(ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
-    {
-      printf(" failed\n  ! mbedtls_ssl_write returned %d\n\n", ret);
       break;
-    }
   }
   
   return ret;
 }
 
-char *read_response(mbedtls_ssl_context *ssl, char *buf, int *buflen)
+/* Reads records until the body holds the whole header line, the rest
+ * of the response is left to read_response() or download(). Returns
+ * the mbedtls error, MBEDTLS_ERR_SSL_TIMEOUT past a deadline. */
+int read_header(mbedtls_ssl_context *ssl, struct spill *body,
+		struct trace *trace)
 {
-  int len, ret;
-  char tmp[1024];
+  int ret;
+  char tmp[16384];
+  
+  spill_reset(body);
+  
+  do
+  {
+    ret = mbedtls_ssl_read(ssl, (unsigned char *) tmp, sizeof(tmp));
+    
+    if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    
+    if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == 0)
+      return -1;
+    
+    if(ret < 0)
+      return ret;
+    
+    trace_mark(trace, PHASE_FIRST_BYTE);
+    
+    if (spill_append(body, tmp, ret) < 0)
+      return -1;
+  }
+  while(strstr(body->data, "\r\n") == NULL && body->len < 1029);
   
-  buf[0] = 0;
+  return 0;
+}
+
+/* Appends records to the body until the server closes it or a
+ * deadline passes, which returns MBEDTLS_ERR_SSL_TIMEOUT and may be
+ * read on from. With cs each record is converted to UTF-8 as it comes,
+ * NULL appends it as it is. The caller finishes the body with
+ * charset_finish() and spill_finish(). */
+int read_response(mbedtls_ssl_context *ssl, struct spill *body,
+		  struct charset *cs, struct trace *trace)
+{
+  int ret;
+  char tmp[16384];
   
   do
   {
-    len = sizeof(tmp)- 1;
-    memset(tmp, 0, sizeof(tmp));
-    ret = mbedtls_ssl_read(ssl, (unsigned char *) tmp, len);
+    ret = mbedtls_ssl_read(ssl, (unsigned char *) tmp, sizeof(tmp));
     
     if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
       continue;
@@ -196,41 +601,133 @@ char *read_response(mbedtls_ssl_context *ssl, char *buf, int *buflen)
     if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
       break;
     
+    if(ret == MBEDTLS_ERR_SSL_TIMEOUT)
+      return ret;
+    
     if(ret < 0)
-    {
-      printf("read failed\n  ! mbedtls_ssl_read returned %d\n\n", ret);
       break;
-    }
     
     if(ret == 0)
       break;
     
-    len = ret;
-    *buflen += len;
-    buf = realloc(buf, *buflen);
-    strcat(buf, tmp);
-    buf[*buflen-1] = 0;
+    if ((cs != NULL ? charset_append(cs, body, tmp, ret)
+	 : spill_append(body, tmp, ret)) < 0)
+      break;
   }
   while(1);
   
-  return buf;
+  return 0;
+}
+
+/* HOST and PORT of url, 1965 when it has none, without the brackets of
+ * IPv6 literals which getaddrinfo() and the certificate files do without */
+int url_address(const char *url, char *host, size_t host_len, char *port, size_t port_len)
+{
+  struct url_view view;
+  size_t len;
+  
+  if (url_parse(url, strlen(url), &view) < 0
+      || url_part_copy(&view, view.host, host, host_len) <= 0)
+    return -1;
+  
+  if (url_part_copy(&view, view.port, port, port_len) <= 0)
+    snprintf(port, port_len, "1965");
+  
+  if (host[0] == '[')
+  {
+    if ((len = strlen(host)) < 3 || host[len - 1] != ']')
+      return -1;
+    memmove(host, host + 1, len - 2);
+    host[len - 2] = 0;
+  }
+  
+  return 0;
+}
+
+/* Connects to host and shakes hands, trusting its certificate on first
+ * use. total_ms is open_conn()'s. Marks PHASE_CONNECT and PHASE_HANDSHAKE
+ * on trace, which may be NULL, and on failure sets phase to the one that
+ * failed. Closed with close_conn() either way. */
+int dial(struct conn *c, mbedtls_ssl_context *ssl, struct session *s,
+	 char *host, char *port, int total_ms, const struct dial_hooks *hooks,
+	 struct trace *trace, const char **phase)
+{
+  int ret;
+  
+  mbedtls_ssl_init(ssl);
+  
+  *phase = "Connect";
+  if ((ret = open_conn(c, host, port, total_ms)) != 0)
+    return ret;
+  if (hooks != NULL && hooks->connected != NULL)
+    hooks->connected(hooks->ctx, c);
+  trace_mark(trace, PHASE_CONNECT);
+  
+  *phase = "Handshake";
+  conn_deadline(c, cfg.handshake_timeout);
+  if ((ret = config(c, ssl, s, host)) != 0)
+    return ret;
+  if (hooks != NULL && hooks->resume != NULL)
+    hooks->resume(hooks->ctx, ssl);
+  if ((ret = handshake(ssl)) != 0)
+    return ret;
+  if (hooks != NULL && hooks->save != NULL)
+    hooks->save(hooks->ctx, ssl);
+  check_cert(ssl, s, host);
+  trace_mark(trace, PHASE_HANDSHAKE);
+  
+  return 0;
+}
+
+/* Sends the request line and reads the response header into head, as
+ * read_header() does. What the sent hook sends after the line, a titan://
+ * upload, takes as long as it needs. Sets phase like dial(). */
+int fetch_header(struct conn *c, mbedtls_ssl_context *ssl, char *request_line,
+		 const struct dial_hooks *hooks, struct spill *head,
+		 struct trace *trace, const char **phase)
+{
+  int ret;
+  
+  request(ssl, request_line);
+  if (hooks != NULL && hooks->sent != NULL)
+  {
+    conn_deadline(c, 0);
+    c->end = 0;
+    hooks->sent(hooks->ctx, ssl);
+  }
+  trace_mark(trace, PHASE_REQUEST);
+  
+  *phase = "Response";
+  conn_deadline(c, cfg.first_byte_timeout);
+  if ((ret = read_header(ssl, head, trace)) != 0)
+    return ret;
+  conn_deadline(c, 0);
+  
+  return 0;
+}
+
+/* What went wrong at phase, for whoever is told */
+void dial_error(char *out, size_t len, const char *phase, int ret, const char *host)
+{
+  if (ret == MBEDTLS_ERR_SSL_TIMEOUT)
+    snprintf(out, len, "%s timed out", phase);
+  else if (ret == MBEDTLS_ERR_NET_UNKNOWN_HOST)
+    snprintf(out, len, "Unknown host %.60s", host);
+  else
+    snprintf(out, len, "%s failed", phase);
 }
 
-void close_conn(mbedtls_ssl_context *ssl)
+void close_conn(struct conn *c, mbedtls_ssl_context *ssl)
 {
   mbedtls_ssl_close_notify(ssl);
   mbedtls_ssl_free(ssl);
+  mbedtls_net_free(&c->net);
 }
 
-void free_session(mbedtls_net_context *server_fd,
-		  mbedtls_entropy_context *entropy,
-		  mbedtls_ctr_drbg_context *ctr_drbg,
-		  mbedtls_ssl_config *conf,
-		  mbedtls_x509_crt *cacert)
+void free_session(struct session *s)
 {
-  mbedtls_net_free(server_fd); 
-  mbedtls_x509_crt_free(cacert);
-  mbedtls_ssl_config_free(conf);
-  mbedtls_ctr_drbg_free(ctr_drbg);
-  mbedtls_entropy_free(entropy);
+  mbedtls_x509_crt_free(&s->cacert);
+  mbedtls_ssl_config_free(&s->conf);
+  mbedtls_ctr_drbg_free(&s->ctr_drbg);
+  mbedtls_entropy_free(&s->entropy);
 }
@@ -1,3 +1,6 @@
+#ifndef _NET_H
+#define _NET_H
+
 #include <mbedtls/net_sockets.h>
 #include <mbedtls/debug.h>
 #include <mbedtls/ssl.h>
@@ -7,38 +10,91 @@
 #include <mbedtls/certs.h>
 #include <mbedtls/base64.h>
 
-void init_session(mbedtls_net_context *server_fd,
-		  mbedtls_entropy_context *entropy,
-		  mbedtls_ctr_drbg_context *ctr_drbg,
-		  mbedtls_ssl_config *conf,
-		  mbedtls_x509_crt *cacert);
+#include "trace.h"
+#include "spill.h"
+#include "charset.h"
+
+/* TLS state shared by every connection */
+struct session
+{
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context ctr_drbg;
+  mbedtls_ssl_config conf;
+  mbedtls_x509_crt cacert;
+  char certs_path[256];
+};
+
+/* A connection's socket and the deadlines its reads are held to, in
+ * trace_now() microseconds with 0 for none */
+struct conn
+{
+  mbedtls_net_context net;
+  uint64_t deadline;   /* The current phase, see conn_deadline() */
+  uint64_t end;        /* The whole fetch */
+};
+
+/* Steps callers of dial() and fetch_header() add, any may be NULL */
+struct dial_hooks
+{
+  void *ctx;
+  void (*connected)(void *ctx, struct conn *c);         /* Before the handshake */
+  void (*resume)(void *ctx, mbedtls_ssl_context *ssl);  /* Offer a saved session */
+  void (*save)(void *ctx, mbedtls_ssl_context *ssl);    /* Keep the new one */
+  void (*sent)(void *ctx, mbedtls_ssl_context *ssl);    /* After the request line */
+};
+
+void init_session(struct session *s);
 
 int init_rng(mbedtls_entropy_context *entropy, mbedtls_ctr_drbg_context *ctr_drbg, char *pers);
 
 int load_tofu_certs(mbedtls_x509_crt *cacert, char *certs_path);
 
-int open_conn(mbedtls_net_context *server_fd, char *server_name, char *server_port);
+int setup_conf(struct session *s);
 
-int config(mbedtls_net_context *server_fd,
-	   mbedtls_ctr_drbg_context *ctr_drbg,
+int open_conn(struct conn *c, char *server_name, char *server_port, int total_ms);
+
+void conn_deadline(struct conn *c, int timeout_ms);
+
+int config(struct conn *c,
 	   mbedtls_ssl_context *ssl,
-	   mbedtls_ssl_config *conf,
-	   mbedtls_x509_crt *cacert,
+	   struct session *s,
 	   char *server_name);
 
-int check_cert(mbedtls_ssl_context *ssl, mbedtls_x509_crt *cacert,
-	       char *certs_path, char *server_name);
+int setup_server_conf(struct session *s, mbedtls_ssl_config *conf,
+		      mbedtls_x509_crt *cert, mbedtls_pk_context *key);
+
+int config_server(struct conn *c, mbedtls_ssl_context *ssl, mbedtls_ssl_config *conf);
+
+int send_all(mbedtls_ssl_context *ssl, const char *buf, size_t len);
+
+int read_request(mbedtls_ssl_context *ssl, char *line, size_t size);
+
+int check_cert(mbedtls_ssl_context *ssl, struct session *s, char *server_name);
 
 int handshake(mbedtls_ssl_context *ssl);
 
 int request(mbedtls_ssl_context *ssl, char *request);
 
-char *read_response(mbedtls_ssl_context *ssl, char *buf, int *buflen);
+int read_header(mbedtls_ssl_context *ssl, struct spill *body,
+		struct trace *trace);
+
+int read_response(mbedtls_ssl_context *ssl, struct spill *body,
+		  struct charset *cs, struct trace *trace);
+
+int url_address(const char *url, char *host, size_t host_len, char *port, size_t port_len);
+
+int dial(struct conn *c, mbedtls_ssl_context *ssl, struct session *s,
+	 char *host, char *port, int total_ms, const struct dial_hooks *hooks,
+	 struct trace *trace, const char **phase);
+
+int fetch_header(struct conn *c, mbedtls_ssl_context *ssl, char *request_line,
+		 const struct dial_hooks *hooks, struct spill *head,
+		 struct trace *trace, const char **phase);
+
+void dial_error(char *out, size_t len, const char *phase, int ret, const char *host);
+
+void close_conn(struct conn *c, mbedtls_ssl_context *ssl);
 
-void close_conn(mbedtls_ssl_context *ssl);
+void free_session(struct session *s);
 
-void free_session(mbedtls_net_context *server_fd,
-		  mbedtls_entropy_context *entropy,
-		  mbedtls_ctr_drbg_context *ctr_drbg,
-		  mbedtls_ssl_config *conf,
-		  mbedtls_x509_crt *cacert);
+#endif /* _NET_H */
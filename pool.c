@@ -0,0 +1,118 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* Worker threads for splitting one large piece of work, such as a
+ * long page, across cores. The thread that asks takes part in its job
+ * too. There is one job at a time: a second caller does its work
+ * alone rather than wait. */
+
+#define POOL_MAX 64
+
+struct job
+{
+  pool_fn fn;
+  void *arg;
+  size_t n;
+  size_t next;       /* Next task to hand out */
+  int users;         /* Workers that may still touch the job */
+};
+
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct job *pool_job;
+static uint64_t pool_generation;
+static size_t pool_threads;
+
+static void work(struct job *j)
+{
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->n)
+    j->fn(j->arg, i);
+}
+
+static void *worker(void *arg)
+{
+  uint64_t seen = 0;
+  struct job *j;
+
+  pthread_mutex_lock(&pool_lock);
+  for (;;)
+  {
+    while (pool_job == NULL || pool_generation == seen)
+      pthread_cond_wait(&pool_start_cond, &pool_lock);
+
+    seen = pool_generation;
+    j = pool_job;
+    j->users++;
+    pthread_mutex_unlock(&pool_lock);
+
+    work(j);
+
+    pthread_mutex_lock(&pool_lock);
+    if (--j->users == 0)
+      pthread_cond_signal(&pool_done);
+  }
+
+  return NULL;
+}
+
+/* Starts threads - 1 workers, threads 0 means one per core */
+void pool_start(int threads)
+{
+  pthread_t thread;
+
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > POOL_MAX)
+    threads = POOL_MAX;
+
+  for (int i = 1; i < threads; i++)
+  {
+    if (pthread_create(&thread, NULL, worker, NULL) != 0)
+      break;
+    pthread_detach(thread);
+    pool_threads++;
+  }
+}
+
+/* Threads a job runs on, the caller's included */
+size_t pool_size(void)
+{
+  return pool_threads + 1;
+}
+
+/* Runs fn for every task of the job and returns once all are done */
+void pool_run(pool_fn fn, void *arg, size_t n)
+{
+  struct job j = { fn, arg, n, 0, 0 };
+
+  if (n < 2 || pool_threads == 0 || pthread_mutex_trylock(&pool_busy) != 0)
+  {
+    work(&j);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  pool_job = &j;
+  pool_generation++;
+  pthread_cond_broadcast(&pool_start_cond);
+  pthread_mutex_unlock(&pool_lock);
+
+  work(&j);
+
+  /* Workers that picked the job up late find nothing left to do */
+  pthread_mutex_lock(&pool_lock);
+  pool_job = NULL;
+  while (j.users > 0)
+    pthread_cond_wait(&pool_done, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+
+  pthread_mutex_unlock(&pool_busy);
+}
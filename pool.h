@@ -0,0 +1,13 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stddef.h>
+
+/* One task of a job, i goes from 0 to the job's count */
+typedef void (*pool_fn)(void *arg, size_t i);
+
+void pool_start(int threads);
+size_t pool_size(void);
+void pool_run(pool_fn fn, void *arg, size_t n);
+
+#endif /* _POOL_H */
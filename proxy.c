@@ -0,0 +1,725 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "proxy.h"
+#include "config.h"
+#include "url_parser.h"
+#include "mem.h"
+#include "hash.h"
+#include "trace.h"
+
+/* Caching proxy: clients send the absolute URL of any capsule, each URL
+ * is fetched once however many clients ask for it at the same time, and
+ * complete 2x responses are served from memory for proxy_ttl seconds.
+ * Clients are sent a response while it is still arriving. */
+
+#define PROXY_BUCKETS 1024
+#define PROXY_CHUNK 16384
+#define PROXY_HOSTS 64
+#define SERVER_CLIENTS_MAX 256
+
+struct reader
+{
+  size_t sent;               /* Bytes of the response this client has */
+  bool cut;                  /* Fell too far behind a large response */
+  struct reader *next;
+};
+
+struct entry
+{
+  char url[1025];
+  uint64_t hash;
+  struct entry *next;        /* Same bucket */
+  struct entry *newer, *older;
+  char *data;                /* The response from base on */
+  size_t base, len, size;
+  bool done;
+  bool listed;               /* Found by URL, otherwise the last reader frees it */
+  bool cached;               /* Complete and on the LRU list */
+  uint64_t expires;
+  int users;
+  struct reader *readers;
+  pthread_cond_t cond;       /* More data, or done */
+};
+
+/* Upstream TLS sessions by host, resumed to skip full handshakes */
+struct warm
+{
+  char host[255];
+  char port[10];
+  bool valid;
+  mbedtls_ssl_session session;
+};
+
+static struct session *session;
+static mbedtls_ssl_config server_conf;
+static char listen_host[255], listen_port[10];
+
+static pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct entry *table[PROXY_BUCKETS];
+static struct entry *newest = NULL, *oldest = NULL;
+static size_t cached_bytes = 0;
+
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct warm warm[PROXY_HOSTS];
+static int warm_next = 0;
+
+/* HOST:PORT, [ADDRESS]:PORT for IPv6, or HOST alone for 1965 */
+int proxy_address(const char *addr, char *host, size_t host_len,
+		  char *port, size_t port_len)
+{
+  const char *start = addr, *end, *colon;
+
+  if (addr[0] == '[')
+  {
+    start++;
+    if ((end = strchr(start, ']')) == NULL)
+      return -1;
+    colon = end[1] == ':' ? end + 1 : NULL;
+  }
+  else if ((colon = end = strrchr(addr, ':')) == NULL)
+    end = addr + strlen(addr);
+
+  if (end == start || (size_t) (end - start) >= host_len)
+    return -1;
+
+  memcpy(host, start, end - start);
+  host[end - start] = 0;
+  snprintf(port, port_len, "%s", colon != NULL ? colon + 1 : "1965");
+
+  return port[0] ? 0 : -1;
+}
+
+/* A response may grow this large before what every reader already has
+ * is dropped, which also keeps it out of the cache */
+static size_t entry_max()
+{
+  return cfg.proxy_cache / 4 > (1 << 20) ? cfg.proxy_cache / 4 : 1 << 20;
+}
+
+static void entry_free(struct entry *e)
+{
+  pthread_cond_destroy(&e->cond);
+  mem_free(e->data);
+  mem_free(e);
+}
+
+/* The rest need proxy_lock */
+
+static struct entry *find(const char *url, uint64_t hash)
+{
+  struct entry *e;
+
+  for (e = table[hash % PROXY_BUCKETS]; e != NULL; e = e->next)
+    if (e->hash == hash && !strcmp(e->url, url))
+      return e;
+
+  return NULL;
+}
+
+static void lru_unlink(struct entry *e)
+{
+  if (e->newer)
+    e->newer->older = e->older;
+  else
+    newest = e->older;
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    oldest = e->newer;
+}
+
+static void lru_push(struct entry *e)
+{
+  e->older = newest;
+  e->newer = NULL;
+  if (newest)
+    newest->newer = e;
+  else
+    oldest = e;
+  newest = e;
+}
+
+/* New readers no longer find it, it goes with its last reader */
+static void unlist(struct entry *e)
+{
+  struct entry **p = &table[e->hash % PROXY_BUCKETS];
+
+  while (*p != e)
+    p = &(*p)->next;
+  *p = e->next;
+  e->listed = false;
+
+  if (e->cached)
+  {
+    lru_unlink(e);
+    cached_bytes -= e->len;
+    e->cached = false;
+  }
+
+  if (e->users == 0)
+    entry_free(e);
+}
+
+/* Attaches a reader to the response for url. The first one, *fetch,
+ * fetches it for everyone, *hit is set when it is already complete. */
+static struct entry *join(const char *url, struct reader *r, bool *fetch, bool *hit)
+{
+  uint64_t hash = hash_bytes(url, strlen(url));
+  struct entry *e;
+
+  pthread_mutex_lock(&proxy_lock);
+
+  /* Expired, or already too large to be read from the start */
+  e = find(url, hash);
+  if (e != NULL && ((e->cached && trace_now() >= e->expires) || e->base > 0))
+  {
+    unlist(e);
+    e = NULL;
+  }
+
+  if ((*fetch = e == NULL))
+  {
+    if ((e = mem_calloc(MEM_CACHE, 1, sizeof(struct entry))) == NULL)
+    {
+      pthread_mutex_unlock(&proxy_lock);
+      return NULL;
+    }
+
+    snprintf(e->url, sizeof(e->url), "%s", url);
+    e->hash = hash;
+    pthread_cond_init(&e->cond, NULL);
+
+    e->next = table[hash % PROXY_BUCKETS];
+    table[hash % PROXY_BUCKETS] = e;
+    e->listed = true;
+  }
+  else if (e->cached)
+  {
+    lru_unlink(e);
+    lru_push(e);
+  }
+
+  *hit = e->done;
+  r->sent = 0;
+  r->cut = false;
+  r->next = e->readers;
+  e->readers = r;
+  e->users++;
+
+  pthread_mutex_unlock(&proxy_lock);
+
+  return e;
+}
+
+static void leave(struct entry *e, struct reader *r)
+{
+  struct reader **p;
+
+  pthread_mutex_lock(&proxy_lock);
+
+  for (p = &e->readers; *p != r; p = &(*p)->next)
+    ;
+  *p = r->next;
+
+  if (--e->users == 0 && !e->listed)
+    entry_free(e);
+
+  pthread_mutex_unlock(&proxy_lock);
+}
+
+/* Whether anyone reads on, or still may. Once no reader is left one
+ * that is no longer found by URL, or is past its start, has none to
+ * come. */
+static bool wanted(struct entry *e)
+{
+  bool ret;
+
+  pthread_mutex_lock(&proxy_lock);
+  ret = e->readers != NULL || (e->listed && e->base == 0);
+  pthread_mutex_unlock(&proxy_lock);
+
+  return ret;
+}
+
+/* Adds bytes from upstream for every reader. Past entry_max() what all
+ * of them have is dropped, and readers more than half of it behind are
+ * cut, so the data is not moved again for a while. */
+static int append(struct entry *e, const char *buf, size_t len)
+{
+  size_t end, keep;
+  int ret = 0;
+
+  pthread_mutex_lock(&proxy_lock);
+
+  end = e->base + e->len;
+
+  if (e->len + len > entry_max())
+  {
+    keep = end;
+    for (struct reader *r = e->readers; r != NULL; r = r->next)
+      if (!r->cut && r->sent < keep)
+	keep = r->sent;
+
+    if (end + len - keep > entry_max() / 2)
+      keep = end + len - entry_max() / 2;
+
+    for (struct reader *r = e->readers; r != NULL; r = r->next)
+      if (r->sent < keep)
+	r->cut = true;
+
+    memmove(e->data, e->data + (keep - e->base), end - keep);
+    e->len = end - keep;
+    e->base = keep;
+  }
+
+  if (e->len + len > e->size)
+  {
+    size_t size = e->size ? e->size : 1 << 16;
+    char *tmp;
+
+    while (size < e->len + len)
+      size *= 2;
+
+    if ((tmp = mem_realloc(MEM_CACHE, e->data, size)) == NULL)
+      ret = -1;
+    else
+    {
+      e->data = tmp;
+      e->size = size;
+    }
+  }
+
+  if (ret == 0)
+  {
+    memcpy(e->data + e->len, buf, len);
+    e->len += len;
+  }
+
+  pthread_cond_broadcast(&e->cond);
+  pthread_mutex_unlock(&proxy_lock);
+
+  return ret;
+}
+
+/* Complete 2x responses are kept, least recently used out first */
+static void finish(struct entry *e, bool complete)
+{
+  pthread_mutex_lock(&proxy_lock);
+
+  e->done = true;
+
+  if (e->listed && complete && e->base == 0 && e->len >= 2 && e->data[0] == '2'
+      && cfg.proxy_ttl > 0 && e->len <= cfg.proxy_cache)
+  {
+    char *tmp = mem_realloc(MEM_CACHE, e->data, e->len);
+
+    if (tmp != NULL)
+    {
+      e->data = tmp;
+      e->size = e->len;
+    }
+
+    e->cached = true;
+    e->expires = trace_now() + cfg.proxy_ttl * 1000000ULL;
+    lru_push(e);
+    cached_bytes += e->len;
+
+    while (cached_bytes > cfg.proxy_cache)
+      unlist(oldest);
+  }
+  else if (e->listed)
+    unlist(e);
+
+  pthread_cond_broadcast(&e->cond);
+  pthread_mutex_unlock(&proxy_lock);
+}
+
+static void advance(struct reader *r, size_t len)
+{
+  pthread_mutex_lock(&proxy_lock);
+  r->sent += len;
+  pthread_mutex_unlock(&proxy_lock);
+}
+
+/* A reader sends what the fetch adds, until it is done or the reader
+ * is cut */
+static void follow(struct entry *e, struct reader *r, mbedtls_ssl_context *ssl)
+{
+  char buf[PROXY_CHUNK];
+  size_t len;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&proxy_lock);
+
+    while (!r->cut && r->sent == e->base + e->len && !e->done)
+      pthread_cond_wait(&e->cond, &proxy_lock);
+
+    if (r->cut || r->sent == e->base + e->len)
+    {
+      pthread_mutex_unlock(&proxy_lock);
+      return;
+    }
+
+    len = e->base + e->len - r->sent;
+    if (len > sizeof(buf))
+      len = sizeof(buf);
+    memcpy(buf, e->data + (r->sent - e->base), len);
+
+    pthread_mutex_unlock(&proxy_lock);
+
+    if (send_all(ssl, buf, len) < 0)
+      return;
+    advance(r, len);
+  }
+}
+
+/* ctx is a struct warm naming the host, as the hooks of dial() */
+static void warm_resume(void *ctx, mbedtls_ssl_context *ssl)
+{
+  const char *host = ((struct warm *) ctx)->host, *port = ((struct warm *) ctx)->port;
+
+  pthread_mutex_lock(&warm_lock);
+
+  for (int i = 0; i < PROXY_HOSTS; i++)
+    if (warm[i].valid && !strcmp(warm[i].host, host) && !strcmp(warm[i].port, port))
+    {
+      mbedtls_ssl_set_session(ssl, &warm[i].session);
+      break;
+    }
+
+  pthread_mutex_unlock(&warm_lock);
+}
+
+static void warm_save(void *ctx, mbedtls_ssl_context *ssl)
+{
+  const char *host = ((struct warm *) ctx)->host, *port = ((struct warm *) ctx)->port;
+  struct warm *w = NULL;
+
+  pthread_mutex_lock(&warm_lock);
+
+  for (int i = 0; i < PROXY_HOSTS && w == NULL; i++)
+    if (warm[i].valid && !strcmp(warm[i].host, host) && !strcmp(warm[i].port, port))
+      w = &warm[i];
+
+  /* Hosts take turns in the slots */
+  if (w == NULL)
+  {
+    w = &warm[warm_next];
+    warm_next = (warm_next + 1) % PROXY_HOSTS;
+  }
+
+  if (w->valid)
+    mbedtls_ssl_session_free(&w->session);
+  mbedtls_ssl_session_init(&w->session);
+
+  w->valid = mbedtls_ssl_get_session(ssl, &w->session) == 0;
+  snprintf(w->host, sizeof(w->host), "%s", host);
+  snprintf(w->port, sizeof(w->port), "%s", port);
+
+  pthread_mutex_unlock(&warm_lock);
+}
+
+/* The reply everyone who joined gets when there is no response */
+static void fail(struct entry *e, const char *reason)
+{
+  char reply[100];
+  int len = snprintf(reply, sizeof(reply), "43 %s\r\n", reason);
+
+  append(e, reply, len);
+  finish(e, false);
+}
+
+/* Reads the response into e for its readers, the first one's client
+ * included, so no client's writes hold up the others */
+static void fetch(struct entry *e)
+{
+  char line[1030], error[100], buf[PROXY_CHUNK];
+  struct warm host = {0};
+  struct dial_hooks hooks = { .ctx = &host, .resume = warm_resume, .save = warm_save };
+  struct conn conn;
+  mbedtls_ssl_context ssl;
+  const char *phase;
+  bool started = false;
+  int ret;
+
+  if (url_address(e->url, host.host, sizeof(host.host), host.port, sizeof(host.port)) < 0)
+  {
+    fail(e, "Bad URL");
+    return;
+  }
+
+  if ((ret = dial(&conn, &ssl, session, host.host, host.port, cfg.total_timeout,
+		  &hooks, NULL, &phase)) != 0)
+  {
+    close_conn(&conn, &ssl);
+    dial_error(error, sizeof(error), phase, ret, host.host);
+    fail(e, error);
+    return;
+  }
+
+  snprintf(line, sizeof(line), "%s\r\n", e->url);
+  send_all(&ssl, line, strlen(line));
+  conn_deadline(&conn, cfg.first_byte_timeout);
+
+  for (;;)
+  {
+    ret = mbedtls_ssl_read(&ssl, (unsigned char *) buf, sizeof(buf));
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (ret <= 0)
+      break;
+
+    /* Large responses take as long as data keeps coming */
+    if (!started)
+    {
+      conn_deadline(&conn, 0);
+      conn.end = 0;
+      started = true;
+    }
+
+    /* Others may still want it after the first client is gone */
+    if (append(e, buf, ret) < 0 || !wanted(e))
+      break;
+  }
+
+  close_conn(&conn, &ssl);
+
+  if (!started)
+  {
+    dial_error(error, sizeof(error), "Response", ret, host.host);
+    fail(e, error);
+  }
+  else
+    finish(e, ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY);
+}
+
+static void *fetch_thread(void *arg)
+{
+  struct entry *e = arg;
+
+  fetch(e);
+
+  pthread_mutex_lock(&proxy_lock);
+  if (--e->users == 0 && !e->listed)
+    entry_free(e);
+  pthread_mutex_unlock(&proxy_lock);
+
+  return NULL;
+}
+
+/* The fetch holds e like a reader would, on a thread of its own or
+ * here when there is none */
+static void start_fetch(struct entry *e)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  pthread_mutex_lock(&proxy_lock);
+  e->users++;
+  pthread_mutex_unlock(&proxy_lock);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, fetch_thread, e) != 0)
+    fetch_thread(e);
+  pthread_attr_destroy(&attr);
+}
+
+/* The URL responses are kept by, or the reply refusing the request */
+static const char *check_request(char *line, char *url, size_t len)
+{
+  struct url_view view;
+  char scheme[16], host[255], port[10], *fragment;
+
+  if (url_parse(line, strlen(line), &view) < 0
+      || url_part_copy(&view, view.host, host, sizeof(host)) <= 0)
+    return "59 Bad request\r\n";
+
+  if (url_part_copy(&view, view.scheme, scheme, sizeof(scheme)) <= 0
+      || strcmp(scheme, "gemini"))
+    return "53 Only gemini:// is proxied\r\n";
+
+  if (url_part_copy(&view, view.port, port, sizeof(port)) <= 0)
+    strcpy(port, "1965");
+
+  if (!strcmp(port, listen_port)
+      && (!strcmp(host, listen_host) || !strcmp(host, "localhost")
+	  || !strcmp(host, "127.0.0.1") || !strcmp(host, "[::1]")))
+    return "53 That is this proxy\r\n";
+
+  if (url_normalize(line, url, len) < 0)
+    return "59 Bad request\r\n";
+
+  if ((fragment = strchr(url, '#')) != NULL)
+    *fragment = 0;
+
+  return NULL;
+}
+
+static void serve(struct client *c)
+{
+  char url[1025];
+  const char *reply;
+  struct reader r;
+  struct entry *e;
+  bool leader, hit;
+
+  if ((reply = check_request(c->line, url, sizeof(url))) != NULL)
+  {
+    send_all(&c->ssl, reply, strlen(reply));
+    return;
+  }
+
+  if ((e = join(url, &r, &leader, &hit)) == NULL)
+  {
+    send_all(&c->ssl, "43 Out of memory\r\n", 18);
+    return;
+  }
+
+  if (leader)
+    start_fetch(e);
+  follow(e, &r, &c->ssl);
+
+  printf("%-4s %6.1fms %9lu %s%s\n", leader ? "miss" : hit ? "hit" : "join",
+	 (trace_now() - c->start) / 1000.0, (unsigned long) r.sent, url, r.cut ? " (cut)" : "");
+
+  leave(e, &r);
+}
+
+/* Loads proxy_cert and proxy_key into conf and binds addr, saying on
+ * stderr what went wrong. --proxy-serve and --serve-test share it. */
+int server_listen(struct session *s, const char *addr, mbedtls_ssl_config *conf,
+		  mbedtls_net_context *listen, char *host, size_t host_len,
+		  char *port, size_t port_len)
+{
+  static mbedtls_x509_crt cert;
+  static mbedtls_pk_context key;
+
+  if (proxy_address(addr, host, host_len, port, port_len) < 0)
+  {
+    fprintf(stderr, "Bad address: %s\n", addr);
+    return -1;
+  }
+
+  mbedtls_x509_crt_init(&cert);
+  mbedtls_pk_init(&key);
+
+  if (mbedtls_x509_crt_parse_file(&cert, cfg.proxy_cert) != 0
+      || mbedtls_pk_parse_keyfile(&key, cfg.proxy_key, NULL) != 0)
+  {
+    fprintf(stderr, "Could not load %s and %s, they can be made with\n"
+	    "  openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes"
+	    " -days 3650 -subj /CN=%s -keyout %s -out %s\n",
+	    cfg.proxy_cert, cfg.proxy_key, host, cfg.proxy_key, cfg.proxy_cert);
+    return -1;
+  }
+
+  mbedtls_ssl_config_init(conf);
+  if (setup_server_conf(s, conf, &cert, &key) != 0)
+    return -1;
+
+  mbedtls_net_init(listen);
+  if (mbedtls_net_bind(listen, host, port, MBEDTLS_NET_PROTO_TCP) != 0)
+  {
+    fprintf(stderr, "Could not listen on %s\n", addr);
+    return -1;
+  }
+
+  /* Clients that go away are noticed through write errors */
+  signal(SIGPIPE, SIG_IGN);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  return 0;
+}
+
+/* Clients of server_accept() being answered */
+static int clients = 0;
+
+/* Shakes hands and reads the request for the client's handler */
+static void *client_thread(void *arg)
+{
+  struct client *c = arg;
+
+  c->start = trace_now();
+
+  if (config_server(&c->conn, &c->ssl, c->conf) != 0)
+    goto close;
+
+  conn_deadline(&c->conn, cfg.handshake_timeout);
+  if (handshake(&c->ssl) != 0)
+    goto close;
+
+  conn_deadline(&c->conn, cfg.first_byte_timeout);
+  if ((c->got = read_request(&c->ssl, c->line, sizeof(c->line))) < 0)
+    goto close;
+  conn_deadline(&c->conn, 0);
+
+  c->handler(c);
+
+ close:
+  close_conn(&c->conn, &c->ssl);
+  mem_free(c);
+  __atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+
+  return NULL;
+}
+
+/* Accepts clients on listen until killed, each on its own thread where
+ * handler answers it. --proxy-serve and --serve-test share it. */
+int server_accept(mbedtls_net_context *listen, mbedtls_ssl_config *conf,
+		  void (*handler)(struct client *c))
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  struct client *c;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;)
+  {
+    if ((c = mem_malloc(MEM_TLS, sizeof(struct client))) == NULL)
+      return 1;
+
+    mbedtls_net_init(&c->conn.net);
+    if (mbedtls_net_accept(listen, &c->conn.net, NULL, 0, NULL) != 0)
+    {
+      mem_free(c);
+      continue;
+    }
+    c->conf = conf;
+    c->handler = handler;
+
+    if (__atomic_add_fetch(&clients, 1, __ATOMIC_RELAXED) > SERVER_CLIENTS_MAX
+	|| pthread_create(&thread, &attr, client_thread, c) != 0)
+    {
+      __atomic_sub_fetch(&clients, 1, __ATOMIC_RELAXED);
+      mbedtls_net_free(&c->conn.net);
+      mem_free(c);
+    }
+  }
+
+  return 0;
+}
+
+int proxy_serve(struct session *s, const char *addr)
+{
+  mbedtls_net_context listen;
+
+  session = s;
+
+  if (server_listen(s, addr, &server_conf, &listen, listen_host, sizeof(listen_host),
+		    listen_port, sizeof(listen_port)) < 0)
+    return 1;
+
+  printf("Proxying gemini:// on %s port %s\n", listen_host, listen_port);
+
+  return server_accept(&listen, &server_conf, serve);
+}
@@ -0,0 +1,30 @@
+#ifndef _PROXY_H
+#define _PROXY_H
+
+#include <stddef.h>
+
+#include "net.h"
+
+/* A client of server_accept(), with its request line read. What came
+ * after the line, got bytes of it, follows the line's NUL. */
+struct client
+{
+  struct conn conn;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config *conf;
+  void (*handler)(struct client *c);
+  uint64_t start;
+  char line[4096];
+  int got;
+};
+
+int proxy_address(const char *addr, char *host, size_t host_len,
+		  char *port, size_t port_len);
+int server_listen(struct session *s, const char *addr, mbedtls_ssl_config *conf,
+		  mbedtls_net_context *listen, char *host, size_t host_len,
+		  char *port, size_t port_len);
+int server_accept(mbedtls_net_context *listen, mbedtls_ssl_config *conf,
+		  void (*handler)(struct client *c));
+int proxy_serve(struct session *s, const char *addr);
+
+#endif /* _PROXY_H */
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "redirect.h"
+#include "url_parser.h"
+#include "stats.h"
+#include "mem.h"
+#include "hash.h"
+
+/* Permanent redirects, an open addressing table keyed by the request
+ * URL. Every new entry is also appended to DIR/redirects, later lines
+ * win when it is loaded again. */
+struct redirect
+{
+  uint64_t hash;
+  char *from;        /* One allocation holding from and to */
+  char *to;
+};
+
+static struct redirect *table = NULL;
+static size_t table_size = 0;
+static size_t table_len = 0;
+static FILE *redirect_fp = NULL;
+static pthread_mutex_t redirect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Normalized URL without its fragment, as it is sent in requests */
+static int request_url(const char *url, char *out, size_t len)
+{
+  char *fragment;
+
+  if (url_normalize(url, out, len) < 0)
+    return -1;
+
+  if ((fragment = strchr(out, '#')) != NULL)
+    *fragment = 0;
+
+  return 0;
+}
+
+static struct redirect *find(const char *url, uint64_t hash)
+{
+  size_t i;
+
+  if (table_size == 0)
+    return NULL;
+
+  for (i = hash & (table_size - 1); table[i].from != NULL; i = (i + 1) & (table_size - 1))
+    if (table[i].hash == hash && !strcmp(table[i].from, url))
+      return &table[i];
+
+  return &table[i];
+}
+
+static int grow()
+{
+  struct redirect *old = table;
+  size_t old_size = table_size;
+  size_t size = table_size ? table_size * 2 : 64;
+
+  if ((table = mem_calloc(MEM_CACHE, size, sizeof(struct redirect))) == NULL)
+  {
+    table = old;
+    return -1;
+  }
+
+  table_size = size;
+
+  for (size_t i = 0; i < old_size; i++)
+    if (old[i].from != NULL)
+      *find(old[i].from, old[i].hash) = old[i];
+
+  mem_free(old);
+
+  return 0;
+}
+
+static void insert(const char *from, const char *to)
+{
+  uint64_t hash = hash_bytes(from, strlen(from));
+  size_t from_len = strlen(from), to_len = strlen(to);
+  struct redirect *r;
+  char *str;
+
+  if ((table_len + 1) * 10 > table_size * 7 && grow() < 0)
+    return;
+
+  if ((str = mem_malloc(MEM_CACHE, from_len + to_len + 2)) == NULL)
+    return;
+
+  memcpy(str, from, from_len + 1);
+  memcpy(str + from_len + 1, to, to_len + 1);
+
+  r = find(from, hash);
+
+  if (r->from != NULL)
+    mem_free(r->from);
+  else
+    table_len++;
+
+  r->hash = hash;
+  r->from = str;
+  r->to = str + from_len + 1;
+}
+
+void redirect_load(const char *dir)
+{
+  char path[512], line[2100];
+  char *from, *to;
+  FILE *fp;
+
+  if (dir[0] == 0)
+    return;
+
+  mkdir(dir, 0755);
+  snprintf(path, sizeof(path), "%s/redirects", dir);
+
+  /* Lines are "from to" */
+  if ((fp = fopen(path, "r")) != NULL)
+  {
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+      from = strtok(line, " \r\n");
+      to = strtok(NULL, " \r\n");
+
+      if (from != NULL && to != NULL)
+	insert(from, to);
+    }
+
+    fclose(fp);
+  }
+
+  redirect_fp = fopen(path, "a");
+}
+
+/* Copies the target of a permanent redirect from url into out, false
+ * if there is none */
+bool redirect_lookup(const char *url, char *out, size_t len)
+{
+  struct redirect *r;
+  bool hit;
+
+  pthread_mutex_lock(&redirect_lock);
+  
+  r = find(url, hash_bytes(url, strlen(url)));
+  hit = r != NULL && r->from != NULL && strlen(r->to) < len;
+  if (hit)
+    strcpy(out, r->to);
+  
+  pthread_mutex_unlock(&redirect_lock);
+  
+  stats_cache(&stats.redirects, hit);
+
+  return hit;
+}
+
+void redirect_add(const char *from, const char *to)
+{
+  char target[1025];
+
+  if (request_url(to, target, sizeof(target)) < 0 || !strcmp(from, target))
+    return;
+
+  pthread_mutex_lock(&redirect_lock);
+  
+  insert(from, target);
+
+  if (redirect_fp != NULL)
+  {
+    fprintf(redirect_fp, "%s %s\n", from, target);
+    fflush(redirect_fp);
+  }
+  
+  pthread_mutex_unlock(&redirect_lock);
+}
+
+void redirect_free()
+{
+  for (size_t i = 0; i < table_size; i++)
+    mem_free(table[i].from);
+
+  mem_free(table);
+  table = NULL;
+  table_size = table_len = 0;
+
+  if (redirect_fp != NULL)
+    fclose(redirect_fp);
+  redirect_fp = NULL;
+}
+
+/* Adds the next URL of a chain, the first one being the request itself.
+ * -1 if it was seen before, -2 past max redirects. */
+int redirect_chain_follow(struct redirect_chain *c, const char *url, int max)
+{
+  char request[1025];
+  uint64_t hash;
+
+  if (c->len > max || c->len >= REDIRECT_CHAIN_MAX)
+    return -2;
+
+  if (request_url(url, request, sizeof(request)) < 0)
+    return 0;
+
+  hash = hash_bytes(request, strlen(request));
+
+  for (int i = 0; i < c->len; i++)
+    if (c->seen[i] == hash)
+      return -1;
+
+  c->seen[c->len++] = hash;
+
+  return 0;
+}
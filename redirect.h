@@ -0,0 +1,24 @@
+#ifndef _REDIRECT_H
+#define _REDIRECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REDIRECT_CHAIN_MAX 32
+
+/* URLs visited while following one request's redirects */
+struct redirect_chain
+{
+  uint64_t seen[REDIRECT_CHAIN_MAX];
+  int len;
+};
+
+void redirect_load(const char *dir);
+bool redirect_lookup(const char *url, char *out, size_t len);
+void redirect_add(const char *from, const char *to);
+void redirect_free();
+
+int redirect_chain_follow(struct redirect_chain *c, const char *url, int max);
+
+#endif /* _REDIRECT_H */
@@ -0,0 +1,181 @@
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "search.h"
+#include "mem.h"
+
+static bool add_match(size_t **matches, size_t *count, size_t *size, size_t offset)
+{
+  if (*count == *size)
+  {
+    size_t *tmp;
+    
+    *size = *size ? *size * 2 : 64;
+    if ((tmp = mem_realloc(MEM_DOC, *matches, *size * sizeof(size_t))) == NULL)
+      return false;
+    *matches = tmp;
+  }
+  
+  (*matches)[(*count)++] = offset;
+  return true;
+}
+
+static bool match_at(const char *buf, const char *pattern, size_t pattern_len,
+		     bool ignore_case)
+{
+  if (ignore_case)
+    return !strncasecmp(buf, pattern, pattern_len);
+  
+  return !memcmp(buf, pattern, pattern_len);
+}
+
+#if defined(__SSE2__)
+/* Compare 16 bytes against c, folding ASCII case when c is a letter.
+ * Folding with 0x20 lets a few symbols through, the full compare
+ * rejects them. */
+static __m128i eq_char(__m128i block, char c, bool ignore_case)
+{
+  if (ignore_case && isalpha((unsigned char) c))
+    return _mm_cmpeq_epi8(_mm_or_si128(block, _mm_set1_epi8(0x20)),
+			  _mm_set1_epi8(tolower((unsigned char) c)));
+  
+  return _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
+}
+#endif
+
+/* Find every non-overlapping occurrence of pattern in one pass. Candidate
+ * positions are those where both the first and last pattern bytes match,
+ * tested 16 at a time, then confirmed with a full compare. */
+size_t search_scan(const char *buf, size_t len, const char *pattern, size_t pattern_len,
+		   bool ignore_case, size_t **matches)
+{
+  size_t count = 0, size = 0, i = 0;
+  size_t last = pattern_len - 1;
+  
+  *matches = NULL;
+  
+  if (pattern_len == 0 || pattern_len > len)
+    return 0;
+  
+#if defined(__SSE2__)
+  for (; i + last + 16 <= len; i += 16)
+  {
+    __m128i first = eq_char(_mm_loadu_si128((const __m128i *) (buf + i)),
+			    pattern[0], ignore_case);
+    __m128i end = eq_char(_mm_loadu_si128((const __m128i *) (buf + i + last)),
+			  pattern[last], ignore_case);
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(first, end));
+    
+    while (mask)
+    {
+      size_t pos = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      if (count && pos < (*matches)[count-1] + pattern_len)
+	continue;
+      
+      if (match_at(buf + pos, pattern, pattern_len, ignore_case)
+	  && !add_match(matches, &count, &size, pos))
+	return count;
+    }
+  }
+#endif
+
+  for (; i + pattern_len <= len; i++)
+  {
+    if (count && i < (*matches)[count-1] + pattern_len)
+      continue;
+
+    if (match_at(buf + i, pattern, pattern_len, ignore_case)
+	&& !add_match(matches, &count, &size, i))
+      return count;
+  }
+  
+  return count;
+}
+
+void search_build(struct search *s, const char *buf, size_t len,
+		  const char *pattern, bool ignore_case)
+{
+  search_clear(s);
+  
+  strncpy(s->pattern, pattern, sizeof(s->pattern)-1);
+  s->pattern[sizeof(s->pattern)-1] = 0;
+  s->pattern_len = strlen(s->pattern);
+  s->ignore_case = ignore_case;
+  s->count = search_scan(buf, len, s->pattern, s->pattern_len, ignore_case, &s->matches);
+}
+
+void search_clear(struct search *s)
+{
+  mem_free(s->matches);
+  s->matches = NULL;
+  s->count = 0;
+  s->current = 0;
+  s->pattern[0] = 0;
+  s->pattern_len = 0;
+}
+
+/* Move to the first match after (or last match before) offset, wrapping */
+bool search_next(struct search *s, size_t offset, bool forward)
+{
+  size_t lo = 0, hi = s->count;
+
+  if (s->count == 0)
+    return false;
+  
+  /* First match >= offset */
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    
+    if (s->matches[mid] < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (forward)
+    s->current = lo < s->count ? lo : 0;
+  else
+    s->current = lo > 0 ? lo - 1 : s->count - 1;
+  
+  return true;
+}
+
+/* Cursor for search_highlight() starting at offset */
+size_t search_cursor(struct search *s, size_t offset)
+{
+  size_t lo = 0, hi = s->count;
+
+  /* First match ending after offset */
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    
+    if (s->matches[mid] + s->pattern_len <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* Whether offset is inside a match. cursor comes from search_cursor()
+ * and offsets must only increase. */
+bool search_highlight(struct search *s, size_t offset, size_t *cursor)
+{
+  if (s == NULL)
+    return false;
+  
+  while (*cursor < s->count && s->matches[*cursor] + s->pattern_len <= offset)
+    (*cursor)++;
+
+  return *cursor < s->count && s->matches[*cursor] <= offset;
+}
@@ -0,0 +1,27 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct search
+{
+  char pattern[100];
+  size_t pattern_len;
+  bool ignore_case;
+  
+  size_t *matches;   /* Offsets of every match, ascending */
+  size_t count;
+  size_t current;
+};
+
+size_t search_scan(const char *buf, size_t len, const char *pattern, size_t pattern_len,
+		   bool ignore_case, size_t **matches);
+void search_build(struct search *s, const char *buf, size_t len,
+		  const char *pattern, bool ignore_case);
+void search_clear(struct search *s);
+bool search_next(struct search *s, size_t offset, bool forward);
+size_t search_cursor(struct search *s, size_t offset);
+bool search_highlight(struct search *s, size_t offset, size_t *cursor);
+
+#endif /* _SEARCH_H */
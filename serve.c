@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <mbedtls/sha256.h>
+
+#include "serve.h"
+#include "proxy.h"
+#include "config.h"
+#include "url_parser.h"
+#include "mem.h"
+#include "trace.h"
+
+/* A capsule to test the client against on loopback, with the proxy's
+ * certificate. It has what uploads, live pages, feed refreshes and
+ * quitting mid-fetch need:
+ *
+ *   titan://HOST/PATH;size=N  takes N bytes and redirects to PATH, paths
+ *                             under /private want ;token=letmein
+ *   /PATH                     what was uploaded there: size, type, sha256
+ *   /live                     a line every 50ms until the client goes
+ *   /live/fast                1000 lines at a time until the client goes
+ *   /dribble                  50 lines over five seconds
+ *   /slow                     the header after ten seconds
+ *   /feed/N                   a feed of SERVE_FEED_POSTS dated links, oldest
+ *                             first, the newest dated today and a day later
+ *                             every SERVE_FEED_DAY seconds */
+
+#define SERVE_CHUNK (1 << 20)
+#define SERVE_UPLOADS 64
+#define SERVE_FEED_POSTS 100
+#define SERVE_FEED_DAY 10
+
+struct upload_info
+{
+  char path[256];
+  char mime[64];
+  uint64_t size;
+  char sha256[65];
+  double rate;               /* MiB/s it came in at */
+};
+
+static mbedtls_ssl_config server_conf;
+static char listen_host[255], listen_port[10];
+static time_t started;
+
+static pthread_mutex_t uploads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct upload_info uploads[SERVE_UPLOADS];
+static int uploads_next = 0;
+
+/* Value of ;name= in params, copied into out */
+static bool param(const char *params, const char *name, char *out, size_t len)
+{
+  size_t name_len = strlen(name);
+  const char *p, *end;
+
+  for (p = params; (p = strchr(p, ';')) != NULL; p = end)
+  {
+    p++;
+    end = p + strcspn(p, ";");
+    if (!strncmp(p, name, name_len) && p[name_len] == '=')
+    {
+      snprintf(out, len, "%.*s", (int) (end - p - name_len - 1), p + name_len + 1);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Reads the upload's size bytes, got of them already at rest, and keeps
+ * their hash. Returns the header to answer with. */
+static const char *titan(mbedtls_ssl_context *ssl, char *path, const char *rest, int got,
+			 char *out, size_t len)
+{
+  char size_text[24], mime[64] = "text/gemini", token[64] = "";
+  unsigned char digest[32], *buf;
+  mbedtls_sha256_context sha;
+  struct upload_info *u;
+  uint64_t size, have = got, start = trace_now();
+  char *params = strchr(path, ';');
+  int ret = 0;
+
+  if (params == NULL || !param(params, "size", size_text, sizeof(size_text)))
+    return "59 size required\r\n";
+  size = strtoull(size_text, NULL, 10);
+  param(params, "mime", mime, sizeof(mime));
+  param(params, "token", token, sizeof(token));
+  *params = 0;
+
+  if (!strncmp(path, "/private", 8) && strcmp(token, "letmein"))
+    return "60 token required\r\n";
+  if ((buf = mem_malloc(MEM_RECV, SERVE_CHUNK)) == NULL)
+    return "42 Out of memory\r\n";
+
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts_ret(&sha, 0);
+  mbedtls_sha256_update_ret(&sha, (const unsigned char *) rest, got);
+
+  while (have < size)
+  {
+    ret = mbedtls_ssl_read(ssl, buf, size - have < SERVE_CHUNK ? size - have : SERVE_CHUNK);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (ret <= 0)
+      break;
+
+    mbedtls_sha256_update_ret(&sha, buf, ret);
+    have += ret;
+  }
+
+  mbedtls_sha256_finish_ret(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  mem_free(buf);
+
+  if (have != size)
+    return "59 short upload\r\n";
+
+  pthread_mutex_lock(&uploads_lock);
+  u = &uploads[uploads_next++ % SERVE_UPLOADS];
+  snprintf(u->path, sizeof(u->path), "%s", path);
+  snprintf(u->mime, sizeof(u->mime), "%s", mime);
+  u->size = size;
+  for (int i = 0; i < 32; i++)
+    sprintf(u->sha256 + i * 2, "%02x", digest[i]);
+  u->rate = size / 1048576.0 / ((trace_now() - start + 1) / 1e6);
+  pthread_mutex_unlock(&uploads_lock);
+
+  if (strchr(listen_host, ':') != NULL)
+    snprintf(out, len, "30 gemini://[%s]:%s%s\r\n", listen_host, listen_port, path);
+  else
+    snprintf(out, len, "30 gemini://%s:%s%s\r\n", listen_host, listen_port, path);
+  return out;
+}
+
+/* What was last uploaded to path, false if nothing was */
+static bool uploaded(const char *path, char *out, size_t len)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&uploads_lock);
+  for (int i = uploads_next - 1; i >= 0 && i >= uploads_next - SERVE_UPLOADS; i--)
+  {
+    struct upload_info *u = &uploads[i % SERVE_UPLOADS];
+
+    if (!strcmp(u->path, path))
+    {
+      snprintf(out, len, "20 text/gemini\r\n# Uploaded %s\n\nsize %llu\nmime %s\n"
+	       "sha256 %s\nreceived at %.1f MiB/s\n", u->path, (unsigned long long) u->size,
+	       u->mime, u->sha256, u->rate);
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&uploads_lock);
+
+  return found;
+}
+
+/* Oldest post first, so a feed is read whole before any are dropped */
+static void feed(mbedtls_ssl_context *ssl, int n)
+{
+  char line[200];
+  time_t newest = started + (time(NULL) - started) / SERVE_FEED_DAY * 86400, day;
+  struct tm tm;
+
+  snprintf(line, sizeof(line), "20 text/gemini\r\n# Gemlog %d\n\nSome words about it.\n\n", n);
+  send_all(ssl, line, strlen(line));
+
+  for (int i = SERVE_FEED_POSTS - 1; i >= 0; i--)
+  {
+    day = newest - (time_t) i * 86400;
+    gmtime_r(&day, &tm);
+    snprintf(line, sizeof(line), "=> /feed/%d/post-%d.gmi %04d-%02d-%02d - Post %d\n* filler line\n",
+	     n, SERVE_FEED_POSTS - i, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+	     SERVE_FEED_POSTS - i);
+    if (send_all(ssl, line, strlen(line)) < 0)
+      return;
+  }
+}
+
+/* Lines until the client goes away, or count of them */
+static void stream(mbedtls_ssl_context *ssl, int per_write, int delay_ms, int count)
+{
+  char *buf;
+  size_t len;
+
+  if ((buf = mem_malloc(MEM_RECV, per_write * 80)) == NULL)
+    return;
+
+  for (int i = 0; count == 0 || i < count; i += per_write)
+  {
+    len = 0;
+    for (int k = 0; k < per_write; k++)
+      len += sprintf(buf + len, "* line %d %.60s\n", i + k,
+		     "yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy");
+    if (send_all(ssl, buf, len) < 0)
+      break;
+    if (delay_ms)
+      usleep(delay_ms * 1000);
+  }
+
+  mem_free(buf);
+}
+
+/* Sends a header, and a body if text has one. Returns its status. */
+static int reply(mbedtls_ssl_context *ssl, const char *text)
+{
+  send_all(ssl, text, strlen(text));
+  return atoi(text);
+}
+
+/* Answers the request line, got bytes of an upload following it.
+ * Returns the status sent. */
+static int respond(mbedtls_ssl_context *ssl, char *line, int got)
+{
+  static const char index_page[] =
+    "20 text/gemini\r\n# Test capsule\n\n"
+    "=> /live A line every 50ms\n"
+    "=> /live/fast Lines as fast as they go\n"
+    "=> /dribble 50 lines over five seconds\n"
+    "=> /slow A header after ten seconds\n"
+    "=> /feed/1 A feed\n";
+  char path[1025], scheme[16], text[1100];
+  const char *rest = line + strlen(line) + 2;
+  struct url_view view;
+
+  if (url_parse(line, strlen(line), &view) < 0
+      || url_part_copy(&view, view.scheme, scheme, sizeof(scheme)) <= 0)
+    return reply(ssl, "59 Bad request\r\n");
+  if (url_part_copy(&view, view.path, path, sizeof(path)) <= 0)
+    strcpy(path, "/");
+
+  if (!strcmp(scheme, "titan"))
+    return reply(ssl, titan(ssl, path, rest, got, text, sizeof(text)));
+  if (strcmp(scheme, "gemini"))
+    return reply(ssl, "53 Only gemini:// and titan://\r\n");
+
+  if (uploaded(path, text, sizeof(text)))
+    return reply(ssl, text);
+  if (!strcmp(path, "/"))
+    return reply(ssl, index_page);
+
+  if (!strcmp(path, "/live") || !strcmp(path, "/live/fast"))
+  {
+    reply(ssl, "20 text/gemini\r\n# live log\n");
+    if (path[5] == 0)
+      stream(ssl, 1, 50, 0);
+    else
+      stream(ssl, 1000, 0, 0);
+    return 20;
+  }
+  if (!strcmp(path, "/dribble"))
+  {
+    reply(ssl, "20 text/gemini\r\n# dribble page\n");
+    stream(ssl, 1, 100, 50);
+    return 20;
+  }
+  if (!strcmp(path, "/slow"))
+  {
+    sleep(10);
+    return reply(ssl, "20 text/gemini\r\n# slow page\n");
+  }
+  if (!strncmp(path, "/feed/", 6) && strchr(path + 6, '/') == NULL)
+  {
+    feed(ssl, atoi(path + 6));
+    return 20;
+  }
+
+  return reply(ssl, "51 Not found\r\n");
+}
+
+static void serve_client(struct client *c)
+{
+  int status = respond(&c->ssl, c->line, c->got);
+
+  printf("%d %8.1fms %s\n", status, (trace_now() - c->start) / 1000.0, c->line);
+}
+
+int serve_test(struct session *s, const char *addr)
+{
+  mbedtls_net_context listen;
+
+  if (server_listen(s, addr, &server_conf, &listen, listen_host, sizeof(listen_host),
+		    listen_port, sizeof(listen_port)) < 0)
+    return 1;
+
+  started = time(NULL);
+  printf("Test capsule on %s port %s\n", listen_host, listen_port);
+
+  return server_accept(&listen, &server_conf, serve_client);
+}
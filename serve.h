@@ -0,0 +1,10 @@
+#ifndef _SERVE_H
+#define _SERVE_H
+
+#include "net.h"
+
+#define SERVE_TEST_ADDR "127.0.0.1:1965"
+
+int serve_test(struct session *s, const char *addr);
+
+#endif /* _SERVE_H */
@@ -0,0 +1,152 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "spill.h"
+#include "mem.h"
+
+/* The header and first records always stay in memory */
+#define SPILL_MIN (64*1024)
+
+/* Moves what is in memory to a temporary file and drops the heap
+ * buffer, so RSS stays flat however large the body gets */
+static int spill_to_file(struct spill *s)
+{
+  if ((s->fp = tmpfile()) == NULL)
+    return -1;
+
+  if (fwrite(s->data, 1, s->len, s->fp) != s->len)
+  {
+    fclose(s->fp);
+    s->fp = NULL;
+    return -1;
+  }
+
+  mem_free(s->data);
+  s->data = NULL;
+  s->size = 0;
+
+  return 0;
+}
+
+int spill_append(struct spill *s, const char *data, size_t len)
+{
+  if (s->fp == NULL && s->limit > 0
+      && s->len + len > (s->limit > SPILL_MIN ? s->limit : SPILL_MIN))
+    spill_to_file(s);
+
+  if (s->fp != NULL)
+  {
+    if (fwrite(data, 1, len, s->fp) != len)
+      return -1;
+
+    s->len += len;
+    return 0;
+  }
+
+  if (s->len + len + 1 > s->size)
+  {
+    size_t size = s->size ? s->size : 4096;
+    char *tmp;
+
+    while (size < s->len + len + 1)
+      size *= 2;
+
+    if ((tmp = mem_realloc(MEM_RECV, s->data, size)) == NULL)
+      return -1;
+
+    s->data = tmp;
+    s->size = size;
+  }
+
+  memcpy(s->data + s->len, data, len);
+  s->len += len;
+  s->data[s->len] = 0;
+
+  return 0;
+}
+
+/* Maps the temporary file, if the body went to one */
+int spill_finish(struct spill *s)
+{
+  void *map;
+
+  if (s->fp == NULL)
+    return spill_append(s, "", 0);
+
+  /* The terminating NUL goes in the file so the mapping ends with it */
+  if (fputc(0, s->fp) == EOF || fflush(s->fp) == EOF)
+    goto fail;
+
+  map = mmap(NULL, s->len + 1, PROT_READ, MAP_PRIVATE, fileno(s->fp), 0);
+  if (map == MAP_FAILED)
+    goto fail;
+
+  madvise(map, s->len + 1, MADV_SEQUENTIAL);
+
+  s->data = map;
+  s->mapped = true;
+
+  return 0;
+
+ fail:
+  fclose(s->fp);
+  s->fp = NULL;
+  s->len = 0;
+  spill_append(s, "", 0);
+
+  return -1;
+}
+
+/* Copies up to len bytes from offset, wherever the body is kept.
+ * Returns how many were copied. */
+size_t spill_read(struct spill *s, size_t offset, char *out, size_t len)
+{
+  ssize_t got;
+
+  if (offset >= s->len)
+    return 0;
+  if (len > s->len - offset)
+    len = s->len - offset;
+
+  if (s->fp == NULL || s->mapped)
+  {
+    memcpy(out, s->data + offset, len);
+    return len;
+  }
+
+  if (fflush(s->fp) == EOF || (got = pread(fileno(s->fp), out, len, offset)) < 0)
+    return 0;
+
+  return got;
+}
+
+/* Empties the body for the next response, keeping the heap buffer */
+void spill_reset(struct spill *s)
+{
+  if (s->mapped)
+  {
+    munmap(s->data, s->len + 1);
+    s->data = NULL;
+    s->mapped = false;
+  }
+
+  /* Temporary files are deleted on close */
+  if (s->fp != NULL)
+  {
+    fclose(s->fp);
+    s->fp = NULL;
+  }
+
+  s->len = 0;
+  if (s->data != NULL)
+    s->data[0] = 0;
+}
+
+void spill_free(struct spill *s)
+{
+  spill_reset(s);
+  mem_free(s->data);
+  s->data = NULL;
+  s->size = 0;
+}
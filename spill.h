@@ -0,0 +1,27 @@
+#ifndef _SPILL_H
+#define _SPILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Response body kept in memory up to limit bytes, past that in a
+ * temporary file which is mapped once the body is complete. Either
+ * way data is NUL-terminated. */
+struct spill
+{
+  char *data;
+  size_t len;
+  size_t size;       /* Capacity of the heap buffer */
+  size_t limit;      /* 0 means no limit */
+  FILE *fp;          /* Temporary file once over the limit */
+  bool mapped;
+};
+
+int spill_append(struct spill *s, const char *data, size_t len);
+int spill_finish(struct spill *s);
+size_t spill_read(struct spill *s, size_t offset, char *out, size_t len);
+void spill_reset(struct spill *s);
+void spill_free(struct spill *s);
+
+#endif /* _SPILL_H */
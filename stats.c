@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "mem.h"
+
+/* Requests are recorded from fetch threads */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct stats stats;
+
+static int hist_index(uint64_t value)
+{
+  int msb, shift, i;
+  
+  if (value < HIST_SUB)
+    return value;
+
+  msb = 63 - __builtin_clzll(value);
+  shift = msb - HIST_SUB_BITS;
+  i = HIST_SUB + shift*HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+
+  if (i >= HIST_BUCKETS)
+    i = HIST_BUCKETS-1;
+  
+  return i;
+}
+
+/* Middle of the range of values stored in a bucket */
+static uint64_t hist_value(int i)
+{
+  int shift;
+  
+  if (i < HIST_SUB)
+    return i;
+
+  shift = (i - HIST_SUB) / HIST_SUB;
+  
+  return ((uint64_t) (HIST_SUB + (i - HIST_SUB) % HIST_SUB) << shift)
+    + ((1ULL << shift) >> 1);
+}
+
+void hist_record(struct histogram *h, uint64_t value)
+{
+  h->counts[hist_index(value)]++;
+  h->total++;
+  h->sum += value;
+  
+  if (value > h->max)
+    h->max = value;
+}
+
+uint64_t hist_percentile(struct histogram *h, double p)
+{
+  uint64_t seen = 0;
+  uint64_t want = (uint64_t) (p * h->total + 0.5);
+
+  if (h->total == 0)
+    return 0;
+  if (want == 0)
+    want = 1;
+  
+  for (int i = 0; i < HIST_BUCKETS; i++)
+  {
+    seen += h->counts[i];
+    
+    if (seen >= want)
+      return hist_value(i) < h->max ? hist_value(i) : h->max;
+  }
+  
+  return h->max;
+}
+
+uint64_t hist_mean(struct histogram *h)
+{
+  return h->total ? h->sum / h->total : 0;
+}
+
+void stats_request(int status, size_t bytes, struct trace *t)
+{
+  pthread_mutex_lock(&stats_lock);
+  
+  stats.requests++;
+  stats.bytes_received += bytes;
+  
+  if (status >= 0 && status < 100)
+    stats.status[status]++;
+
+  if (t->marks[PHASE_HANDSHAKE])
+  {
+    stats.handshakes++;
+    hist_record(&stats.handshake_us, trace_phase_time(t, PHASE_HANDSHAKE));
+  }
+  
+  if (t->marks[PHASE_BODY])
+    hist_record(&stats.fetch_us, t->marks[PHASE_BODY] - t->start);
+  
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_frame(uint64_t us)
+{
+  pthread_mutex_lock(&stats_lock);
+  stats.redraws++;
+  hist_record(&stats.frame_us, us);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_cache(struct cache_counter *c, bool hit)
+{
+  pthread_mutex_lock(&stats_lock);
+  c->lookups++;
+  if (hit)
+    c->hits++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_count(uint64_t *counter)
+{
+  pthread_mutex_lock(&stats_lock);
+  (*counter)++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static void write_hist(FILE *fp, char *name, struct histogram *h)
+{
+  fprintf(fp, "* %s: %lu samples, mean %.2fms, p50 %.2fms, p99 %.2fms, max %.2fms\n",
+	  name, (unsigned long) h->total,
+	  hist_mean(h) / 1000.0,
+	  hist_percentile(h, 0.50) / 1000.0,
+	  hist_percentile(h, 0.99) / 1000.0,
+	  h->max / 1000.0);
+}
+
+static void write_cache(FILE *fp, char *name, struct cache_counter *c)
+{
+  fprintf(fp, "* %s: %lu hits in %lu lookups (%.1f%%)\n",
+	  name, (unsigned long) c->hits, (unsigned long) c->lookups,
+	  c->lookups ? 100.0 * c->hits / c->lookups : 0.0);
+}
+
+/* Gemtext report for about:stats */
+void stats_write(FILE *fp)
+{
+  pthread_mutex_lock(&stats_lock);
+  
+  fputs("# Stats\n\n", fp);
+  
+  fputs("## Requests\n\n", fp);
+  fprintf(fp, "* Requests: %lu\n", (unsigned long) stats.requests);
+  fprintf(fp, "* Bytes received: %lu\n", (unsigned long) stats.bytes_received);
+  fprintf(fp, "* Timeouts: %lu\n", (unsigned long) stats.timeouts);
+  fprintf(fp, "* Retries: %lu\n", (unsigned long) stats.retries);
+  fprintf(fp, "* Live responses: %lu\n", (unsigned long) stats.live);
+  
+  for (int i = 0; i < 100; i++)
+    if (stats.status[i])
+      fprintf(fp, "* Status %02d: %lu\n", i, (unsigned long) stats.status[i]);
+
+  fputs("\n## Latency\n\n", fp);
+  fprintf(fp, "* Handshakes: %lu\n", (unsigned long) stats.handshakes);
+  write_hist(fp, "Handshake", &stats.handshake_us);
+  write_hist(fp, "Fetch", &stats.fetch_us);
+
+  fputs("\n## Caches\n\n", fp);
+  write_cache(fp, "Redirects", &stats.redirects);
+  write_cache(fp, "Rendered lines", &stats.rendered);
+
+  fputs("\n## Rendering\n\n", fp);
+  fprintf(fp, "* Redraws: %lu\n", (unsigned long) stats.redraws);
+  write_hist(fp, "Frame", &stats.frame_us);
+  
+  pthread_mutex_unlock(&stats_lock);
+}
+
+char *stats_page(char *buf)
+{
+  char *page = NULL;
+  size_t size;
+  FILE *fp;
+
+  if ((fp = open_memstream(&page, &size)) == NULL)
+    return buf;
+  
+  stats_write(fp);
+  fclose(fp);
+
+  buf = mem_realloc(MEM_RECV, buf, size+1);
+  memcpy(buf, page, size+1);
+  free(page);
+  
+  return buf;
+}
+
+static void dump_hist(FILE *fp, char *name, struct histogram *h)
+{
+  fprintf(fp, ",\"%s\":{\"count\":%lu,\"mean_us\":%lu,\"p50_us\":%lu,"
+	  "\"p99_us\":%lu,\"max_us\":%lu}",
+	  name, (unsigned long) h->total,
+	  (unsigned long) hist_mean(h),
+	  (unsigned long) hist_percentile(h, 0.50),
+	  (unsigned long) hist_percentile(h, 0.99),
+	  (unsigned long) h->max);
+}
+
+static void dump_cache(FILE *fp, char *name, struct cache_counter *c)
+{
+  fprintf(fp, ",\"%s\":{\"lookups\":%lu,\"hits\":%lu}",
+	  name, (unsigned long) c->lookups, (unsigned long) c->hits);
+}
+
+/* One JSON object per session, appended to path */
+void stats_dump(char *path)
+{
+  FILE *fp;
+  bool first = true;
+  
+  if (path[0] == 0 || (fp = fopen(path, "a")) == NULL)
+    return;
+
+  pthread_mutex_lock(&stats_lock);
+
+  fprintf(fp, "{\"requests\":%lu,\"bytes_received\":%lu,\"handshakes\":%lu,"
+	  "\"redraws\":%lu,\"timeouts\":%lu,\"retries\":%lu,\"live\":%lu,\"status\":{",
+	  (unsigned long) stats.requests,
+	  (unsigned long) stats.bytes_received,
+	  (unsigned long) stats.handshakes,
+	  (unsigned long) stats.redraws,
+	  (unsigned long) stats.timeouts,
+	  (unsigned long) stats.retries,
+	  (unsigned long) stats.live);
+  
+  for (int i = 0; i < 100; i++)
+  {
+    if (!stats.status[i])
+      continue;
+    
+    fprintf(fp, "%s\"%02d\":%lu", first ? "" : ",", i, (unsigned long) stats.status[i]);
+    first = false;
+  }
+  fputs("}", fp);
+
+  dump_hist(fp, "handshake", &stats.handshake_us);
+  dump_hist(fp, "fetch", &stats.fetch_us);
+  dump_hist(fp, "frame", &stats.frame_us);
+  dump_cache(fp, "redirects", &stats.redirects);
+  dump_cache(fp, "rendered", &stats.rendered);
+  
+  pthread_mutex_unlock(&stats_lock);
+  
+  fputs("}\n", fp);
+  fclose(fp);
+}
@@ -0,0 +1,64 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+/* Log-linear (HDR-style) histogram: 16 sub-buckets per power of two,
+ * so any recorded value is within 1/16 of its bucket */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB + 40*HIST_SUB)
+
+struct histogram
+{
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+struct cache_counter
+{
+  uint64_t lookups;
+  uint64_t hits;
+};
+
+struct stats
+{
+  uint64_t requests;
+  uint64_t status[100];
+  uint64_t bytes_received;
+  uint64_t handshakes;
+  uint64_t redraws;
+  uint64_t timeouts;
+  uint64_t retries;
+  uint64_t live;
+  
+  struct cache_counter redirects;
+  struct cache_counter rendered;
+  
+  struct histogram handshake_us;
+  struct histogram fetch_us;
+  struct histogram frame_us;
+};
+
+extern struct stats stats;
+
+void hist_record(struct histogram *h, uint64_t value);
+uint64_t hist_percentile(struct histogram *h, double p);
+uint64_t hist_mean(struct histogram *h);
+
+void stats_request(int status, size_t bytes, struct trace *t);
+void stats_frame(uint64_t us);
+void stats_cache(struct cache_counter *c, bool hit);
+void stats_count(uint64_t *counter);
+
+void stats_write(FILE *fp);
+char *stats_page(char *buf);
+void stats_dump(char *path);
+
+#endif /* _STATS_H */
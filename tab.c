@@ -0,0 +1,803 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "tab.h"
+#include "url_parser.h"
+#include "config.h"
+#include "stats.h"
+#include "mem.h"
+#include "redirect.h"
+#include "index.h"
+#include "proxy.h"
+#include "feeds.h"
+
+/* Live reads wake up this often to see if the UI wants them to stop */
+#define LIVE_POLL 250
+
+/* What fetch threads write to the wakeup pipe */
+struct wakeup_msg
+{
+  struct tab *t;
+  bool done;         /* The fetch is over, not only new live text */
+};
+
+static struct session *session;
+static int wakeup;
+
+/* Every tab, closed ones still loading included, and how many fetch
+ * threads are not joined yet. Only the UI touches them. */
+static struct tab *tabs_all = NULL;
+static int fetching = 0;
+
+static void strpre(char* s, const char* t)
+{
+  size_t len = strlen(t);
+  memmove(s + len, s, strlen(s) + 1);
+  memcpy(s, t, len);
+}
+
+/* Gemini requests are the absolute URL without its fragment */
+static int setup_request(char *url, char *get_request)
+{
+  char *fragment;
+  
+  if (url_normalize(url, get_request, 1023) < 0)
+    return -1;
+
+  if ((fragment = strchr(get_request, '#')) != NULL)
+    *fragment = 0;
+  
+  strcat(get_request, "\r\n");
+  
+  return 0;
+}
+
+/* <STATUS><SPACE><META><CR><LF>, malformed headers get status 0 and no
+ * header at all (buf NULL, nothing was read) gets NULL */
+struct response *read_response_header(char *buf, struct arena *page)
+{
+  struct response *resp;
+  char *end, *meta;
+  size_t meta_len = 0;
+
+  if (buf == NULL || (resp = arena_alloc(page, sizeof(struct response))) == NULL)
+    return NULL;
+
+  end = strstr(buf, "\r\n");
+  meta = buf + 3;
+
+  resp->status = 0;
+  resp->body = NULL;
+  
+  if (end != NULL && end - buf >= 2 && isdigit(buf[0]) && isdigit(buf[1])
+      && (end - buf == 2 || buf[2] == ' '))
+  {
+    resp->status = (buf[0] - '0') * 10 + buf[1] - '0';
+
+    if (end > meta)
+      meta_len = end - meta;
+    if (meta_len > 1024)
+      meta_len = 1024;
+
+    if (buf[0] == '2')
+      resp->body = end + 2;
+  }
+  
+  resp->meta = arena_strndup(page, meta, meta_len);
+  
+  return resp;
+}
+
+static int parse_input_url(char *get_request, char *page_url,
+		    char *server_name, char *server_port, char *scheme)
+{
+  struct url_view url;
+  
+  strcpy(page_url, get_request);
+  
+  if (!strncmp(get_request, "about:", 6))
+  {
+    memmove(get_request, get_request+6, strlen(get_request+6));
+    get_request[strlen(get_request+6)] = 0;
+    strcpy(scheme, "about");
+
+    return 0;
+  }
+  else if (!strstr(get_request, "://"))
+  {
+    strpre(page_url, "gemini://");
+    strpre(get_request, "gemini://");
+  }
+  else if (!strncmp(get_request, "file", 4))
+  {
+    memmove(get_request, get_request+7, strlen(get_request+7));
+    get_request[strlen(get_request+7)] = 0;
+    strcpy(scheme, "file");
+
+    return 0;
+  }    
+  
+  if (setup_request(page_url, get_request) < 0)
+    return -1;
+
+  strcpy(page_url, get_request);
+  page_url[strlen(page_url)-2] = 0;
+  
+  if (url_parse(page_url, strlen(page_url), &url) < 0
+      || url_address(page_url, server_name, 255, server_port, 10) < 0)
+    return -1;
+  
+  url_part_copy(&url, url.scheme, scheme, 100);
+  
+  return 0;
+}
+
+/* file:// URLs hold a path that may be relative to the working directory
+ * ("file://test.gmi"), those are made absolute before resolving */
+int resolve_link(char *base, char *link, char *out, size_t len)
+{
+  char file_base[1025];
+  char cwd[512];
+
+  if (strncmp(base, "file://", 7) || base[7] == '/')
+    return url_resolve(base, link, out, len);
+
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    return -1;
+  
+  snprintf(file_base, sizeof(file_base), "file://%s/%s", cwd, base+7);
+  
+  return url_resolve(file_base, link, out, len);
+}
+
+static char *read_file(char *buf, char *file_name)
+{
+  long size;
+  size_t i;
+
+  FILE *fp = fopen(file_name, "r");
+   
+  if(fp != NULL)
+  {
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    
+    buf = mem_realloc(MEM_RECV, buf, size+1);
+    i = fread(buf, 1, size, fp);
+    
+    fclose(fp);
+    buf[i] = 0;
+  }
+  else
+  {
+    buf = mem_realloc(MEM_RECV, buf, 20);
+
+    strcpy(buf, "File not found");
+ }
+  
+  return buf;
+}
+
+/* Generated about: pages, everything else is read from built-in/ */
+static char *read_about(char *buf, char *page)
+{
+  if (!strcmp(page, "stats"))
+    return stats_page(buf);
+  if (!strcmp(page, "memory"))
+    return mem_page(buf);
+  if (!strncmp(page, "search", 6) && (page[6] == 0 || page[6] == '?'))
+    return index_page(buf, page[6] ? page + 7 : "");
+  if (!strncmp(page, "feeds", 5) && (page[5] == 0 || page[5] == '?'))
+    return feeds_page(buf, session, !strcmp(page + 5, "?refresh"));
+  
+  strpre(page, "built-in/");
+  strcat(page, ".gmi");
+  
+  return read_file(buf, page);
+}
+
+/* Why the fetch stopped at phase, for the status line */
+static void fetch_error(struct tab *t, const char *phase, int ret)
+{
+  if (ret == MBEDTLS_ERR_SSL_TIMEOUT)
+    stats_count(&stats.timeouts);
+  dial_error(t->error_msg, sizeof(t->error_msg), phase, ret, t->server_name);
+}
+
+/* Waits before another attempt: retry_delay doubling every time, less
+ * up to half of it at random so clients that failed together do not
+ * come back together, and at least min_ms. False when out of retries
+ * or the wait would run past total_timeout. */
+static bool retry_wait(struct tab *t, int *attempt, uint64_t min_ms, uint64_t start)
+{
+  unsigned int seed = trace_now() ^ (uintptr_t) t;
+  uint64_t delay;
+  struct timespec ts;
+
+  if (*attempt >= cfg.retries)
+    return false;
+
+  delay = (uint64_t) cfg.retry_delay << *attempt;
+  delay -= rand_r(&seed) % (delay/2 + 1);
+  if (delay < min_ms)
+    delay = min_ms;
+
+  if (cfg.total_timeout > 0
+      && trace_now() + delay*1000 > start + cfg.total_timeout*1000ULL)
+    return false;
+
+  (*attempt)++;
+  stats_count(&stats.retries);
+
+  ts.tv_sec = delay / 1000;
+  ts.tv_nsec = delay % 1000 * 1000000;
+  nanosleep(&ts, NULL);
+
+  return true;
+}
+
+/* Tells the UI which tab is done, or has more live text */
+static void tab_wake(struct tab *t, bool done)
+{
+  struct wakeup_msg msg = { t, done };
+
+  if (write(wakeup, &msg, sizeof(msg)) != sizeof(msg))
+    perror("write");
+}
+
+/* Reads a response that may never end into the live ring, until the
+ * server closes it or the UI stops it. Only the ring is shared from
+ * here on, the UI parses the page from copies of it. */
+static void tab_live(struct tab *t, mbedtls_ssl_context *ssl, struct conn *conn,
+		     size_t head, struct charset *cs)
+{
+  char tmp[16384], *data;
+  size_t from, got, len;
+  int ret;
+
+  if (live_start(&t->live, cfg.live_buffer, cfg.live_lines) < 0)
+    return;
+
+  /* Only the tail of what came so far is kept, from a line start */
+  from = t->body.len - head > cfg.live_buffer ? t->body.len - cfg.live_buffer : head;
+  while ((got = spill_read(&t->body, from, tmp, sizeof(tmp))) > 0)
+  {
+    data = tmp;
+    if (from > head && t->live.len == 0)
+      data = (data = memchr(tmp, '\n', got)) != NULL ? data + 1 : tmp + got;
+    live_append(&t->live, data, tmp + got - data);
+    from += got;
+  }
+
+  t->resp->body = NULL;
+  strcpy(t->error_msg, "Live, following the end of the response");
+  trace_mark(&t->trace, PHASE_BODY);
+  stats_request(t->resp->status, t->body.len, &t->trace);
+  stats_count(&stats.live);
+  spill_free(&t->body);
+
+  __atomic_store_n(&t->state, TAB_LIVE, __ATOMIC_RELEASE);
+  tab_wake(t, false);
+
+  conn->end = 0;
+  while (!__atomic_load_n(&t->live.stop, __ATOMIC_ACQUIRE))
+  {
+    /* Short reads so a stop is seen even when nothing comes */
+    conn_deadline(conn, LIVE_POLL);
+    ret = mbedtls_ssl_read(ssl, (unsigned char *) tmp, sizeof(tmp));
+
+    if (ret == MBEDTLS_ERR_SSL_TIMEOUT || ret == MBEDTLS_ERR_SSL_WANT_READ
+	|| ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (ret <= 0)
+      break;
+
+    data = tmp;
+    len = ret;
+    
+    /* The body only holds the record being converted now */
+    if (cs != NULL)
+    {
+      spill_reset(&t->body);
+      charset_append(cs, &t->body, tmp, len);
+      data = t->body.data;
+      len = t->body.len;
+    }
+
+    if (len > 0 && live_append(&t->live, data, len))
+      tab_wake(t, false);
+  }
+
+  spill_free(&t->body);
+}
+
+/* The socket tabs_stop() shuts down, once there is one */
+static void tab_connected(void *ctx, struct conn *conn)
+{
+  struct tab *t = ctx;
+
+  __atomic_store_n(&t->sock, conn->net.fd, __ATOMIC_RELEASE);
+}
+
+/* Uploads take as long as they need, like downloads. A capsule refusing
+ * one may still say why before it closes. */
+static void tab_send_upload(void *ctx, mbedtls_ssl_context *ssl)
+{
+  struct tab *t = ctx;
+
+  upload_send(ssl, &t->ul);
+}
+
+/* The socket is no longer there to be shut down by tabs_stop() */
+static void tab_disconnect(struct tab *t, struct conn *conn, mbedtls_ssl_context *ssl)
+{
+  __atomic_store_n(&t->sock, -1, __ATOMIC_RELEASE);
+  close_conn(conn, ssl);
+}
+
+/* Fetches and parses the page t->get_request points to, following
+ * redirects. Runs on the tab's own thread. */
+static void tab_fetch(struct tab *t)
+{
+  struct redirect_chain chain = {0};
+  struct conn conn;
+  struct charset cs;
+  mbedtls_ssl_context ssl;
+  struct dial_hooks hooks = { .ctx = t, .connected = tab_connected };
+  char target[1025], upload_path[1024];
+  const char *phase;
+  size_t head;
+  int attempt, ret;
+  uint64_t start;
+  bool titan;
+
+  t->error_msg[0] = 0;
+  
+  /* Only the first request sends the file, never a redirect */
+  snprintf(upload_path, sizeof(upload_path), "%s", t->upload);
+  t->upload[0] = 0;
+
+ request:
+  /* Everything belonging to the last page goes at once */
+  arena_reset(&t->page);
+  spill_reset(&t->body);
+  memset(&t->doc, 0, sizeof(struct document));
+  t->resp = NULL;
+  
+  trace_begin(&t->trace, t->get_request);
+  if (parse_input_url(t->get_request, t->page_url, t->server_name,
+		      t->server_port, t->scheme) < 0)
+  {
+    strcpy(t->error_msg, "Invalid URL");
+    strcpy(t->scheme, "invalid");
+  }
+  else if (!strcmp(t->scheme, "gemini"))
+  {
+    ret = redirect_chain_follow(&chain, t->page_url, cfg.max_redirects);
+    
+    if (ret < 0)
+    {
+      strcpy(t->error_msg, ret == -1 ? "Redirect loop" : "Too many redirects");
+      strcpy(t->scheme, "invalid");
+    }
+    else if (redirect_lookup(t->page_url, target, sizeof(target)))
+    {
+      /* Known permanent redirects skip a connection */
+      strcpy(t->get_request, target);
+      goto request;
+    }
+  }
+  else if (!strcmp(t->scheme, "titan"))
+  {
+    /* The request gets the size of the file, and its type */
+    if (upload_path[0] == 0)
+      strcpy(t->error_msg, "Titan URLs are opened with :upload FILE URL");
+    else if (upload_open(&t->ul, upload_path) < 0)
+      snprintf(t->error_msg, sizeof(t->error_msg), "Cannot read %.80s", upload_path);
+    else if (titan_url(t->page_url, &t->ul, t->get_request, sizeof(t->get_request) - 2) < 0)
+      strcpy(t->error_msg, "Invalid URL");
+    else
+      strcat(t->get_request, "\r\n");
+    
+    if (t->error_msg[0] != 0)
+      strcpy(t->scheme, "invalid");
+  }
+  
+  titan = !strcmp(t->scheme, "titan");
+  hooks.sent = titan ? tab_send_upload : NULL;
+  if (!strcmp(t->scheme, "gemini") || t->scheme[0] == 0 || titan)
+  {
+    /* Through a proxy only the connection changes, requests are
+     * absolute URLs already. The proxy only takes gemini://. */
+    char *host = t->server_name, *port = t->server_port;
+    char proxy_host[255], proxy_port[10];
+    
+    if (cfg.proxy[0] && !titan
+	&& proxy_address(cfg.proxy, proxy_host, sizeof(proxy_host),
+			 proxy_port, sizeof(proxy_port)) == 0)
+    {
+      host = proxy_host;
+      port = proxy_port;
+    }
+    
+    attempt = 0;
+    start = t->trace.start;
+    
+  retry:
+    /* Each phase has its own deadline, total_timeout bounds them all */
+    if ((ret = dial(&conn, &ssl, session, host, port, cfg.total_timeout,
+		    &hooks, &t->trace, &phase)) != 0
+	|| (ret = fetch_header(&conn, &ssl, t->get_request, &hooks,
+			       &t->body, &t->trace, &phase)) != 0)
+    {
+      tab_disconnect(t, &conn, &ssl);
+      if (!strcmp(phase, "Connect") && retry_wait(t, &attempt, 0, start))
+	goto retry;
+      if (titan && t->ul.failed)
+	upload_status(&t->ul, t->error_msg, sizeof(t->error_msg));
+      else
+	fetch_error(t, phase, ret);
+      return;
+    }
+    if ((t->resp = read_response_header(t->body.data, &t->page)) == NULL)
+    {
+      tab_disconnect(t, &conn, &ssl);
+      strcpy(t->error_msg, "Out of memory");
+      return;
+    }
+    trace_mark(&t->trace, PHASE_HEADER);
+    head = t->resp->body != NULL ? t->resp->body - t->body.data : 0;
+    
+    /* Temporary failures may go away, 44 says how long to wait */
+    if ((t->resp->status == 40 || t->resp->status == 41 || t->resp->status == 44)
+	&& retry_wait(t, &attempt, t->resp->status == 44 ? strtoul(t->resp->meta, NULL, 10) * 1000 : 0, start))
+    {
+      tab_disconnect(t, &conn, &ssl);
+      arena_reset(&t->page);
+      t->resp = NULL;
+      goto retry;
+    }
+    
+    /* Only text is rendered, anything else goes straight to disk and
+     * may take as long as it needs while data keeps coming */
+    if (t->resp->body != NULL && !mime_is_text(t->resp->meta))
+    {
+      conn.end = 0;
+      download(&ssl, t->resp->body, t->body.len - head, t->page_url, &t->dl);
+      t->resp->body = NULL;
+      trace_mark(&t->trace, PHASE_BODY);
+      stats_request(t->resp->status, head + t->dl.bytes, &t->trace);
+    }
+    else
+    {
+      bool convert = t->resp->body != NULL && charset_open(&cs, t->resp->meta);
+      bool watch, live = false;
+      
+      /* Text in another charset becomes UTF-8 record by record, what
+       * came with the header is converted first */
+      if (convert && t->body.len > head)
+      {
+	size_t len = t->body.len - head;
+	char *rest = mem_malloc(MEM_RECV, len);
+	
+	if (rest != NULL)
+	{
+	  memcpy(rest, t->body.data + head, len);
+	  t->body.len = head;
+	  t->body.data[head] = 0;
+	  charset_append(&cs, &t->body, rest, len);
+	  mem_free(rest);
+	}
+      }
+      
+      /* A page still coming after live_after may never end: it goes
+       * live while under the live buffer, more is a large page still
+       * arriving and gets until total_timeout before it goes live */
+      watch = t->resp->status == 20 && t->resp->body != NULL && cfg.live_after > 0;
+      if (watch)
+	conn_deadline(&conn, cfg.live_after);
+      
+      while ((ret = read_response(&ssl, &t->body, convert ? &cs : NULL, &t->trace)) == MBEDTLS_ERR_SSL_TIMEOUT
+	     && watch)
+      {
+	if (conn.end != 0 && trace_now() >= conn.end)
+	  live = true;
+	else if (conn.deadline == 0 || trace_now() < conn.deadline)
+	  break;
+	else if (t->body.len - head < cfg.live_buffer)
+	  live = true;
+	
+	if (live)
+	  break;
+	conn_deadline(&conn, cfg.live_after);
+      }
+      
+      if (live)
+	tab_live(t, &ssl, &conn, head, convert ? &cs : NULL);
+      else
+      {
+	if (convert)
+	  charset_finish(&cs, &t->body);
+	spill_finish(&t->body);
+	
+	if (ret == MBEDTLS_ERR_SSL_TIMEOUT)
+	{
+	  strcpy(t->error_msg, "Timed out, the page is incomplete");
+	  stats_count(&stats.timeouts);
+	}
+	
+	/* The body may be moved or mapped, the header is copied */
+	if (t->resp->body != NULL)
+	  t->resp->body = t->body.data + head;
+	trace_mark(&t->trace, PHASE_BODY);
+	stats_request(t->resp->status, t->body.len, &t->trace);
+      }
+      if (convert)
+	charset_close(&cs);
+    }
+    
+    tab_disconnect(t, &conn, &ssl);
+
+    if (t->resp->status == 30 || t->resp->status == 31)
+    {
+      /* Redirects may be relative */
+      if (resolve_link(t->page_url, t->resp->meta, t->get_request, sizeof(t->get_request)) < 0)
+	strcpy(t->get_request, t->resp->meta);
+      if (titan)
+	titan_view_url(t->get_request);
+      else if (t->resp->status == 31)
+	redirect_add(t->page_url, t->get_request);
+      trace_end(&t->trace);
+      goto request;
+    }
+  }
+  else if (!strcmp(t->scheme, "file"))
+  {
+    t->buf = read_file(t->buf, t->get_request);
+    trace_mark(&t->trace, PHASE_BODY);
+  }
+  else if (!strcmp(t->scheme, "about"))
+  {
+    t->buf = read_about(t->buf, t->get_request);
+    trace_mark(&t->trace, PHASE_BODY);
+  }
+  
+  /* Parse the page once, redraws only render it */
+  if ((!strcmp(t->scheme, "gemini") || t->scheme[0] == 0 || !strcmp(t->scheme, "titan"))
+      && t->resp->body != NULL)
+  {
+    size_t len = t->body.len - (t->resp->body - t->body.data);
+    
+    doc_parse(&t->doc, &t->page, t->resp->body, len, mime_is_gemini(t->resp->meta));
+    
+    /* Indexed on its own thread, this only copies the text */
+    if (t->resp->status == 20 && mime_is_gemini(t->resp->meta) && !titan)
+      index_add(t->page_url, t->resp->body, len);
+  }
+  else if (!strcmp(t->scheme, "file"))
+    doc_parse(&t->doc, &t->page, t->buf, strlen(t->buf),
+	      !strcmp(t->get_request+strlen(t->get_request)-3, "gmi"));
+  else if (!strcmp(t->scheme, "about"))
+    doc_parse(&t->doc, &t->page, t->buf, strlen(t->buf), true);
+}
+
+static void *tab_thread(void *arg)
+{
+  struct tab *t = arg;
+
+  tab_fetch(t);
+  
+  /* An upload ends with its throughput on the status line */
+  if (t->ul.fd >= 0)
+  {
+    if (t->error_msg[0] == 0)
+      upload_status(&t->ul, t->error_msg, sizeof(t->error_msg));
+    upload_close(&t->ul);
+  }
+  __atomic_store_n(&t->state, TAB_READY, __ATOMIC_RELEASE);
+  tab_wake(t, true);
+
+  return NULL;
+}
+
+void tabs_init(struct session *s, int wakeup_fd)
+{
+  session = s;
+  wakeup = wakeup_fd;
+}
+
+struct tab *tab_new()
+{
+  struct tab *t = mem_calloc(MEM_DOC, 1, sizeof(struct tab));
+
+  if (t == NULL)
+    return NULL;
+  if ((t->buf = mem_malloc(MEM_RECV, 1)) == NULL)
+  {
+    mem_free(t);
+    return NULL;
+  }
+
+  t->body.limit = cfg.memory_limit;
+  t->ul.fd = -1;
+  t->sock = -1;
+  t->buf[0] = 0;
+  live_init(&t->live);
+
+  t->next = tabs_all;
+  tabs_all = t;
+
+  return t;
+}
+
+/* Starts loading url on the tab's thread, or queues it if a load is
+ * already running. A live response is stopped for it. */
+void tab_open(struct tab *t, const char *url)
+{
+  if (tab_state(t) == TAB_LOADING || tab_state(t) == TAB_LIVE)
+  {
+    snprintf(t->pending, sizeof(t->pending), "%s", url);
+    tab_stop(t);
+    return;
+  }
+
+  snprintf(t->get_request, sizeof(t->get_request), "%s", url);
+  t->pending[0] = 0;
+  t->start_line = 0;
+  t->painted = false;
+  t->follow = true;
+  search_clear(&t->search);
+  layout_invalidate(&t->layout);
+  
+  /* The last live page goes with it */
+  live_free(&t->live);
+  __atomic_store_n(&t->live.stop, false, __ATOMIC_RELAXED);
+  
+  __atomic_store_n(&t->state, TAB_LOADING, __ATOMIC_RELAXED);
+
+  if (pthread_create(&t->thread, NULL, tab_thread, t) != 0)
+  {
+    strcpy(t->error_msg, "Could not start loading");
+    __atomic_store_n(&t->state, TAB_READY, __ATOMIC_RELEASE);
+  }
+  else
+    fetching++;
+}
+
+/* Opens a titan:// URL with path as its content. Fails while the tab
+ * is loading, the file would go with whatever it loads next. */
+int tab_upload(struct tab *t, const char *url, const char *path)
+{
+  if (tab_state(t) == TAB_LOADING || tab_state(t) == TAB_LIVE)
+    return -1;
+
+  snprintf(t->upload, sizeof(t->upload), "%s", path);
+  tab_open(t, url);
+
+  return 0;
+}
+
+int tab_state(struct tab *t)
+{
+  return __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+}
+
+/* Whether the tab has a page to show, which a live one has while its
+ * fetch goes on */
+bool tab_shown(struct tab *t)
+{
+  int state = tab_state(t);
+
+  return state == TAB_READY || state == TAB_LIVE;
+}
+
+/* Reads which tab finished loading, or has new live text, from the
+ * wakeup pipe */
+struct tab *tab_finished(int wakeup_fd, bool *done)
+{
+  struct wakeup_msg msg;
+
+  if (read(wakeup_fd, &msg, sizeof(msg)) != sizeof(msg))
+    return NULL;
+
+  if (msg.done)
+  {
+    pthread_join(msg.t->thread, NULL);
+    fetching--;
+  }
+  *done = msg.done;
+
+  return msg.t;
+}
+
+/* Asks a live fetch to end, loads that do end on their own ignore it */
+void tab_stop(struct tab *t)
+{
+  __atomic_store_n(&t->live.stop, true, __ATOMIC_RELEASE);
+}
+
+/* Parses a copy of the live text on the UI thread. A search is run
+ * again on the new text. */
+void tab_live_update(struct tab *t)
+{
+  char pattern[sizeof(t->search.pattern)];
+  size_t len;
+
+  if (t->live.ring == NULL || t->resp == NULL)
+    return;
+
+  if (t->live_text == NULL
+      && (t->live_text = mem_malloc(MEM_DOC, t->live.size + 1)) == NULL)
+    return;
+
+  len = live_copy(&t->live, t->live_text);
+
+  arena_reset(&t->live_page);
+  memset(&t->doc, 0, sizeof(struct document));
+  doc_parse(&t->doc, &t->live_page, t->live_text, len, mime_is_gemini(t->resp->meta));
+  layout_invalidate(&t->layout);
+
+  if (t->search.pattern[0])
+  {
+    strcpy(pattern, t->search.pattern);
+    search_build(&t->search, t->doc.text, t->doc.len, pattern, t->search.ignore_case);
+  }
+}
+
+/* Ends every fetch for exit: live reads are told to stop and sockets
+ * are shut down, which wakes reads and writes blocked on them. Waits
+ * up to wait_ms for the threads, closed tabs are freed as they finish.
+ * Returns whether all of them were joined. */
+bool tabs_stop(int wakeup_fd, int wait_ms)
+{
+  uint64_t end = trace_now() + wait_ms * 1000ULL;
+  struct pollfd fds = { .fd = wakeup_fd, .events = POLLIN };
+  struct tab *t;
+  bool done;
+  int sock;
+
+  for (t = tabs_all; t != NULL; t = t->next)
+  {
+    tab_stop(t);
+    if ((sock = __atomic_load_n(&t->sock, __ATOMIC_ACQUIRE)) >= 0)
+      shutdown(sock, SHUT_RDWR);
+  }
+
+  while (fetching > 0 && trace_now() < end)
+  {
+    if (poll(&fds, 1, (end - trace_now()) / 1000 + 1) <= 0)
+      continue;
+    if ((t = tab_finished(wakeup_fd, &done)) != NULL && done && t->closed)
+      tab_free(t);
+  }
+
+  return fetching == 0;
+}
+
+void tab_free(struct tab *t)
+{
+  struct tab **p;
+
+  for (p = &tabs_all; *p != NULL && *p != t; p = &(*p)->next)
+    ;
+  if (*p != NULL)
+    *p = t->next;
+
+  live_free(&t->live);
+  pthread_mutex_destroy(&t->live.lock);
+  mem_free(t->live_text);
+  arena_free(&t->live_page);
+  arena_free(&t->page);
+  spill_free(&t->body);
+  mem_free(t->buf);
+  layout_free(&t->layout);
+  search_clear(&t->search);
+  mem_free(t);
+}
@@ -0,0 +1,87 @@
+#ifndef _TAB_H
+#define _TAB_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "net.h"
+#include "arena.h"
+#include "spill.h"
+#include "gemtext.h"
+#include "download.h"
+#include "search.h"
+#include "trace.h"
+#include "term.h"
+#include "live.h"
+#include "titan.h"
+
+enum tab_state
+{
+  TAB_EMPTY,
+  TAB_LOADING,       /* The page belongs to the fetch thread */
+  TAB_LIVE,          /* Still fetching, the page shows the live tail */
+  TAB_READY,
+};
+
+struct response
+{
+  int status;
+  char *meta;
+  char *body;
+};
+
+struct tab
+{
+  char get_request[1025];
+  char page_url[1025];
+  char server_name[255];
+  char server_port[10];
+  char scheme[100];
+  char pending[1025];      /* Asked for while loading, loaded next */
+  char upload[1024];       /* File the next titan:// URL sends */
+
+  /* Page, written by the fetch thread */
+  struct arena page;
+  struct spill body;
+  char *buf;               /* file: and about: pages */
+  struct response *resp;
+  struct document doc;
+  struct download dl;
+  struct upload ul;
+  struct trace trace;
+  char error_msg[100];
+  struct live live;        /* Tail of an endless response */
+
+  /* View, only touched by the UI */
+  struct layout layout;
+  struct search search;
+  int start_line;
+  char timing_text[200];
+  bool painted;            /* The first paint finishes the trace */
+  bool closed;             /* Freed once its fetch is done */
+  char *live_text;         /* Copy of the live tail the page is parsed from */
+  struct arena live_page;
+  bool follow;             /* Live pages keep their last line in view */
+
+  int state;               /* enum tab_state */
+  pthread_t thread;
+  int sock;                /* Of the fetch, -1 between connections */
+  struct tab *next;        /* In the list of every tab */
+};
+
+void tabs_init(struct session *s, int wakeup_fd);
+struct tab *tab_new();
+void tab_open(struct tab *t, const char *url);
+int tab_upload(struct tab *t, const char *url, const char *path);
+int tab_state(struct tab *t);
+bool tab_shown(struct tab *t);
+struct tab *tab_finished(int wakeup_fd, bool *done);
+void tab_stop(struct tab *t);
+bool tabs_stop(int wakeup_fd, int wait_ms);
+void tab_live_update(struct tab *t);
+void tab_free(struct tab *t);
+
+int resolve_link(char *base, char *link, char *out, size_t len);
+struct response *read_response_header(char *buf, struct arena *page);
+
+#endif /* _TAB_H */
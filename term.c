@@ -5,6 +5,11 @@
 #include <ctype.h>
 
 #include "term.h"
+#include "mem.h"
+#include "utf8.h"
+#include "stats.h"
+#include "config.h"
+#include "pool.h"
 
 struct termios setup_term()
 {
@@ -61,8 +66,30 @@ void show_cursor(bool show)
 
 int parse_input(char input, char *command)
 {
-  if (command[0] != ':')
-  {  
+  if (command[0] != ':' && command[0] != '/')
+  {
+    /* Pending keys are a count as in 50j, maybe followed by the first
+     * g of gg */
+    size_t len = strlen(command);
+    bool pending_g = len > 0 && command[len-1] == 'g';
+    char count[12];
+
+    if (!pending_g && len < 9 && ((input >= '1' && input <= '9')
+				   || (input == '0' && len > 0)))
+    {
+      command[len] = input;
+      return 0;
+    }
+
+    if (input == 'g' && !pending_g)
+    {
+      command[len] = 'g';
+      return 0;
+    }
+
+    snprintf(count, sizeof(count), "%.*s", (int) (len - pending_g), command);
+    memset(command, 0, len);
+    
     switch(input)
     {
     case 'q':
@@ -71,23 +98,79 @@ int parse_input(char input, char *command)
       break;
       
     case 'j':
-      strcat(command, ":down"); 
+      sprintf(command, ":down %s", count);
       break;
       
     case 'k':
-      strcat(command, ":up"); 
+      sprintf(command, ":up %s", count);
+      break;
+
+    case ' ':
+    case 6: /* ^F */
+      sprintf(command, ":pagedown %s", count);
+      break;
+
+    case 2: /* ^B */
+      sprintf(command, ":pageup %s", count);
+      break;
+
+    case 4: /* ^D */
+      sprintf(command, ":halfdown %s", count);
+      break;
+
+    case 21: /* ^U */
+      sprintf(command, ":halfup %s", count);
+      break;
+
+    case 't':
+    case 'T':
+      if (!pending_g)
+	return 0;
+      strcat(command, input == 't' ? ":tabnext" : ":tabprev");
+      break;
+
+    case 'g':
+      if (count[0])
+	sprintf(command, ":line %s", count);
+      else
+	strcat(command, ":top");
+      break;
+
+    case 'G':
+      if (count[0])
+	sprintf(command, ":line %s", count);
+      else
+	strcat(command, ":bottom");
       break;
 
     case '?':
       strcat(command, ":help"); 
       break;
 
+    case 'n':
+      strcat(command, ":next"); 
+      break;
+
+    case 'N':
+      strcat(command, ":prev"); 
+      break;
+
+    case '/':
+      strcat(command, "/"); 
+      return 0;
+
     case 'o':
       strcat(command, ":open "); 
       return 0;
+
+    case 'O':
+      strcat(command, ":tabopen "); 
+      return 0;
       
     case ':':
       strcat(command, ":");
+      return 0;
+
     default:
       return 0;
     }
@@ -114,229 +197,652 @@ int parse_input(char input, char *command)
   return 0;
 }
 
-enum line_types
+#define RESET_STYLE "\e[39;49;22;23;24;25m"
+
+/* How a line is drawn: its style, a generated prefix (link number, list
+ * bullet) and the part of the document text that is shown */
+struct line_view
 {
-  NORMAL_LINE,
-  LINK_LINE,
-  LINK_LINE_LINK,
-  LINK_LINE_SPACE,
-  LINK_LINE_DESC,
-  PREFORMATTED_TOGGLE_LINE,
-  PREFORMATTED_TEXT_LINE,
-  HEADING_LINE,
-  SUBHEADING_LINE,
-  SUBSUBHEADING_LINE,
-  LIST_LINE,
-  QUOTE_LINE,
+  const char *style;
+  char prefix[32];
+  int prefix_width;
+  const char *text;
+  size_t len;
 };
 
-struct print_info print_text(char *buf, struct winsize ws,
-			     int start_line, bool gemini) 
+static size_t link_number(struct document *doc, size_t line)
+{
+  size_t lo = 0, hi = doc->links_len;
+
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+
+    if (doc->links[mid] < line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* Returns false for lines that are not drawn */
+static bool view_line(struct document *doc, size_t i, struct line_view *v)
 {
-  char ch;
-  int tmpi=0, line=0, preformatted_tmp=0, links_len=0, linki=0;
-  bool reached_end = true;
-  bool line_start = true;
-  bool newline = false;
-  bool preformatted_line = true;
-  enum line_types line_type = NORMAL_LINE;
-
-  char **links = {NULL};
+  struct doc_line *line = &doc->lines[i];
+  const char *url, *label;
+  size_t url_len, label_len;
+  size_t n;
   
-  for (unsigned long i = 0; i < strlen(buf); i++)
+  v->style = "";
+  v->prefix[0] = 0;
+  v->prefix_width = 0;
+  v->text = doc->text + line->off;
+  v->len = line->len;
+
+  switch (line->type)
   {
-    ch = buf[i];
-    tmpi++;
+  case LINE_TEXT:
+  case LINE_PRE:
+  case LINE_QUOTE:
+    if (line->type == LINE_QUOTE)
+      v->style = "\e[3m";
+    break;
+  case LINE_PRE_TOGGLE:
+    return false;
+  case LINE_LINK:
+    line_link(v->text, v->len, &url, &url_len, &label, &label_len);
     
-    if (ch == '\n')
-      newline = true;
+    n = link_number(doc, i);
+    v->prefix_width = snprintf(v->prefix, sizeof(v->prefix), "(%lu) ", (unsigned long) n);
+    snprintf(v->prefix, sizeof(v->prefix), "(\e[5m%lu\e[25m) ", (unsigned long) n);
     
-    if (tmpi > ws.ws_col-1)
+    /* Links without a label show their URL */
+    if (label_len)
     {
-      if (line >= start_line)
-	putchar(ch);
-      newline = true;
+      v->text = label;
+      v->len = label_len;
     }
-    
-    if (line-start_line > ws.ws_row-2)
+    else
     {
-      reached_end = false;
-      break;
+      v->text = url;
+      v->len = url_len;
     }
+    break;
+  case LINE_HEADING:
+  case LINE_SUBHEADING:
+  case LINE_SUBSUBHEADING:
+    if (line->type == LINE_HEADING)
+      v->style = "\e[1;4m";
+    else if (line->type == LINE_SUBHEADING)
+      v->style = "\e[1m";
+    else
+      v->style = "\e[4m";
     
-    if (newline)
+    while (v->len && (*v->text == '#' || *v->text == ' ' || *v->text == '\t'))
     {
-      ch = '\n';
-
-      if (line_type != PREFORMATTED_TOGGLE_LINE)
-	line++;
-
-      tmpi=0;
-      newline = false;
-      line_start = true;
-      preformatted_tmp = 0;
-      fputs("\e[39;49;22;23;24;25m", stdout); /* Reset styling */
-      fflush(stdout);
-
-      if (linki)
-      {
-	if (line_type == LINK_LINE_LINK)
-	  fputs(links[links_len], stdout);
-	
-	links[links_len][linki] = 0;
-	linki=0;
-	links_len++;
-      }
-      
-      if (line_type == PREFORMATTED_TOGGLE_LINE)
-      {
-	line_type = NORMAL_LINE;
-	continue;
-      }
-      else
-	line_type = NORMAL_LINE;
+      v->text++;
+      v->len--;
     }
+    break;
+  case LINE_LIST:
+    strcpy(v->prefix, " •");
+    v->prefix_width = 2;
+    v->text++;
+    v->len--;
+    break;
+  }
+  
+  return true;
+}
+
+/* Bytes of text that go on a row starting at column col. Only returns 0
+ * when the prefix left no room, so characters wider than the screen
+ * still make progress. */
+static size_t row_fit(const char *text, size_t len, size_t cols, size_t col)
+{
+  size_t width, n;
+  uint32_t cp;
 
-    if (gemini) /* Gemini parsing */
+  n = utf8_fit(text, len, col < cols ? cols - col : 0, &width);
+  
+  if (n == 0 && len > 0 && col == 0)
+    n = utf8_decode(text, len, &cp);
+
+  return n;
+}
+
+static int line_rows(struct line_view *v, int cols)
+{
+  size_t pos = 0, col = v->prefix_width;
+  int rows = 1;
+
+  /* Pure ASCII lines need no decoding. A prefix as wide as the screen
+   * gets a row of its own below, which the sum would not count. */
+  if (col < (size_t) cols && ascii_prefix(v->text, v->len) == v->len)
+  {
+    size_t width = v->prefix_width + v->len;
+    
+    return width ? (width + cols - 1) / cols : 1;
+  }
+
+  while ((pos += row_fit(v->text + pos, v->len - pos, cols, col)) < v->len)
+  {
+    rows++;
+    col = 0;
+  }
+
+  return rows;
+}
+
+static void put_text(const char *text, size_t len, size_t offset,
+		     struct search *search, size_t *cursor)
+{
+  bool on = false, highlight;
+
+  if (search == NULL || search->count == 0)
+  {
+    fwrite(text, 1, len, stdout);
+    return;
+  }
+  
+  for (size_t j = 0; j < len; j++)
+  {
+    highlight = search_highlight(search, offset + j, cursor);
+
+    /* Only switch between characters, never inside one */
+    if (highlight != on && (text[j] & 0xC0) != 0x80)
     {
-      if (line_start && ch == '`')
-      {
-	preformatted_tmp++;
-	
-	if (preformatted_tmp > 2)
-	  preformatted_line = !preformatted_line;
-	  
-	line_type = PREFORMATTED_TOGGLE_LINE;
-	
-	continue;
-      }
+      fputs(highlight ? "\e[7m" : "\e[27m", stdout);
+      on = highlight;
     }
     
-    if (line < start_line)
-      continue;
-    
-    if (tmpi == 1 && ch == ' ')
-      continue;
+    putchar(text[j]);
+  }
+
+  if (on)
+    fputs("\e[27m", stdout);
+}
+
+/* Draw the rows of a line from skip on, at most max_rows of them.
+ * Returns how many were drawn. */
+static int draw_line(struct document *doc, struct line_view *v, int cols,
+		     int skip, int max_rows, struct search *search, size_t *cursor)
+{
+  size_t pos = 0, col = v->prefix_width, n;
+  size_t offset = v->text - doc->text;
+  int row = 0, drawn = 0;
+
+  do
+  {
+    n = row_fit(v->text + pos, v->len - pos, cols, col);
     
-    if (gemini && preformatted_line)
-      {
-	if (line_start)
-	{
-	  switch (ch)
-	  {   
-	  case '>':
-	    if (line_type != LINK_LINE)
-	      line_type = QUOTE_LINE;
-	    else
-	    {
-	      printf("(\e[5m%d\e[25m) ", links_len);
-	      links = realloc(links, (links_len+1)*sizeof(char*));
-	      links[links_len] = malloc(1025);
-	    }
-
-	    line_start = false;
-	    break;
-	    
-	  case '*':
-	    line_start = false;
-	    line_type = LIST_LINE;
-	    
-	    fputs(" •", stdout);
-	    continue;
-	    
-	    break;
-	    
-	  case '#':
-	    if (line_type < HEADING_LINE)
-	      line_type = HEADING_LINE;
-	    else
-	      if (line_type < SUBSUBHEADING_LINE)
-		line_type++;
-	    continue;
-	    
-	    break;
-
-	  case '=':
-	    line_type = LINK_LINE;
-	    break;
-	    
-	  case '\n':
-	    break;
-	    
-	  case ' ':
-	    if (line_type >= HEADING_LINE && line_type <= SUBSUBHEADING_LINE)
-	      continue;
-	    break;
-	    
-	  default: 
-	    if (line_type == LINK_LINE)
-	      line_type = NORMAL_LINE;
-
-	    line_start = false;
-	  }
-	}
-
-	switch (line_type)
-	{
-	case NORMAL_LINE:
-	case PREFORMATTED_TEXT_LINE:
-	case LIST_LINE: /* To make compiler shut up */
-	  break;
-	case LINK_LINE:
-	  if (ch == ' ')
-	    line_type++;
-	  continue;
-	  break;
-	case LINK_LINE_LINK:
-	  if (isspace(ch))
-	    line_type++;
-	  else
-	    links[links_len][linki++] = ch;
-	  continue;
-	  break;
-	case LINK_LINE_SPACE:
-	  if (isspace(ch))
-	    continue;
-	  else
-	    line_type++;
-	case LINK_LINE_DESC:
-	  break;
-	case PREFORMATTED_TOGGLE_LINE:
-	  continue; 
-	  break;
-	case HEADING_LINE:
-	  fputs("\e[1;4m", stdout);
-	  break;
-	case SUBHEADING_LINE:
-	  fputs("\e[1m", stdout);
-	  break;
-	case SUBSUBHEADING_LINE:
-	  fputs("\e[4m", stdout);
-	  break;
-	case QUOTE_LINE:
-	  fputs("\e[3m", stdout);
-	  break;
-	}
+    if (row >= skip)
+    {
+      fputs(v->style, stdout);
+      if (row == 0)
+	fputs(v->prefix, stdout);
+      
+      put_text(v->text + pos, n, offset + pos, search, cursor);
+      fputs(RESET_STYLE "\n", stdout);
+      drawn++;
     }
     
-    putchar(ch);
-    fflush(stdout);
+    pos += n;
+    row++;
+    col = 0;
   }
+  while (pos < v->len && drawn < max_rows);
+
+  return drawn;
+}
+
+/* Rendered lines: every row of a line with its style, prefix and reset,
+ * so drawing them again is a copy. Keyed by the page's text and the
+ * line, which lets tabs and later visits showing the same text share
+ * them. Bounded by render_cache bytes, least recently drawn first out,
+ * and all dropped when the width changes. */
+struct rendered
+{
+  struct rendered *next;           /* Same bucket */
+  struct rendered *newer, *older;
+  uint64_t page;
+  size_t line;
+  size_t size;
+  int rows;
+  uint32_t *ends;                  /* Row r is text[ends[r-1]..ends[r]) */
+  char *text;
+};
+
+#define RENDER_BUCKETS 4096
+
+static struct rendered *render_table[RENDER_BUCKETS];
+static struct rendered *newest, *oldest;
+static size_t render_used;
+static int render_cols;
+
+static size_t render_bucket(uint64_t page, size_t line)
+{
+  return ((page ^ line) * 0x9E3779B97F4A7C15ull) >> 52;
+}
+
+static void render_unlink(struct rendered *r)
+{
+  struct rendered **p = &render_table[render_bucket(r->page, r->line)];
+
+  while (*p != r)
+    p = &(*p)->next;
+  *p = r->next;
+
+  if (r->newer)
+    r->newer->older = r->older;
+  else
+    newest = r->older;
+  if (r->older)
+    r->older->newer = r->newer;
+  else
+    oldest = r->newer;
+}
+
+static void render_push(struct rendered *r)
+{
+  r->older = newest;
+  r->newer = NULL;
+  if (newest)
+    newest->newer = r;
+  else
+    oldest = r;
+  newest = r;
+}
+
+static void render_flush()
+{
+  struct rendered *r, *older;
+
+  for (r = newest; r != NULL; r = older)
+  {
+    older = r->older;
+    mem_free(r);
+  }
+
+  memset(render_table, 0, sizeof(render_table));
+  newest = oldest = NULL;
+  render_used = 0;
+}
+
+/* Lays the line out into a new entry, or NULL when it does not fit in
+ * the cache at all */
+static struct rendered *render_line(struct line_view *v, int cols,
+				    uint64_t page, size_t line)
+{
+  struct rendered *r;
+  size_t pos = 0, col = v->prefix_width, n, size, bytes;
+  size_t style_len = strlen(v->style), prefix_len = strlen(v->prefix);
+  size_t reset_len = strlen(RESET_STYLE "\n");
+  int rows = 0;
+
+  do
+  {
+    pos += row_fit(v->text + pos, v->len - pos, cols, col);
+    rows++;
+    col = 0;
+  }
+  while (pos < v->len);
+
+  bytes = rows * (style_len + reset_len) + prefix_len + v->len;
+  size = sizeof(struct rendered) + rows * sizeof(uint32_t) + bytes;
+
+  if (size > cfg.render_cache || bytes > UINT32_MAX)
+    return NULL;
+
+  while (render_used + size > cfg.render_cache)
+  {
+    struct rendered *old = oldest;
 
+    render_unlink(old);
+    render_used -= old->size;
+    mem_free(old);
+  }
+
+  if ((r = mem_malloc(MEM_CACHE, size)) == NULL)
+    return NULL;
+
+  r->page = page;
+  r->line = line;
+  r->size = size;
+  r->rows = rows;
+  r->ends = (uint32_t *) (r + 1);
+  r->text = (char *) (r->ends + rows);
+
+  bytes = 0;
+  pos = 0;
+  col = v->prefix_width;
+
+  for (int row = 0; row < rows; row++)
+  {
+    n = row_fit(v->text + pos, v->len - pos, cols, col);
+
+    memcpy(r->text + bytes, v->style, style_len);
+    bytes += style_len;
+    if (row == 0)
+    {
+      memcpy(r->text + bytes, v->prefix, prefix_len);
+      bytes += prefix_len;
+    }
+    memcpy(r->text + bytes, v->text + pos, n);
+    bytes += n;
+    memcpy(r->text + bytes, RESET_STYLE "\n", reset_len);
+    bytes += reset_len;
+
+    r->ends[row] = bytes;
+    pos += n;
+    col = 0;
+  }
+
+  r->next = render_table[render_bucket(page, line)];
+  render_table[render_bucket(page, line)] = r;
+  render_push(r);
+  render_used += size;
+
+  return r;
+}
+
+static struct rendered *render_get(struct line_view *v, int cols,
+				   uint64_t page, size_t line)
+{
+  struct rendered *r;
+
+  for (r = render_table[render_bucket(page, line)]; r != NULL; r = r->next)
+    if (r->page == page && r->line == line)
+      break;
+
+  stats_cache(&stats.rendered, r != NULL);
+
+  if (r == NULL)
+    return render_line(v, cols, page, line);
+
+  render_unlink(r);
+  r->next = render_table[render_bucket(page, line)];
+  render_table[render_bucket(page, line)] = r;
+  render_push(r);
+
+  return r;
+}
+
+/* Same as draw_line() for a rendered line */
+static int render_draw(struct rendered *r, int skip, int max_rows)
+{
+  int last = skip + max_rows < r->rows ? skip + max_rows : r->rows;
+  size_t start;
+
+  if (skip >= last)
+    return 0;
+  start = skip > 0 ? r->ends[skip-1] : 0;
+
+  fwrite(r->text + start, 1, r->ends[last-1] - start, stdout);
+
+  return last - skip;
+}
+
+/* Names a document by its text for the rendered lines */
+static uint64_t page_hash(struct document *doc)
+{
+  uint64_t h = doc->len * 0x9E3779B97F4A7C15ull ^ doc->gemini, w;
+  size_t i;
+
+  for (i = 0; i + 8 <= doc->len; i += 8)
+  {
+    memcpy(&w, doc->text + i, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+
+  w = 0;
+  if (i < doc->len)
+    memcpy(&w, doc->text + i, doc->len - i);
+  h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+
+  return h ^ h >> 29;
+}
+
+/* Rebuilds the row index when the width changed. Returns the number of
+ * rows the document takes. */
+/* Pages with this many lines are wrapped in chunks on the pool: each
+ * chunk counts its rows from 0, then adds the rows of the chunks
+ * before it */
+#define LAYOUT_PARALLEL 100000
+#define LAYOUT_CHUNK 16384
+
+struct layout_job
+{
+  struct layout *l;
+  struct document *doc;
+  int cols;
+  size_t *sums;        /* Rows of each chunk, then rows before it */
+};
+
+static void layout_count(void *arg, size_t n)
+{
+  struct layout_job *job = arg;
+  size_t end = (n + 1) * LAYOUT_CHUNK, row = 0;
+  struct line_view v;
+
+  if (end > job->doc->lines_len)
+    end = job->doc->lines_len;
+
+  for (size_t i = n * LAYOUT_CHUNK; i < end; i++)
+  {
+    job->l->rows[i] = row;
+
+    if (view_line(job->doc, i, &v))
+      row += line_rows(&v, job->cols);
+  }
+
+  job->sums[n] = row;
+}
+
+static void layout_shift(void *arg, size_t n)
+{
+  struct layout_job *job = arg;
+  size_t end = (n + 1) * LAYOUT_CHUNK;
+
+  if (end > job->doc->lines_len)
+    end = job->doc->lines_len;
+
+  for (size_t i = n * LAYOUT_CHUNK; i < end; i++)
+    job->l->rows[i] += job->sums[n];
+}
+
+static bool layout_chunks(struct layout *l, struct document *doc, int cols,
+			  size_t *total)
+{
+  size_t n = (doc->lines_len + LAYOUT_CHUNK - 1) / LAYOUT_CHUNK, row = 0, rows;
+  struct layout_job job = { l, doc, cols, NULL };
+
+  if ((job.sums = mem_malloc(MEM_DOC, n * sizeof(size_t))) == NULL)
+    return false;
+
+  pool_run(layout_count, &job, n);
+
+  for (size_t i = 0; i < n; i++)
+  {
+    rows = job.sums[i];
+    job.sums[i] = row;
+    row += rows;
+  }
+
+  pool_run(layout_shift, &job, n);
+  mem_free(job.sums);
+
+  *total = row;
+  return true;
+}
+
+size_t layout_update(struct layout *l, struct document *doc, struct winsize ws)
+{
+  struct line_view v;
+  int cols = ws.ws_col > 1 ? ws.ws_col - 1 : 1;
+  size_t row = 0;
+
+  if (l->cols == cols && l->rows != NULL)
+    return l->rows[doc->lines_len];
+
+  if (l->cols == 0)
+    l->page = page_hash(doc);
+
+  if (l->size < doc->lines_len + 1)
+  {
+    size_t *tmp = mem_realloc(MEM_DOC, l->rows, (doc->lines_len + 1) * sizeof(size_t));
+
+    if (tmp == NULL)
+      return 0;
+
+    l->rows = tmp;
+    l->size = doc->lines_len + 1;
+  }
+
+  if (doc->lines_len < LAYOUT_PARALLEL || pool_size() == 1
+      || !layout_chunks(l, doc, cols, &row))
+    for (size_t i = 0; i < doc->lines_len; i++)
+    {
+      l->rows[i] = row;
+      
+      if (view_line(doc, i, &v))
+	row += line_rows(&v, cols);
+    }
+
+  l->rows[doc->lines_len] = row;
+  l->cols = cols;
+
+  return row;
+}
+
+/* For a new document */
+void layout_invalidate(struct layout *l)
+{
+  l->cols = 0;
+}
+
+void layout_free(struct layout *l)
+{
+  mem_free(l->rows);
+  memset(l, 0, sizeof(struct layout));
+}
+
+/* First row of line, clamped to the end of the document */
+size_t layout_line_row(struct layout *l, struct document *doc, size_t line)
+{
+  return l->rows[line < doc->lines_len ? line : doc->lines_len];
+}
+
+/* Line that row is part of */
+static size_t layout_find(struct layout *l, struct document *doc, size_t row)
+{
+  size_t lo = 0, hi = doc->lines_len;
+
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+
+    if (l->rows[mid + 1] <= row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* Draws one screen from start_line. Only the visible lines are looked
+ * at, the layout finds where to start. */
+struct print_info print_text(struct document *doc, struct layout *layout,
+			     struct winsize ws, int start_line, struct search *search)
+{
   struct print_info ret;
-  ret.reached_end = reached_end;
-  ret.links = links;
-  ret.links_len = links_len;
+  struct line_view v;
+  struct rendered *r;
+  int cols = ws.ws_col > 1 ? ws.ws_col - 1 : 1;
+  int rows = ws.ws_row - 1;
+  int drawn = 0;
+  int n, skip;
+  size_t cursor = 0, total;
+  bool first = true;
+
+  total = layout_update(layout, doc, ws);
+  ret.reached_end = (size_t) start_line + rows >= total;
+
+  if (layout->rows == NULL)
+    return ret;
+
+  if (cols != render_cols)
+  {
+    render_flush();
+    render_cols = cols;
+  }
+
+  for (size_t i = layout_find(layout, doc, start_line); i < doc->lines_len && drawn < rows; i++)
+  {
+    if (!view_line(doc, i, &v))
+      continue;
+    
+    if (first && search != NULL)
+      cursor = search_cursor(search, v.text - doc->text);
+    first = false;
+    
+    n = layout->rows[i+1] - layout->rows[i];
+    skip = (size_t) start_line > layout->rows[i] ? start_line - layout->rows[i] : 0;
+
+    if (skip >= n)
+      continue;
+
+    /* Highlighted matches are drawn as they are */
+    r = NULL;
+    if ((search == NULL || search->count == 0) && cfg.render_cache > 0)
+      r = render_get(&v, cols, layout->page, i);
+
+    if (r != NULL)
+      drawn += render_draw(r, skip, rows - drawn);
+    else
+      drawn += draw_line(doc, &v, cols, skip, rows - drawn, search, &cursor);
+  }
+
+  fflush(stdout);
   
   return ret;
 }
 
-void free_info(struct print_info pinfo)
+/* Row of the document that offset is drawn on */
+int line_at_offset(struct document *doc, struct layout *layout,
+		   size_t offset, struct winsize ws)
 {
-  if (pinfo.links != NULL)
+  struct line_view v;
+  int cols = ws.ws_col > 1 ? ws.ws_col - 1 : 1;
+  int row;
+  size_t line;
+
+  if (doc->lines_len == 0)
+    return 0;
+  
+  if (layout_update(layout, doc, ws), layout->rows == NULL)
+    return 0;
+  
+  line = doc_line_at(doc, offset);
+  row = layout->rows[line];
+
+  if (view_line(doc, line, &v) && offset >= (size_t) (v.text - doc->text))
   {
-    for (int i=0; i < pinfo.links_len; i++)
-      free(pinfo.links[i]);
-    free(pinfo.links);
+    size_t target = offset - (v.text - doc->text);
+    size_t pos = 0, col = v.prefix_width, n;
+
+    while ((n = row_fit(v.text + pos, v.len - pos, cols, col)), pos + n <= target
+	   && pos + n < v.len)
+    {
+      pos += n;
+      row++;
+      col = 0;
+    }
   }
+  
+  return row;
 }
@@ -1,18 +1,41 @@
+#ifndef _TERM_H
+#define _TERM_H
+
 #include <stdbool.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "search.h"
+#include "gemtext.h"
 
 struct print_info
 {
   bool reached_end;
-  char **links;
-  int links_len;
+};
+
+/* First row of every line at the current width, so drawing and
+ * scrolling never walk the document before what is on screen */
+struct layout
+{
+  size_t *rows;     /* rows[lines_len] is the total */
+  size_t size;
+  int cols;         /* 0 until built for a document */
+  uint64_t page;    /* Hash of the text, names the page's rendered lines */
 };
 
 struct termios setup_term();
 void reset_term(struct termios oldt);
 int parse_input(char input, char *command);
-struct print_info print_text(char *buf, struct winsize ws,
-			     int start_line, bool gemini);
+size_t layout_update(struct layout *l, struct document *doc, struct winsize ws);
+void layout_invalidate(struct layout *l);
+void layout_free(struct layout *l);
+size_t layout_line_row(struct layout *l, struct document *doc, size_t line);
+struct print_info print_text(struct document *doc, struct layout *layout,
+			     struct winsize ws, int start_line, struct search *search);
+int line_at_offset(struct document *doc, struct layout *layout,
+		   size_t offset, struct winsize ws);
 void show_cursor(bool show);
-void free_info(struct print_info pinfo);
+
+#endif /* _TERM_H */
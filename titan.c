@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "titan.h"
+#include "tab.h"
+#include "url_parser.h"
+#include "config.h"
+#include "trace.h"
+#include "mem.h"
+
+/* Titan requests are "titan://HOST/PATH;size=N;mime=TYPE;token=T" and
+ * the N bytes of content right after the request line. The file is
+ * mapped and handed to mbedtls a chunk at a time, so it is never copied
+ * into memory and pages already sent are let go. */
+
+#define UPLOAD_CHUNK (1024*1024)
+
+static const struct
+{
+  const char *ext;
+  const char *mime;
+} mime_types[] =
+{
+  { "gmi", "text/gemini" },
+  { "gemini", "text/gemini" },
+  { "txt", "text/plain" },
+  { "md", "text/markdown" },
+  { "html", "text/html" },
+  { "css", "text/css" },
+  { "png", "image/png" },
+  { "jpg", "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "gif", "image/gif" },
+  { "webp", "image/webp" },
+  { "svg", "image/svg+xml" },
+  { "pdf", "application/pdf" },
+  { "zip", "application/zip" },
+  { "mp3", "audio/mpeg" },
+  { "ogg", "audio/ogg" },
+};
+
+/* By extension, NULL leaves it to the server, which assumes gemtext */
+static const char *guess_mime(const char *path)
+{
+  const char *base = strrchr(path, '/'), *ext;
+
+  if ((ext = strrchr(base != NULL ? base : path, '.')) == NULL)
+    return NULL;
+
+  for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++)
+    if (!strcasecmp(ext + 1, mime_types[i].ext))
+      return mime_types[i].mime;
+
+  return NULL;
+}
+
+/* Where the parameters start in the path, or its end */
+static const char *params_start(const char *url)
+{
+  const char *s = strstr(url, "://"), *path;
+
+  s = s != NULL ? s + 3 : url;
+  path = s + strcspn(s, "/");
+
+  return path + strcspn(path, ";");
+}
+
+int upload_open(struct upload *ul, const char *path)
+{
+  struct stat st;
+  void *map;
+
+  memset(ul, 0, sizeof(struct upload));
+  snprintf(ul->path, sizeof(ul->path), "%s", path);
+
+  if ((ul->fd = open(path, O_RDONLY)) < 0)
+    goto fail;
+  if (fstat(ul->fd, &st) < 0 || !S_ISREG(st.st_mode))
+  {
+    close(ul->fd);
+    goto fail;
+  }
+
+  ul->size = st.st_size;
+
+  /* Read in order, once */
+  if (ul->size > 0
+      && (map = mmap(NULL, ul->size, PROT_READ, MAP_PRIVATE, ul->fd, 0)) != MAP_FAILED)
+  {
+    madvise(map, ul->size, MADV_SEQUENTIAL);
+    ul->map = map;
+  }
+
+  return 0;
+
+ fail:
+  ul->fd = -1;
+  ul->failed = true;
+  return -1;
+}
+
+/* The request URL: url with the file's size, and its type when url has
+ * none. Other parameters, such as the token, are kept. */
+int titan_url(const char *url, struct upload *ul, char *out, size_t len)
+{
+  const char *params = params_start(url), *p, *end, *mime;
+  bool has_mime = false;
+  size_t used;
+
+  used = snprintf(out, len, "%.*s;size=%llu", (int) (params - url), url,
+		  (unsigned long long) ul->size);
+
+  for (p = params; *p == ';'; p = end)
+  {
+    p++;
+    end = p + strcspn(p, ";");
+
+    if (end == p || !strncmp(p, "size=", 5))
+      continue;
+    if (!strncmp(p, "mime=", 5))
+      has_mime = true;
+
+    used += snprintf(out + used, len > used ? len - used : 0, ";%.*s", (int) (end - p), p);
+  }
+
+  if (!has_mime && (mime = guess_mime(ul->path)) != NULL)
+    used += snprintf(out + used, len > used ? len - used : 0, ";mime=%s", mime);
+
+  return used < len ? 0 : -1;
+}
+
+/* Sends the file from its start. Without a mapping it is read into one
+ * chunk sized buffer instead. */
+int upload_send(mbedtls_ssl_context *ssl, struct upload *ul)
+{
+  uint64_t dropped = 0;
+  size_t len, have = 0, used = 0;
+  const char *data;
+  char *buf = NULL;
+  ssize_t got;
+  int ret;
+
+  __atomic_store_n(&ul->bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&ul->start, trace_now(), __ATOMIC_RELEASE);
+  __atomic_store_n(&ul->end, 0, __ATOMIC_RELAXED);
+
+  if (ul->map == NULL && ul->size > 0
+      && (buf = mem_malloc(MEM_RECV, UPLOAD_CHUNK)) == NULL)
+    goto fail;
+
+  while (ul->bytes < ul->size)
+  {
+    len = ul->size - ul->bytes < UPLOAD_CHUNK ? ul->size - ul->bytes : UPLOAD_CHUNK;
+
+    if (ul->map != NULL)
+      data = ul->map + ul->bytes;
+    else
+    {
+      if (used == have)
+      {
+	if ((got = pread(ul->fd, buf, len, ul->bytes)) <= 0)
+	  goto fail;
+	have = got;
+	used = 0;
+      }
+      data = buf + used;
+      len = have - used;
+    }
+
+    /* mbedtls cuts it into records, one write each */
+    ret = mbedtls_ssl_write(ssl, (const unsigned char *) data, len);
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+      continue;
+    if (ret <= 0)
+      goto fail;
+
+    used += ret;
+    __atomic_store_n(&ul->bytes, ul->bytes + ret, __ATOMIC_RELAXED);
+
+    /* Sent pages are not needed again, RSS stays flat */
+    while (ul->map != NULL && ul->bytes - dropped >= UPLOAD_CHUNK)
+    {
+      madvise(ul->map + dropped, UPLOAD_CHUNK, MADV_DONTNEED);
+      dropped += UPLOAD_CHUNK;
+    }
+  }
+
+  __atomic_store_n(&ul->end, trace_now(), __ATOMIC_RELEASE);
+  mem_free(buf);
+  return 0;
+
+ fail:
+  ul->failed = true;
+  __atomic_store_n(&ul->end, trace_now(), __ATOMIC_RELEASE);
+  mem_free(buf);
+  return -1;
+}
+
+/* Its progress is no longer shown either */
+void upload_close(struct upload *ul)
+{
+  __atomic_store_n(&ul->start, 0, __ATOMIC_RELEASE);
+  if (ul->map != NULL)
+    munmap(ul->map, ul->size);
+  if (ul->fd >= 0)
+    close(ul->fd);
+  ul->map = NULL;
+  ul->fd = -1;
+}
+
+/* Bytes per second */
+double upload_rate(struct upload *ul)
+{
+  uint64_t us = ul->end > ul->start ? ul->end - ul->start : 1;
+
+  return ul->bytes * 1e6 / us;
+}
+
+/* Progress while sending, the throughput once done */
+void upload_status(struct upload *ul, char *out, size_t len)
+{
+  uint64_t start = __atomic_load_n(&ul->start, __ATOMIC_ACQUIRE);
+  uint64_t end = __atomic_load_n(&ul->end, __ATOMIC_ACQUIRE);
+  uint64_t bytes = __atomic_load_n(&ul->bytes, __ATOMIC_RELAXED);
+  uint64_t us = start && trace_now() > start ? trace_now() - start : 1;
+
+  if (start == 0)
+    out[0] = 0;
+  else if (end == 0)
+    snprintf(out, len, "Uploading %s: %.1f of %.1f MiB, %.1f MiB/s", ul->path,
+	     bytes / 1048576.0, ul->size / 1048576.0, bytes * 1e6 / us / 1048576.0);
+  else if (ul->failed)
+    snprintf(out, len, "Upload of %s failed after %.1f MiB", ul->path, bytes / 1048576.0);
+  else
+    snprintf(out, len, "Uploaded %s, %.1f MiB at %.1f MiB/s", ul->path,
+	     bytes / 1048576.0, upload_rate(ul) / 1048576.0);
+}
+
+/* Redirects after an upload lead to what was uploaded, which is read
+ * over gemini:// without the parameters */
+void titan_view_url(char *url)
+{
+  char *params;
+
+  if (strncmp(url, "titan://", 8))
+    return;
+
+  params = (char *) params_start(url);
+  *params = 0;
+  memmove(url + 6, url + 5, strlen(url + 5) + 1);
+  memcpy(url, "gemini", 6);
+}
+
+static void send_upload(void *ctx, mbedtls_ssl_context *ssl)
+{
+  upload_send(ssl, ctx);
+}
+
+/* --upload: sends path to a titan:// URL, then prints the response
+ * header and the throughput */
+int upload_url(struct session *s, const char *path, const char *url)
+{
+  char normal[1025], request_line[1100], host[255], port[10], status[1200];
+  struct arena page = {0};
+  struct spill head = {0};
+  struct response *resp;
+  struct upload ul;
+  struct dial_hooks hooks = { .ctx = &ul, .sent = send_upload };
+  struct conn conn;
+  mbedtls_ssl_context ssl;
+  const char *phase;
+  int ret = 1, err;
+
+  if (upload_open(&ul, path) < 0)
+  {
+    perror(path);
+    return 1;
+  }
+
+  if (strncmp(url, "titan://", 8)
+      || url_normalize(url, normal, sizeof(normal)) < 0
+      || titan_url(normal, &ul, request_line, sizeof(request_line) - 2) < 0
+      || url_address(normal, host, sizeof(host), port, sizeof(port)) < 0)
+  {
+    fprintf(stderr, "Bad URL: %s\n", url);
+    goto close;
+  }
+  strcat(request_line, "\r\n");
+
+  /* Large files take as long as they take. A capsule refusing the
+   * upload may still say why. */
+  if ((err = dial(&conn, &ssl, s, host, port, 0, NULL, NULL, &phase)) != 0
+      || (err = fetch_header(&conn, &ssl, request_line, &hooks, &head, NULL, &phase)) != 0
+      || (resp = read_response_header(head.data, &page)) == NULL)
+  {
+    dial_error(status, sizeof(status), phase, err, host);
+    fprintf(stderr, "%s: %s\n", normal, status);
+  }
+  else
+  {
+    printf("%d %s\n", resp->status, resp->meta);
+    ret = !ul.failed && (resp->status / 10 == 2 || resp->status / 10 == 3) ? 0 : 1;
+  }
+  close_conn(&conn, &ssl);
+
+  upload_status(&ul, status, sizeof(status));
+  fprintf(stderr, "%s\n", status);
+
+ close:
+  spill_free(&head);
+  arena_free(&page);
+  upload_close(&ul);
+
+  return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef _TITAN_H
+#define _TITAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+/* A file sent as the content of a titan:// request */
+struct upload
+{
+  char path[1024];
+  int fd;
+  char *map;         /* The whole file, NULL when it could not be mapped */
+  uint64_t size;
+  uint64_t bytes;    /* Sent so far */
+  uint64_t start;    /* trace_now() */
+  uint64_t end;
+  bool failed;
+};
+
+int upload_open(struct upload *ul, const char *path);
+int titan_url(const char *url, struct upload *ul, char *out, size_t len);
+int upload_send(mbedtls_ssl_context *ssl, struct upload *ul);
+void upload_close(struct upload *ul);
+double upload_rate(struct upload *ul);
+void upload_status(struct upload *ul, char *out, size_t len);
+void titan_view_url(char *url);
+int upload_url(struct session *s, const char *path, const char *url);
+
+#endif /* _TITAN_H */
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "json.h"
+
+static const char *phase_names[PHASE_COUNT] =
+{
+  "connect",
+  "handshake",
+  "request",
+  "first_byte",
+  "header",
+  "body",
+  "paint",
+};
+
+static FILE *trace_fp = NULL;
+static bool trace_first_event = true;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Monotonic clock in microseconds */
+uint64_t trace_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_begin(struct trace *t, char *url)
+{
+  memset(t->marks, 0, sizeof(t->marks));
+  strncpy(t->url, url, sizeof(t->url)-1);
+  t->url[sizeof(t->url)-1] = 0;
+  t->start = trace_now();
+  t->active = true;
+}
+
+void trace_mark(struct trace *t, enum trace_phase phase)
+{
+  if (t != NULL && t->active && !t->marks[phase])
+    t->marks[phase] = trace_now();
+}
+
+/* Time spent in a phase, measured from the previous recorded boundary */
+static uint64_t phase_start(struct trace *t, enum trace_phase phase)
+{
+  for (int i = phase-1; i >= 0; i--)
+    if (t->marks[i])
+      return t->marks[i];
+  
+  return t->start;
+}
+
+uint64_t trace_phase_time(struct trace *t, enum trace_phase phase)
+{
+  if (!t->marks[phase])
+    return 0;
+  
+  return t->marks[phase] - phase_start(t, phase);
+}
+
+static void write_event(const char *name, uint64_t ts, uint64_t dur, char *url)
+{
+  if (!trace_first_event)
+    fputs(",\n", trace_fp);
+  trace_first_event = false;
+  
+  fprintf(trace_fp, "{\"name\":\"%s\",\"cat\":\"gemini\",\"ph\":\"X\","
+	  "\"ts\":%lu,\"dur\":%lu,\"pid\":%d,\"tid\":1",
+	  name, (unsigned long) ts, (unsigned long) dur, (int) getpid());
+  
+  if (url != NULL)
+  {
+    fputs(",\"args\":{\"url\":", trace_fp);
+    json_string(trace_fp, url, strlen(url));
+    fputs("}", trace_fp);
+  }
+  
+  fputs("}", trace_fp);
+}
+
+/* Finish a navigation and write it to the trace file */
+void trace_end(struct trace *t)
+{
+  uint64_t end = t->start;
+  
+  if (!t->active)
+    return;
+  t->active = false;
+  
+  /* Every tab fetches on its own thread */
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fp == NULL)
+  {
+    pthread_mutex_unlock(&trace_lock);
+    return;
+  }
+  
+  for (int i = 0; i < PHASE_COUNT; i++)
+  {
+    if (!t->marks[i])
+      continue;
+    
+    write_event(phase_names[i], phase_start(t, i), trace_phase_time(t, i), NULL);
+    end = t->marks[i];
+  }
+  
+  write_event("navigate", t->start, end - t->start, t->url);
+  fflush(trace_fp);
+  
+  pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_status(struct trace *t, char *out, size_t len)
+{
+  int n = 0;
+  
+  out[0] = 0;
+  
+  for (int i = 0; i < PHASE_COUNT && (size_t) n < len; i++)
+    if (t->marks[i])
+      n += snprintf(out+n, len-n, "%s %.1fms  ", phase_names[i],
+		    trace_phase_time(t, i) / 1000.0);
+}
+
+/* Chrome trace-event JSON, loadable in chrome://tracing or Perfetto */
+void trace_open(char *path)
+{
+  if (path[0] == 0)
+    return;
+  
+  if ((trace_fp = fopen(path, "w")) != NULL)
+    fputs("[\n", trace_fp);
+}
+
+void trace_close()
+{
+  if (trace_fp == NULL)
+    return;
+  
+  pthread_mutex_lock(&trace_lock);
+  fputs("\n]\n", trace_fp);
+  fclose(trace_fp);
+  trace_fp = NULL;
+  pthread_mutex_unlock(&trace_lock);
+}
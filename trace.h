@@ -0,0 +1,37 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+enum trace_phase
+{
+  PHASE_CONNECT,     /* DNS + TCP, open_conn(), the last attempt on retries */
+  PHASE_HANDSHAKE,   /* config(), check_cert(), handshake() */
+  PHASE_REQUEST,     /* request() */
+  PHASE_FIRST_BYTE,  /* First byte of read_response() */
+  PHASE_HEADER,      /* read_header(), read_response_header() */
+  PHASE_BODY,        /* End of body or download */
+  PHASE_PAINT,       /* First print_text() */
+  PHASE_COUNT,
+};
+
+struct trace
+{
+  uint64_t start;
+  uint64_t marks[PHASE_COUNT];
+  char url[1025];
+  bool active;
+};
+
+uint64_t trace_now();
+void trace_begin(struct trace *t, char *url);
+void trace_mark(struct trace *t, enum trace_phase phase);
+uint64_t trace_phase_time(struct trace *t, enum trace_phase phase);
+void trace_end(struct trace *t);
+void trace_status(struct trace *t, char *out, size_t len);
+void trace_open(char *path);
+void trace_close();
+
+#endif /* _TRACE_H */
@@ -7,15 +7,22 @@
 
 #include "url_parser.h"
 
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
+#define URL_NONE    ((struct url_part){ 0, -1 })
+
 /*
  * Prototype declarations
  */
 static __inline__ int _is_scheme_char(int);
+static __inline__ int _is_unreserved(int);
+static __inline__ int _hex_value(int);
+static int _append(char *, size_t, size_t *, const char *, size_t);
+static int _append_pct(char *, size_t, size_t *, const char *, size_t, int);
+static size_t _remove_dot_segments(char *, size_t);
+static const char *_default_port(const struct url_view *);
 
 /*
  * Check whether the character is permitted in scheme string
@@ -23,299 +30,497 @@ static __inline__ int _is_scheme_char(int);
 static __inline__ int
 _is_scheme_char(int c)
 {
-    return (!isalpha(c) && '+' != c && '-' != c && '.' != c) ? 0 : 1;
+    return (!isalnum(c) && '+' != c && '-' != c && '.' != c) ? 0 : 1;
 }
 
 /*
- * See RFC 1738, 3986
+ * Unreserved characters never need percent-encoding (RFC 3986 2.3)
  */
-struct parsed_url *
-parse_url(const char *url)
+static __inline__ int
+_is_unreserved(int c)
+{
+    return (isalnum(c) || '-' == c || '.' == c || '_' == c || '~' == c) ? 1 : 0;
+}
+
+static __inline__ int
+_hex_value(int c)
 {
-    struct parsed_url *purl;
-    const char *tmpstr;
-    const char *curstr;
-    int len;
-    int i;
-    int userpass_flag;
-    int bracket_flag;
-
-    /* Allocate the parsed url storage */
-    purl = malloc(sizeof(struct parsed_url));
-    if ( NULL == purl ) {
-        return NULL;
+    if ( c >= '0' && c <= '9' ) {
+        return c - '0';
     }
-    purl->scheme = NULL;
-    purl->host = NULL;
-    purl->port = NULL;
-    purl->path = NULL;
-    purl->query = NULL;
-    purl->fragment = NULL;
-    purl->username = NULL;
-    purl->password = NULL;
+    c = tolower(c);
+    if ( c >= 'a' && c <= 'f' ) {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
 
-    curstr = url;
+/*
+ * See RFC 3986 3 and Appendix B.  Parses both absolute URLs and relative
+ * references; every component is a view into url.
+ */
+int
+url_parse(const char *url, size_t len, struct url_view *v)
+{
+    size_t i;
+    size_t start;
+    size_t end;
+    size_t host;
+    size_t colon;
+
+    v->buf = url;
+    v->scheme = URL_NONE;
+    v->authority = URL_NONE;
+    v->userinfo = URL_NONE;
+    v->host = URL_NONE;
+    v->port = URL_NONE;
+    v->path = URL_NONE;
+    v->query = URL_NONE;
+    v->fragment = URL_NONE;
 
     /*
-     * <scheme>:<scheme-specific-part>
-     * <scheme> := [a-z\+\-\.]+
-     *             upper case = lower case for resiliency
+     * <scheme> := ALPHA *( ALPHA / DIGIT / "+" / "-" / "." )
      */
-    /* Read scheme */
-    tmpstr = strchr(curstr, ':');
-    if ( NULL == tmpstr ) {
-        /* Not found the character */
-        parsed_url_free(purl);
-        return NULL;
-    }
-    /* Get the scheme length */
-    len = tmpstr - curstr;
-    /* Check restrictions */
-    for ( i = 0; i < len; i++ ) {
-        if ( !_is_scheme_char(curstr[i]) ) {
-            /* Invalid format */
-            parsed_url_free(purl);
-            return NULL;
+    i = 0;
+    if ( len > 0 && isalpha((unsigned char)url[0]) ) {
+        for ( i = 1; i < len && _is_scheme_char((unsigned char)url[i]); i++ ) {
+            ;
+        }
+        if ( i < len && ':' == url[i] ) {
+            v->scheme.off = 0;
+            v->scheme.len = i;
+            i++;
+        } else {
+            /* First path segment of a relative reference */
+            i = 0;
         }
     }
-    /* Copy the scheme to the storage */
-    purl->scheme = malloc(sizeof(char) * (len + 1));
-    if ( NULL == purl->scheme ) {
-        parsed_url_free(purl);
-        return NULL;
-    }
-    (void)strncpy(purl->scheme, curstr, len);
-    purl->scheme[len] = '\0';
-    /* Make the character to lower if it is upper case. */
-    for ( i = 0; i < len; i++ ) {
-        purl->scheme[i] = tolower(purl->scheme[i]);
-    }
-    /* Skip ':' */
-    tmpstr++;
-    curstr = tmpstr;
 
     /*
-     * //<user>:<password>@<host>:<port>/<url-path>
-     * Any ":", "@" and "/" must be encoded.
+     * //<userinfo>@<host>:<port>
      */
-    /* Eat "//" */
-    for ( i = 0; i < 2; i++ ) {
-        if ( '/' != *curstr ) {
-            parsed_url_free(purl);
-            return NULL;
+    if ( i + 1 < len && '/' == url[i] && '/' == url[i + 1] ) {
+        i += 2;
+        start = i;
+        while ( i < len && '/' != url[i] && '?' != url[i] && '#' != url[i] ) {
+            i++;
         }
-        curstr++;
-    }
-
-    /* Check if the user (and password) are specified. */
-    userpass_flag = 0;
-    tmpstr = curstr;
-    while ( '\0' != *tmpstr ) {
-        if ( '@' == *tmpstr ) {
-            /* Username and password are specified */
-            userpass_flag = 1;
-            break;
-        } else if ( '/' == *tmpstr ) {
-            /* End of <host>:<port> specification */
-            userpass_flag = 0;
-            break;
-        }
-        tmpstr++;
-    }
+        end = i;
+        v->authority.off = start;
+        v->authority.len = end - start;
 
-    /* User and password specification */
-    tmpstr = curstr;
-    if ( userpass_flag ) {
-        /* Read username */
-        while ( '\0' != *tmpstr && ':' != *tmpstr && '@' != *tmpstr ) {
-            tmpstr++;
+        /* The last '@' ends the userinfo */
+        host = start;
+        for ( i = start; i < end; i++ ) {
+            if ( '@' == url[i] ) {
+                host = i + 1;
+            }
         }
-        len = tmpstr - curstr;
-        purl->username = malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->username ) {
-            parsed_url_free(purl);
-            return NULL;
+        if ( host != start ) {
+            v->userinfo.off = start;
+            v->userinfo.len = host - 1 - start;
         }
-        (void)strncpy(purl->username, curstr, len);
-        purl->username[len] = '\0';
-        /* Proceed current pointer */
-        curstr = tmpstr;
-        if ( ':' == *curstr ) {
-            /* Skip ':' */
-            curstr++;
-            /* Read password */
-            tmpstr = curstr;
-            while ( '\0' != *tmpstr && '@' != *tmpstr ) {
-                tmpstr++;
+
+        /* IPv6 literals keep their brackets */
+        colon = end;
+        if ( host < end && '[' == url[host] ) {
+            for ( i = host; i < end && ']' != url[i]; i++ ) {
+                ;
+            }
+            if ( i == end ) {
+                /* Invalid format */
+                return -1;
+            }
+            if ( i + 1 < end ) {
+                if ( ':' != url[i + 1] ) {
+                    return -1;
+                }
+                colon = i + 1;
             }
-            len = tmpstr - curstr;
-            purl->password = malloc(sizeof(char) * (len + 1));
-            if ( NULL == purl->password ) {
-                parsed_url_free(purl);
-                return NULL;
+        } else {
+            for ( i = host; i < end; i++ ) {
+                if ( ':' == url[i] ) {
+                    colon = i;
+                }
             }
-            (void)strncpy(purl->password, curstr, len);
-            purl->password[len] = '\0';
-            curstr = tmpstr;
         }
-        /* Skip '@' */
-        if ( '@' != *curstr ) {
-            parsed_url_free(purl);
-            return NULL;
+        v->host.off = host;
+        v->host.len = colon - host;
+
+        if ( colon < end ) {
+            v->port.off = colon + 1;
+            v->port.len = end - colon - 1;
+            for ( i = colon + 1; i < end; i++ ) {
+                if ( !isdigit((unsigned char)url[i]) ) {
+                    return -1;
+                }
+            }
         }
-        curstr++;
+        i = end;
     }
 
-    if ( '[' == *curstr ) {
-        bracket_flag = 1;
-    } else {
-        bracket_flag = 0;
+    /* Parse path */
+    start = i;
+    while ( i < len && '?' != url[i] && '#' != url[i] ) {
+        i++;
     }
-    /* Proceed on by delimiters with reading host */
-    tmpstr = curstr;
-    while ( '\0' != *tmpstr ) {
-        if ( bracket_flag && ']' == *tmpstr ) {
-            /* End of IPv6 address. */
-            tmpstr++;
-            break;
-        } else if ( !bracket_flag && (':' == *tmpstr || '/' == *tmpstr) ) {
-            /* Port number is specified. */
-            break;
+    v->path.off = start;
+    v->path.len = i - start;
+
+    /* Is query specified? */
+    if ( i < len && '?' == url[i] ) {
+        start = ++i;
+        while ( i < len && '#' != url[i] ) {
+            i++;
         }
-        tmpstr++;
+        v->query.off = start;
+        v->query.len = i - start;
+    }
+
+    /* Is fragment specified? */
+    if ( i < len && '#' == url[i] ) {
+        v->fragment.off = i + 1;
+        v->fragment.len = len - i - 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy a component out as a C string, returns its length or -1
+ */
+int
+url_part_copy(const struct url_view *v, struct url_part part, char *out, size_t outlen)
+{
+    if ( !URL_HAS(part) || (size_t)part.len >= outlen ) {
+        return -1;
     }
-    len = tmpstr - curstr;
-    purl->host = malloc(sizeof(char) * (len + 1));
-    if ( NULL == purl->host || len <= 0 ) {
-        parsed_url_free(purl);
-        return NULL;
+    memcpy(out, v->buf + part.off, part.len);
+    out[part.len] = '\0';
+
+    return part.len;
+}
+
+static int
+_append(char *out, size_t outlen, size_t *pos, const char *s, size_t len)
+{
+    if ( *pos + len >= outlen ) {
+        return -1;
     }
-    (void)strncpy(purl->host, curstr, len);
-    purl->host[len] = '\0';
-    curstr = tmpstr;
-
-    /* Is port number specified? */
-    if ( ':' == *curstr ) {
-        curstr++;
-        /* Read port number */
-        tmpstr = curstr;
-        while ( '\0' != *tmpstr && '/' != *tmpstr ) {
-            tmpstr++;
+    memmove(out + *pos, s, len);
+    *pos += len;
+    out[*pos] = '\0';
+
+    return 0;
+}
+
+/*
+ * Append with percent-encodings normalized (RFC 3986 6.2.2.1, 6.2.2.2):
+ * unreserved characters are decoded, the rest get upper case hex digits.
+ * lower also folds the component to lower case (scheme and host).
+ */
+static int
+_append_pct(char *out, size_t outlen, size_t *pos, const char *s, size_t len, int lower)
+{
+    size_t i;
+    int hi;
+    int lo;
+    char c;
+
+    for ( i = 0; i < len; i++ ) {
+        c = s[i];
+        if ( '%' == c && i + 2 < len
+             && (hi = _hex_value((unsigned char)s[i + 1])) >= 0
+             && (lo = _hex_value((unsigned char)s[i + 2])) >= 0 ) {
+            c = (char)(hi * 16 + lo);
+            i += 2;
+            if ( !_is_unreserved((unsigned char)c) ) {
+                if ( *pos + 3 >= outlen ) {
+                    return -1;
+                }
+                out[(*pos)++] = '%';
+                out[(*pos)++] = "0123456789ABCDEF"[hi];
+                out[(*pos)++] = "0123456789ABCDEF"[lo];
+                continue;
+            }
+        }
+        if ( lower ) {
+            c = tolower((unsigned char)c);
         }
-        len = tmpstr - curstr;
-        purl->port = malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->port ) {
-            parsed_url_free(purl);
-            return NULL;
+        if ( *pos + 1 >= outlen ) {
+            return -1;
         }
-        (void)strncpy(purl->port, curstr, len);
-        purl->port[len] = '\0';
-        curstr = tmpstr;
+        out[(*pos)++] = c;
     }
+    out[*pos] = '\0';
 
-    /* End of the string */
-    if ( '\0' == *curstr ) {
-        return purl;
+    return 0;
+}
+
+/*
+ * RFC 3986 5.2.4, in place.  The output never runs ahead of the input, so
+ * path can be both.  Returns the new length.
+ */
+static size_t
+_remove_dot_segments(char *path, size_t len)
+{
+    size_t i;
+    size_t o;
+    int slash;
+
+    i = 0;
+    o = 0;
+    /* Set when a '/' has been taken from the input but not written yet */
+    slash = 0;
+    while ( i < len || slash ) {
+        const char *p = path + i;
+        size_t n = len - i;
+
+        if ( !slash ) {
+            if ( n >= 3 && !strncmp(p, "../", 3) ) {
+                /* A */
+                i += 3;
+                continue;
+            } else if ( n >= 2 && !strncmp(p, "./", 2) ) {
+                i += 2;
+                continue;
+            } else if ( (1 == n && '.' == p[0])
+                        || (2 == n && '.' == p[0] && '.' == p[1]) ) {
+                /* D */
+                i = len;
+                continue;
+            } else if ( '/' == p[0] ) {
+                slash = 1;
+                i++;
+                continue;
+            }
+        } else {
+            if ( (n >= 2 && '.' == p[0] && '/' == p[1]) || (1 == n && '.' == p[0]) ) {
+                /* B: "/./" and "/." become "/" */
+                i += (n >= 2) ? 2 : 1;
+                continue;
+            } else if ( (n >= 3 && !strncmp(p, "../", 3)) || (2 == n && !strncmp(p, "..", 2)) ) {
+                /* C: also drop the last output segment */
+                i += (n >= 3) ? 3 : 2;
+                while ( o > 0 && '/' != path[o - 1] ) {
+                    o--;
+                }
+                if ( o > 0 ) {
+                    o--;
+                }
+                continue;
+            }
+            path[o++] = '/';
+            slash = 0;
+        }
+
+        /* E: move the first segment to the output */
+        while ( i < len && '/' != path[i] ) {
+            path[o++] = path[i++];
+        }
+    }
+    path[o] = '\0';
+
+    return o;
+}
+
+/*
+ * Ports that are implied by the scheme and dropped when normalizing
+ */
+static const char *
+_default_port(const struct url_view *v)
+{
+    static const struct {
+        const char *scheme;
+        const char *port;
+    } ports[] = {
+        { "gemini", "1965" },
+        { "titan", "1965" },
+    };
+    size_t i;
+
+    for ( i = 0; i < sizeof(ports) / sizeof(ports[0]); i++ ) {
+        if ( (size_t)v->scheme.len == strlen(ports[i].scheme)
+             && !strncasecmp(v->buf + v->scheme.off, ports[i].scheme, v->scheme.len) ) {
+            return ports[i].port;
+        }
     }
 
-    /* Skip '/' */
-    if ( '/' != *curstr ) {
-        parsed_url_free(purl);
-        return NULL;
+    return NULL;
+}
+
+/*
+ * RFC 3986 5.2.2: resolve ref against the absolute URL base into out.
+ * Returns the length of the result or -1.
+ */
+int
+url_resolve(const char *base, const char *ref, char *out, size_t outlen)
+{
+    struct url_view b;
+    struct url_view r;
+    const struct url_view *auth;
+    const char *query;
+    int query_len;
+    size_t pos;
+    size_t path;
+    size_t i;
+
+    if ( url_parse(base, strlen(base), &b) < 0 || !URL_HAS(b.scheme)
+         || url_parse(ref, strlen(ref), &r) < 0 || 0 == outlen ) {
+        return -1;
     }
-    curstr++;
+    out[0] = '\0';
+    pos = 0;
 
-    /* Parse path */
-    tmpstr = curstr;
-    while ( '\0' != *tmpstr && '#' != *tmpstr  && '?' != *tmpstr ) {
-        tmpstr++;
+    /* Scheme */
+    if ( URL_HAS(r.scheme) ) {
+        if ( _append(out, outlen, &pos, ref + r.scheme.off, r.scheme.len) < 0 ) {
+            return -1;
+        }
+    } else if ( _append(out, outlen, &pos, base + b.scheme.off, b.scheme.len) < 0 ) {
+        return -1;
     }
-    len = tmpstr - curstr;
-    purl->path = malloc(sizeof(char) * (len + 1));
-    if ( NULL == purl->path ) {
-        parsed_url_free(purl);
-        return NULL;
+    if ( _append(out, outlen, &pos, ":", 1) < 0 ) {
+        return -1;
     }
-    (void)strncpy(purl->path, curstr, len);
-    purl->path[len] = '\0';
-    curstr = tmpstr;
 
-    /* Is query specified? */
-    if ( '?' == *curstr ) {
-        /* Skip '?' */
-        curstr++;
-        /* Read query */
-        tmpstr = curstr;
-        while ( '\0' != *tmpstr && '#' != *tmpstr ) {
-            tmpstr++;
+    /* Authority */
+    auth = (URL_HAS(r.scheme) || URL_HAS(r.authority)) ? &r : &b;
+    if ( URL_HAS(auth->authority) ) {
+        if ( _append(out, outlen, &pos, "//", 2) < 0
+             || _append(out, outlen, &pos, auth->buf + auth->authority.off,
+                        auth->authority.len) < 0 ) {
+            return -1;
+        }
+    }
+
+    /* Path and query */
+    path = pos;
+    query = ref + r.query.off;
+    query_len = r.query.len;
+    if ( auth == &r || (r.path.len > 0 && '/' == ref[r.path.off]) ) {
+        if ( _append(out, outlen, &pos, ref + r.path.off, r.path.len) < 0 ) {
+            return -1;
+        }
+    } else if ( 0 == r.path.len ) {
+        if ( _append(out, outlen, &pos, base + b.path.off, b.path.len) < 0 ) {
+            return -1;
+        }
+        if ( !URL_HAS(r.query) ) {
+            query = base + b.query.off;
+            query_len = b.query.len;
+        }
+    } else {
+        /* Merge (5.2.3) */
+        if ( URL_HAS(b.authority) && 0 == b.path.len ) {
+            if ( _append(out, outlen, &pos, "/", 1) < 0 ) {
+                return -1;
+            }
+        } else {
+            for ( i = b.path.len; i > 0 && '/' != base[b.path.off + i - 1]; i-- ) {
+                ;
+            }
+            if ( _append(out, outlen, &pos, base + b.path.off, i) < 0 ) {
+                return -1;
+            }
         }
-        len = tmpstr - curstr;
-        purl->query = malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->query ) {
-            parsed_url_free(purl);
-            return NULL;
+        if ( _append(out, outlen, &pos, ref + r.path.off, r.path.len) < 0 ) {
+            return -1;
         }
-        (void)strncpy(purl->query, curstr, len);
-        purl->query[len] = '\0';
-        curstr = tmpstr;
     }
+    pos = path + _remove_dot_segments(out + path, pos - path);
 
-    /* Is fragment specified? */
-    if ( '#' == *curstr ) {
-        /* Skip '#' */
-        curstr++;
-        /* Read fragment */
-        tmpstr = curstr;
-        while ( '\0' != *tmpstr ) {
-            tmpstr++;
+    if ( query_len >= 0 ) {
+        if ( _append(out, outlen, &pos, "?", 1) < 0
+             || _append(out, outlen, &pos, query, query_len) < 0 ) {
+            return -1;
         }
-        len = tmpstr - curstr;
-        purl->fragment = malloc(sizeof(char) * (len + 1));
-        if ( NULL == purl->fragment ) {
-            parsed_url_free(purl);
-            return NULL;
+    }
+
+    /* Fragment always comes from the reference */
+    if ( URL_HAS(r.fragment) ) {
+        if ( _append(out, outlen, &pos, "#", 1) < 0
+             || _append(out, outlen, &pos, ref + r.fragment.off, r.fragment.len) < 0 ) {
+            return -1;
         }
-        (void)strncpy(purl->fragment, curstr, len);
-        purl->fragment[len] = '\0';
-        curstr = tmpstr;
     }
 
-    return purl;
+    return pos;
 }
 
 /*
- * Free memory of parsed url
+ * RFC 3986 6.2.2 syntax-based normalization of an absolute URL: case,
+ * percent-encoding, dot segments, default port and empty path.  Equal
+ * resources normalize to equal strings, so the result can be used as a
+ * cache key.  Returns the length of the result or -1.
  */
-void
-parsed_url_free(struct parsed_url *purl)
+int
+url_normalize(const char *url, char *out, size_t outlen)
 {
-    if ( NULL != purl ) {
-        if ( NULL != purl->scheme ) {
-            free(purl->scheme);
-        }
-        if ( NULL != purl->host ) {
-            free(purl->host);
+    struct url_view v;
+    const char *port;
+    size_t pos;
+    size_t path;
+
+    if ( url_parse(url, strlen(url), &v) < 0 || !URL_HAS(v.scheme) || 0 == outlen ) {
+        return -1;
+    }
+    out[0] = '\0';
+    pos = 0;
+
+    if ( _append_pct(out, outlen, &pos, url + v.scheme.off, v.scheme.len, 1) < 0
+         || _append(out, outlen, &pos, ":", 1) < 0 ) {
+        return -1;
+    }
+
+    if ( URL_HAS(v.authority) ) {
+        if ( _append(out, outlen, &pos, "//", 2) < 0 ) {
+            return -1;
         }
-        if ( NULL != purl->port ) {
-            free(purl->port);
+        if ( URL_HAS(v.userinfo) ) {
+            if ( _append_pct(out, outlen, &pos, url + v.userinfo.off, v.userinfo.len, 0) < 0
+                 || _append(out, outlen, &pos, "@", 1) < 0 ) {
+                return -1;
+            }
         }
-        if ( NULL != purl->path ) {
-            free(purl->path);
+        if ( _append_pct(out, outlen, &pos, url + v.host.off, v.host.len, 1) < 0 ) {
+            return -1;
         }
-        if ( NULL != purl->query ) {
-            free(purl->query);
+        port = _default_port(&v);
+        if ( v.port.len > 0
+             && (NULL == port || (size_t)v.port.len != strlen(port)
+                 || strncmp(url + v.port.off, port, v.port.len)) ) {
+            if ( _append(out, outlen, &pos, ":", 1) < 0
+                 || _append(out, outlen, &pos, url + v.port.off, v.port.len) < 0 ) {
+                return -1;
+            }
         }
-        if ( NULL != purl->fragment ) {
-            free(purl->fragment);
+    }
+
+    path = pos;
+    if ( URL_HAS(v.authority) && 0 == v.path.len ) {
+        if ( _append(out, outlen, &pos, "/", 1) < 0 ) {
+            return -1;
         }
-        if ( NULL != purl->username ) {
-            free(purl->username);
+    } else if ( _append_pct(out, outlen, &pos, url + v.path.off, v.path.len, 0) < 0 ) {
+        return -1;
+    }
+    pos = path + _remove_dot_segments(out + path, pos - path);
+
+    if ( URL_HAS(v.query) ) {
+        if ( _append(out, outlen, &pos, "?", 1) < 0
+             || _append_pct(out, outlen, &pos, url + v.query.off, v.query.len, 0) < 0 ) {
+            return -1;
         }
-        if ( NULL != purl->password ) {
-            free(purl->password);
+    }
+    if ( URL_HAS(v.fragment) ) {
+        if ( _append(out, outlen, &pos, "#", 1) < 0
+             || _append_pct(out, outlen, &pos, url + v.fragment.off, v.fragment.len, 0) < 0 ) {
+            return -1;
         }
-        free(purl);
     }
+
+    return pos;
 }
 
 /*
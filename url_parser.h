@@ -8,18 +8,33 @@
 #ifndef _URL_PARSER_H
 #define _URL_PARSER_H
 
+#include <stddef.h>
+
+/*
+ * A component of a URL, as an offset/length view into the parsed string.
+ * len is -1 when the component is absent, which is different from empty
+ * ("gemini://host/?" has an empty query, "gemini://host/" has none).
+ */
+struct url_part {
+    int off;
+    int len;
+};
+
+#define URL_HAS(part)   ((part).len >= 0)
+
 /*
- * URL storage
+ * URL views, nothing is copied or allocated
  */
-struct parsed_url {
-    char *scheme;               /* mandatory */
-    char *host;                 /* mandatory */
-    char *port;                 /* optional */
-    char *path;                 /* optional */
-    char *query;                /* optional */
-    char *fragment;             /* optional */
-    char *username;             /* optional */
-    char *password;             /* optional */
+struct url_view {
+    const char *buf;
+    struct url_part scheme;     /* optional in relative references */
+    struct url_part authority;  /* optional, userinfo, host and port */
+    struct url_part userinfo;   /* optional */
+    struct url_part host;       /* present when there is an authority */
+    struct url_part port;       /* optional */
+    struct url_part path;       /* always present, may be empty */
+    struct url_part query;      /* optional */
+    struct url_part fragment;   /* optional */
 };
 
 #ifdef __cplusplus
@@ -29,8 +44,10 @@ extern "C" {
     /*
      * Declaration of function prototypes
      */
-    struct parsed_url * parse_url(const char *);
-    void parsed_url_free(struct parsed_url *);
+    int url_parse(const char *, size_t, struct url_view *);
+    int url_part_copy(const struct url_view *, struct url_part, char *, size_t);
+    int url_resolve(const char *, const char *, char *, size_t);
+    int url_normalize(const char *, char *, size_t);
 
 #ifdef __cplusplus
 }
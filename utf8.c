@@ -0,0 +1,267 @@
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "utf8.h"
+
+struct range
+{
+  uint32_t first;
+  uint32_t last;
+};
+
+/* Combining marks, zero width spaces/joiners, variation selectors */
+static const struct range zero_width[] =
+{
+  { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF },
+  { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A },
+  { 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+  { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 }, { 0x0730, 0x074A },
+  { 0x07A6, 0x07B0 }, { 0x0900, 0x0902 }, { 0x093A, 0x093A }, { 0x093C, 0x093C },
+  { 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 },
+  { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1160, 0x11FF },
+  { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E },
+  { 0x2060, 0x2064 }, { 0x20D0, 0x20FF }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+  { 0xFEFF, 0xFEFF }, { 0x1F3FB, 0x1F3FF }, { 0xE0000, 0xE0FFF },
+};
+
+/* East Asian Wide and Fullwidth, and emoji presentation */
+static const struct range wide[] =
+{
+  { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+  { 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+  { 0x2648, 0x2653 }, { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+  { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE },
+  { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+  { 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+  { 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 },
+  { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF },
+  { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x303E },
+  { 0x3041, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+  { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 },
+  { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE4 },
+  { 0x17000, 0x18AFF }, { 0x1B000, 0x1B2FF }, { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF },
+  { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F202 }, { 0x1F210, 0x1F23B },
+  { 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 }, { 0x1F260, 0x1F265 }, { 0x1F300, 0x1F320 },
+  { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C }, { 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA },
+  { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 }, { 0x1F3F8, 0x1F3FA },
+  { 0x1F400, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC }, { 0x1F4FF, 0x1F53D },
+  { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 },
+  { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F }, { 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC },
+  { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6D7 }, { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC },
+  { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF },
+  { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+static bool in_table(uint32_t cp, const struct range *table, size_t len)
+{
+  size_t lo = 0, hi = len;
+
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+
+    if (cp > table[mid].last)
+      lo = mid + 1;
+    else if (cp < table[mid].first)
+      hi = mid;
+    else
+      return true;
+  }
+
+  return false;
+}
+
+typedef size_t (*ascii_fn)(const char *s, size_t len);
+
+static size_t ascii_scalar(const char *s, size_t len)
+{
+  size_t i = 0;
+
+  while (i < len && !(s[i] & 0x80))
+    i++;
+
+  return i;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t ascii_sse2(const char *s, size_t len)
+{
+  size_t i;
+  unsigned mask;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    if ((mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i)))))
+      return i + __builtin_ctz(mask);
+
+  return i + ascii_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_avx2(const char *s, size_t len)
+{
+  size_t i;
+  unsigned mask;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    if ((mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (s + i)))))
+      return i + __builtin_ctz(mask);
+
+  return i + ascii_scalar(s + i, len - i);
+}
+#endif
+
+static size_t ascii_choose(const char *s, size_t len);
+
+static ascii_fn ascii_impl = ascii_choose;
+
+static size_t ascii_choose(const char *s, size_t len)
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    ascii_impl = ascii_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    ascii_impl = ascii_sse2;
+  else
+#endif
+    ascii_impl = ascii_scalar;
+
+  return ascii_impl(s, len);
+}
+
+/* Number of leading ASCII bytes, checked 16/32 at a time */
+size_t ascii_prefix(const char *s, size_t len)
+{
+  return ascii_impl(s, len);
+}
+
+/* Decode one character. Invalid sequences decode to U+FFFD and consume
+ * one byte. Returns the number of bytes used. */
+int utf8_decode(const char *s, size_t len, uint32_t *cp)
+{
+  const unsigned char *u = (const unsigned char *) s;
+  uint32_t c;
+  int n, i;
+
+  if (u[0] < 0x80)
+  {
+    *cp = u[0];
+    return 1;
+  }
+  else if ((u[0] & 0xE0) == 0xC0)
+  {
+    c = u[0] & 0x1F;
+    n = 2;
+  }
+  else if ((u[0] & 0xF0) == 0xE0)
+  {
+    c = u[0] & 0x0F;
+    n = 3;
+  }
+  else if ((u[0] & 0xF8) == 0xF0)
+  {
+    c = u[0] & 0x07;
+    n = 4;
+  }
+  else
+    goto invalid;
+
+  if ((size_t) n > len)
+    goto invalid;
+
+  for (i = 1; i < n; i++)
+  {
+    if ((u[i] & 0xC0) != 0x80)
+      goto invalid;
+    c = c << 6 | (u[i] & 0x3F);
+  }
+
+  /* Overlong, surrogates, out of range */
+  if ((n == 2 && c < 0x80) || (n == 3 && c < 0x800) || (n == 4 && c < 0x10000)
+      || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+    goto invalid;
+
+  *cp = c;
+  return n;
+
+invalid:
+  *cp = 0xFFFD;
+  return 1;
+}
+
+int codepoint_width(uint32_t cp)
+{
+  if (cp < 0x300)
+    return 1;
+  if (in_table(cp, zero_width, sizeof(zero_width) / sizeof(zero_width[0])))
+    return 0;
+  if (in_table(cp, wide, sizeof(wide) / sizeof(wide[0])))
+    return 2;
+
+  return 1;
+}
+
+/* Display width in columns */
+size_t utf8_width(const char *s, size_t len)
+{
+  size_t i = 0, width = 0, run;
+  uint32_t cp;
+
+  while (i < len)
+  {
+    run = ascii_prefix(s + i, len - i);
+    i += run;
+    width += run;
+
+    if (i < len)
+    {
+      i += utf8_decode(s + i, len - i, &cp);
+      width += codepoint_width(cp);
+    }
+  }
+
+  return width;
+}
+
+/* How many bytes of s fit in cols columns without splitting a character.
+ * Zero width characters stay with the character before them. */
+size_t utf8_fit(const char *s, size_t len, size_t cols, size_t *width)
+{
+  size_t i = 0, w = 0, run;
+  uint32_t cp;
+  int n, cw;
+
+  while (i < len)
+  {
+    if (w < cols)
+    {
+      run = ascii_prefix(s + i, len - i < cols - w ? len - i : cols - w);
+      i += run;
+      w += run;
+
+      if (i == len)
+	break;
+    }
+
+    if (!(s[i] & 0x80))
+      break;
+
+    n = utf8_decode(s + i, len - i, &cp);
+    cw = codepoint_width(cp);
+
+    if (w + cw > cols)
+      break;
+
+    i += n;
+    w += cw;
+  }
+
+  *width = w;
+  return i;
+}
@@ -0,0 +1,13 @@
+#ifndef _UTF8_H
+#define _UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t ascii_prefix(const char *s, size_t len);
+int utf8_decode(const char *s, size_t len, uint32_t *cp);
+int codepoint_width(uint32_t cp);
+size_t utf8_width(const char *s, size_t len);
+size_t utf8_fit(const char *s, size_t len, size_t cols, size_t *width);
+
+#endif /* _UTF8_H */